@@ -17,6 +17,7 @@
 #include <string.h>
 
 #include <atomic>
+#include <cassert>
 
 namespace DB
 {
@@ -13,12 +13,27 @@
 #include <cstring>
 #include <typeinfo>
 #include <typeindex>
+#include <limits>
+#include <memory>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <thread>
 
 #include "Hash.h"
+#include "HashBatch.h"
+#include "HashBits.h"
 #include "HashMap.h"
 #include "Arena.h"
 #include "Stopwatch.h"
 #include "Column.h"
+#include "JoinKind.h"
+#include "JoinOutput.h"
+#include "CacheControl.h"
+#include "Dataset.h"
+#include "Options.h"
+#include "Topology.h"
+#include "WorkStealing.h"
 
 template<size_t payload>
 struct Value
@@ -50,18 +65,97 @@ bool compare(std::vector<KeyValue<payload>> v1, std::vector<KeyValue<payload>> v
     return true;
 }
 
+/// The first 8 bytes of the payload, read as the timestamp of a row by the residual conditions.
+template<size_t payload>
+UInt64 payloadTimestamp(const KeyValue<payload> & row)
+{
+    static_assert(payload >= sizeof(UInt64), "a timestamp needs a payload of at least 8 bytes");
+    UInt64 ts;
+    memcpy(&ts, row.value.p, sizeof(ts));
+    return ts;
+}
+
+/** Residual (non-equi) join conditions. The probe loops evaluate them on every pair of rows with equal keys,
+  *  before the pair is counted or output, and the compiler inlines them into the chain walk.
+  * NoResidual is the plain equi-join and compiles away.
+  */
+struct NoResidual
+{
+    template<typename Build, typename Probe>
+    constexpr bool operator()(const Build &, const Probe &) const { return true; }
+};
+
+/// build.ts < probe.ts
+struct TimestampLess
+{
+    template<size_t build_payload, size_t probe_payload>
+    bool operator()(const KeyValue<build_payload> & build, const KeyValue<probe_payload> & probe) const
+    {
+        return payloadTimestamp(build) < payloadTimestamp(probe);
+    }
+};
+
+/** Build timestamps are uniform in [0, 10000) and every probe timestamp is 100 * selectivity,
+  *  so that TimestampLess passes `selectivity` percent of the pairs with equal keys.
+  */
 template<size_t build_payload, size_t probe_payload>
-std::tuple<std::vector<KeyValue<build_payload>>, std::vector<KeyValue<probe_payload>>> init(size_t build_size, size_t probe_size, size_t match_possibility)
+void setTimestamps(std::vector<KeyValue<build_payload>> & build_kv, std::vector<KeyValue<probe_payload>> & probe_kv, size_t selectivity, UInt64 seed)
+{
+    std::mt19937_64 mt(seed ? seed : std::random_device()());
+    for (auto & row : build_kv)
+    {
+        UInt64 ts = mt() % 10000;
+        memcpy(row.value.p, &ts, sizeof(ts));
+    }
+    UInt64 ts = selectivity * 100;
+    for (auto & row : probe_kv)
+        memcpy(row.value.p, &ts, sizeof(ts));
+}
+
+/// Ranks in [0, n) with P(k) proportional to 1 / (k + 1)^theta, by a binary search in the CDF.
+class ZipfDistribution
+{
+public:
+    ZipfDistribution(size_t n, double theta)
+        : cdf(n)
+    {
+        double sum = 0;
+        for (size_t k = 0; k < n; ++k)
+        {
+            sum += 1.0 / std::pow(static_cast<double>(k + 1), theta);
+            cdf[k] = sum;
+        }
+        for (auto & c : cdf)
+            c /= sum;
+    }
+
+    template<typename Generator>
+    size_t operator()(Generator & generator)
+    {
+        double u = std::uniform_real_distribution<double>()(generator);
+        return std::min<size_t>(std::lower_bound(cdf.begin(), cdf.end(), u) - cdf.begin(), cdf.size() - 1);
+    }
+
+private:
+    std::vector<double> cdf;
+};
+
+/** build_size random keys and probe_size probe keys, of which match_possibility percent are build keys.
+  * With zipf > 0 the build keys are drawn from build_size distinct keys with a Zipf distribution of that exponent,
+  *  so a few keys have long chains of duplicates. The matching probe rows pick a build row, so they hit the hot keys as often.
+  */
+template<size_t build_payload, size_t probe_payload>
+std::tuple<std::vector<KeyValue<build_payload>>, std::vector<KeyValue<probe_payload>>> generate(size_t build_size, size_t probe_size, size_t match_possibility, UInt64 seed, double zipf = 0)
 {
     std::vector<KeyValue<build_payload>> build_kv;
     std::vector<KeyValue<probe_payload>> probe_kv;
 
     std::random_device rd;
-    std::mt19937 mt(rd());
+    std::mt19937 mt(seed ? seed : rd());
     std::uniform_int_distribution<uint32_t> int_dist;
 
     std::random_device rd2;
-    std::mt19937 mt2(rd2());
+    std::mt19937 mt2(seed ? seed + 1 : rd2());
     std::uniform_int_distribution<uint32_t> int_dist2;
 
     build_kv.reserve(build_size);
@@ -74,6 +168,16 @@ std::tuple<std::vector<KeyValue<build_payload>>, std::vector<KeyValue<probe_payl
         build_kv.emplace_back(random);
     }
 
+    if (zipf > 0 && build_size > 0)
+    {
+        std::vector<UInt64> distinct_keys(build_size);
+        for (size_t i = 0; i < build_size; ++i)
+            distinct_keys[i] = build_kv[i].key;
+        ZipfDistribution ranks(build_size, zipf);
+        for (auto & row : build_kv)
+            row.key = distinct_keys[ranks(mt)];
+    }
+
     probe_kv.reserve(probe_size);
     for (size_t i = 0; i < probe_size; ++i)
     {
@@ -91,22 +195,171 @@ std::tuple<std::vector<KeyValue<build_payload>>, std::vector<KeyValue<probe_payl
     return {build_kv, probe_kv};
 }
 
-void FlushCache()
+template<size_t payload>
+void writeDatasetRows(DatasetWriter & writer, const std::vector<KeyValue<payload>> & kv)
+{
+    for (const auto & row : kv)
+        writer.write(&row.key, sizeof(row.key));
+    writer.endSection();
+    if constexpr (payload > 0)
+    {
+        for (const auto & row : kv)
+            writer.write(row.value.p, payload);
+    }
+    writer.endSection();
+}
+
+template<size_t payload>
+std::vector<KeyValue<payload>> readDatasetRows(const UInt64 * keys, const char * payloads, size_t size)
+{
+    std::vector<KeyValue<payload>> kv;
+    kv.reserve(size);
+    for (size_t i = 0; i < size; ++i)
+    {
+        kv.emplace_back(keys[i]);
+        if constexpr (payload > 0)
+            memcpy(kv.back().value.p, payloads + i * payload, payload);
+    }
+    return kv;
+}
+
+/// Generate the join input, or map it from the dataset cache if `dataset_options.dir` is set.
+template<size_t build_payload, size_t probe_payload>
+std::tuple<std::vector<KeyValue<build_payload>>, std::vector<KeyValue<probe_payload>>> init(size_t build_size, size_t probe_size, size_t match_possibility)
 {
-    const size_t bigger_than_cachesize = 15 * 1024 * 1024;
-    long * p = new long[bigger_than_cachesize];
-    // When you want to "flush" cache.
-    for(size_t i = 0; i < bigger_than_cachesize; ++i)
+    if (dataset_options.dir.empty())
+        return generate<build_payload, probe_payload>(build_size, probe_size, match_possibility, dataset_options.seed, dataset_options.zipf);
+
+    DatasetHeader header(build_size, probe_size, match_possibility, dataset_options.seed, build_payload, probe_payload, dataset_options.zipf);
+    std::string path = datasetPath(dataset_options.dir, header);
+
+    MappedDataset mapped;
+    if (mapped.open(path, header))
     {
-        p[i] = rand();
+        return {readDatasetRows<build_payload>(mapped.buildKeys(), mapped.buildPayloads(), build_size),
+                readDatasetRows<probe_payload>(mapped.probeKeys(), mapped.probePayloads(), probe_size)};
     }
-    delete [] p;
+
+    auto res = generate<build_payload, probe_payload>(build_size, probe_size, match_possibility, dataset_options.seed, dataset_options.zipf);
+
+    DatasetWriter writer(dataset_options.dir, header);
+    writeDatasetRows<build_payload>(writer, std::get<0>(res));
+    writeDatasetRows<probe_payload>(writer, std::get<1>(res));
+    if (!writer.finish())
+        fprintf(stderr, "cannot write dataset %s\n", path.c_str());
+
+    return res;
+}
+
+/// Phase times of the last finished join, the sweep drivers read it to print their summary.
+struct JoinResult
+{
+    UInt64 build_time = 0;
+    UInt64 probe_time = 0;
+    UInt64 total_time = 0;
+    size_t output_size = 0;
+    UInt64 build_cycles = 0;
+    UInt64 probe_cycles = 0;
+};
+
+inline JoinResult last_join_result;
+
+/// Per-tuple cost of the join phases, normalized by the input sizes so that runs of different sizes and machines compare.
+void reportJoinCost(const std::string & log_head, size_t build_size, size_t probe_size, const JoinResult & res, const BatchLatencyHistogram & probe_latency)
+{
+    printf("%s build %.2f cycles/tuple %.2f Mtuples/s, probe %.2f cycles/tuple %.2f Mtuples/s, tsc %.3f GHz%s\n",
+           log_head.c_str(),
+           build_size ? static_cast<double>(res.build_cycles) / build_size : 0.0,
+           res.build_time ? build_size * 1e3 / res.build_time : 0.0,
+           probe_size ? static_cast<double>(res.probe_cycles) / probe_size : 0.0,
+           res.probe_time ? probe_size * 1e3 / res.probe_time : 0.0,
+           tscTicksPerNanosecond(),
+           hasInvariantTSC() ? "" : " (TSC is not invariant)");
+    probe_latency.print((log_head + " probe").c_str());
 }
 
-template<bool construct_tuple, size_t build_payload = 8, size_t probe_payload = 8>
+/** The output of the join kinds other than inner on rows, a null row is KeyValue(0) with a zero payload.
+  * The probe loops call match() for every build row with an equal key and probeEnd() once per probe row,
+  *  finish() emits the build rows no probe row matched. SEMI and ANTI joins only output probe rows.
+  * Without construct_tuple only the rows are counted.
+  */
+template<JoinKind kind, bool construct_tuple, size_t build_payload, size_t probe_payload>
+class KeyValueJoinOutput
+{
+public:
+    KeyValueJoinOutput(size_t build_size, size_t probe_size)
+        : matched(emitsUnmatchedBuild(kind) ? build_size : 0)
+    {
+        if constexpr (construct_tuple)
+        {
+            output_build.reserve(probe_size);
+            output_probe.reserve(probe_size);
+        }
+    }
+
+    /// `build_row` numbers the build rows for the matched map. Returns false if the rest of the chain doesn't matter.
+    bool ALWAYS_INLINE match(const KeyValue<build_payload> & build, size_t build_row, const KeyValue<probe_payload> & probe)
+    {
+        probe_matched = true;
+        if constexpr (stopsAtFirstMatch(kind))
+            return false;
+        if constexpr (emitsUnmatchedBuild(kind))
+            matched.setMatched(build_row);
+        emit(build, probe);
+        return true;
+    }
+
+    void ALWAYS_INLINE probeEnd(const KeyValue<probe_payload> & probe)
+    {
+        if (kind == JoinKind::Semi ? probe_matched : emitsUnmatchedProbe(kind) && !probe_matched)
+            emit(null_build, probe);
+        probe_matched = false;
+    }
+
+    /// get_row(build_row) returns the build row of a number passed to match().
+    template<typename GetRow>
+    void finish(GetRow && get_row)
+    {
+        if constexpr (emitsUnmatchedBuild(kind))
+            matched.forEachUnmatched([&](size_t row) { emit(get_row(row), null_probe); });
+    }
+
+    size_t size() const { return rows; }
+
+    std::pair<std::vector<KeyValue<build_payload>>, std::vector<KeyValue<probe_payload>>> release()
+    {
+        return std::make_pair(std::move(output_build), std::move(output_probe));
+    }
+
+private:
+    void ALWAYS_INLINE emit(const KeyValue<build_payload> & build, const KeyValue<probe_payload> & probe)
+    {
+        ++rows;
+        if constexpr (construct_tuple)
+        {
+            if constexpr (!stopsAtFirstMatch(kind))
+                output_build.emplace_back(build);
+            output_probe.emplace_back(probe);
+        }
+    }
+
+    const KeyValue<build_payload> null_build{0};
+    const KeyValue<probe_payload> null_probe{0};
+    BuildMatchedMap matched;
+    bool probe_matched = false;
+    size_t rows = 0;
+    std::vector<KeyValue<build_payload>> output_build;
+    std::vector<KeyValue<probe_payload>> output_probe;
+};
+
+/** With `saved_hash` the table is HashMapWithSavedHash: a cell keeps the hash of its key, probes compare it before the key
+  *  and resize doesn't hash the keys again, at the cost of 8 more bytes per cell.
+  * `kind` other than inner goes through KeyValueJoinOutput, the inner join keeps its own loop.
+  */
+template<bool construct_tuple, size_t build_payload = 8, size_t probe_payload = 8, typename HashMethod = HashCRC32<uint64_t>, bool saved_hash = false, JoinKind kind = JoinKind::Inner>
 void TestLinear(size_t build_size, size_t probe_size, size_t match_possibility)
 {
-    std::string log_head = "linear " + std::to_string(build_size) + "/" + std::to_string(probe_size) + "/" + std::to_string(match_possibility) + "/" + std::to_string(construct_tuple);
+    std::string log_head = std::string(saved_hash ? "linear(saved hash)" : "linear") + joinKindSuffix(kind) + " " + std::to_string(build_size) + "/" + std::to_string(probe_size) + "/" + std::to_string(match_possibility) + "/" + std::to_string(construct_tuple);
 
     auto [build_kv, probe_kv] = init<build_payload, probe_payload>(build_size, probe_size, match_possibility);
 
@@ -115,19 +368,22 @@ void TestLinear(size_t build_size, size_t probe_size, size_t match_possibility)
         KeyValue<build_payload> * kv = nullptr;
     };
 
-    using CKHashTable = HashMap<uint64_t, Cell, HashCRC32<uint64_t>>;
+    using CKHashTable = std::conditional_t<saved_hash, HashMapWithSavedHash<uint64_t, Cell, HashMethod>, HashMap<uint64_t, Cell, HashMethod>>;
 
     CKHashTable hash_table;
     using MappedType = typename CKHashTable::mapped_type;
 
+    BatchedHashes<HashMethod, KeyValue<build_payload>> build_hashes(build_kv);
+    BatchedHashes<HashMethod, KeyValue<probe_payload>> probe_hashes(probe_kv);
+
     Stopwatch watch;
-    Stopwatch watch2;
+    TscStopwatch tsc_watch;
 
     for (size_t i = 0; i < build_size; ++i)
     {
         typename CKHashTable::LookupResult it;
         bool inserted;
-        hash_table.emplace(build_kv[i].key, it, inserted);
+        hash_table.emplace(build_kv[i].key, it, inserted, build_hashes.get(i));
         if (inserted)
             new (&it->getMapped()) MappedType(Cell{&build_kv[i]});
         else
@@ -139,54 +395,81 @@ void TestLinear(size_t build_size, size_t probe_size, size_t match_possibility)
 
     size_t collision = hash_table.getCollisions();
     unsigned long long build_hash_time = watch.elapsedFromLastTime();
+    UInt64 build_cycles = tsc_watch.elapsedFromLastTime();
 
     printf("%s build hash table time %llu, size %zu, buf %zu, collision %zu, displace_max_step %zu\n", log_head.c_str(), build_hash_time, hash_table.size(), hash_table.bufSize(), collision, hash_table.getDisplaceMaxStep());
 
-    FlushCache();
-    unsigned long long flush_cache_time = watch.elapsedFromLastTime();
-
-    //printf("%s flush cache time %llu\n", log_head.c_str(), flush_cache_time);
-
-    std::vector<KeyValue<build_payload>> output_build;
-    output_build.reserve(probe_size);
-    std::vector<KeyValue<probe_payload>> output_probe;
-    output_probe.reserve(probe_size);
+    prepareCache({memoryRange(probe_kv), memoryRange(build_kv), {hash_table.getCell(0), hash_table.getBufferSizeInBytes()}});
+    watch.elapsedFromLastTime();
+    tsc_watch.elapsedFromLastTime();
 
     size_t offset = 0;
-    for (size_t i = 0; i < probe_size; ++i)
+    BatchLatencyHistogram probe_latency;
+    if constexpr (kind == JoinKind::Inner)
     {
-        auto * it = hash_table.find(probe_kv[i].key);
-        if (it != nullptr)
+        std::vector<KeyValue<build_payload>> output_build;
+        output_build.reserve(probe_size);
+        std::vector<KeyValue<probe_payload>> output_probe;
+        output_probe.reserve(probe_size);
+
+        for (size_t i = 0; i < probe_size; ++i)
         {
-            if constexpr (construct_tuple)
+            probe_latency.step(i);
+            auto * it = hash_table.find(probe_kv[i].key, probe_hashes.get(i));
+            if (it != nullptr)
             {
-                for (auto * p = it->getMapped().kv; p != nullptr; p = p->next)
+                if constexpr (construct_tuple)
+                {
+                    for (auto * p = it->getMapped().kv; p != nullptr; p = p->next)
+                    {
+                        output_build.emplace_back(*p);
+                        output_probe.emplace_back(probe_kv[i]);
+                        ++offset;
+                    }
+                }
+                else
                 {
-                    output_build.emplace_back(*p);
-                    output_probe.emplace_back(probe_kv[i]);
                     ++offset;
                 }
             }
-            else
+        }
+    }
+    else
+    {
+        KeyValueJoinOutput<kind, construct_tuple, build_payload, probe_payload> output(build_size, probe_size);
+        for (size_t i = 0; i < probe_size; ++i)
+        {
+            probe_latency.step(i);
+            auto * it = hash_table.find(probe_kv[i].key, probe_hashes.get(i));
+            if (it != nullptr)
             {
-                ++offset;
+                for (auto * p = it->getMapped().kv; p != nullptr && output.match(*p, p - build_kv.data(), probe_kv[i]); p = p->next)
+                    ;
             }
+            output.probeEnd(probe_kv[i]);
         }
+        output.finish([&](size_t row) -> const auto & { return build_kv[row]; });
+        offset = output.size();
     }
 
     collision = hash_table.getCollisions() - collision;
     unsigned long long probe_hash_time = watch.elapsedFromLastTime();
+    UInt64 probe_cycles = tsc_watch.elapsedFromLastTime();
+    probe_latency.finish();
 
     if constexpr (construct_tuple)
         printf("%s probe hash table + construct tuple time %llu, size %lu, collision %zu\n", log_head.c_str(), probe_hash_time, offset, collision);
     else
         printf("%s probe hash table time %llu, size %lu, collision %zu\n", log_head.c_str(), probe_hash_time, offset, collision);
 
-    unsigned long long total_time = watch2.elapsedFromLastTime() - flush_cache_time;
+    unsigned long long total_time = build_hash_time + probe_hash_time;
     printf("%s total_time %llu\n", log_head.c_str(), total_time);
+
+    last_join_result = {build_hash_time, probe_hash_time, total_time, offset, build_cycles, probe_cycles};
+    reportJoinCost(log_head, build_size, probe_size, last_join_result, probe_latency);
 }
 
-template<bool construct_tuple, size_t build_payload = 8, size_t probe_payload = 8>
+template<bool construct_tuple, size_t build_payload = 8, size_t probe_payload = 8, typename HashMethod = HashCRC32<uint64_t>>
 void TestLinearPrefetch(size_t build_size, size_t probe_size, size_t match_possibility)
 {
     std::string log_head = "linear(prefetch) " + std::to_string(build_size) + "/" + std::to_string(probe_size) + "/" + std::to_string(match_possibility) + "/" + std::to_string(construct_tuple);
@@ -198,19 +481,22 @@ void TestLinearPrefetch(size_t build_size, size_t probe_size, size_t match_possi
         KeyValue<build_payload> * kv = nullptr;
     };
 
-    using CKHashTable = HashMap<uint64_t, Cell, HashCRC32<uint64_t>>;
+    using CKHashTable = HashMap<uint64_t, Cell, HashMethod>;
 
     CKHashTable hash_table;
     using MappedType = typename CKHashTable::mapped_type;
 
+    BatchedHashes<HashMethod, KeyValue<build_payload>> build_hashes(build_kv);
+    BatchedHashes<HashMethod, KeyValue<probe_payload>> probe_hashes(probe_kv);
+
     Stopwatch watch;
-    Stopwatch watch2;
+    TscStopwatch tsc_watch;
 
     for (size_t i = 0; i < build_size; ++i)
     {
         typename CKHashTable::LookupResult it;
         bool inserted;
-        hash_table.emplace(build_kv[i].key, it, inserted);
+        hash_table.emplace(build_kv[i].key, it, inserted, build_hashes.get(i));
         if (inserted)
             new (&it->getMapped()) MappedType(Cell{&build_kv[i]});
         else
@@ -222,35 +508,36 @@ void TestLinearPrefetch(size_t build_size, size_t probe_size, size_t match_possi
 
     size_t collision = hash_table.getCollisions();
     unsigned long long build_hash_time = watch.elapsedFromLastTime();
+    UInt64 build_cycles = tsc_watch.elapsedFromLastTime();
 
     printf("%s build hash table time %llu, size %zu, buf %zu, collision %zu\n", log_head.c_str(), build_hash_time, hash_table.size(), hash_table.bufSize(), collision);
 
-    FlushCache();
-    unsigned long long flush_cache_time = watch.elapsedFromLastTime();
-
-    //printf("%s flush cache time %llu\n", log_head.c_str(), flush_cache_time);
+    prepareCache({memoryRange(probe_kv), memoryRange(build_kv), {hash_table.getCell(0), hash_table.getBufferSizeInBytes()}});
+    watch.elapsedFromLastTime();
+    tsc_watch.elapsedFromLastTime();
 
     std::vector<KeyValue<build_payload>> output_build;
     output_build.reserve(probe_size);
     std::vector<KeyValue<probe_payload>> output_probe;
     output_probe.reserve(probe_size);
 
-    auto hash_method = HashCRC32<uint64_t>();
 
     const auto PREFETCH = 16;
     size_t hashes[PREFETCH];
     for (size_t i = 0; i < PREFETCH && i < probe_size; ++i)
     {
-        hashes[i] = hash_method(probe_kv[i].key);
+        hashes[i] = probe_hashes.get(i);
     }
     size_t offset = 0;
+    BatchLatencyHistogram probe_latency;
     for (size_t i = 0; i < probe_size; ++i)
     {
+        probe_latency.step(i);
         size_t pos = i % PREFETCH;
         size_t hash_value = hashes[pos];
         if (i + PREFETCH < probe_size)
         {
-            hashes[pos] = hash_method(probe_kv[i + PREFETCH].key);
+            hashes[pos] = probe_hashes.get(i + PREFETCH);
             hash_table.prefetch(hashes[pos]);
         }
         auto * it = hash_table.find(probe_kv[i].key, hash_value);
@@ -274,52 +561,58 @@ void TestLinearPrefetch(size_t build_size, size_t probe_size, size_t match_possi
 
     collision = hash_table.getCollisions() - collision;
     unsigned long long probe_hash_time = watch.elapsedFromLastTime();
+    UInt64 probe_cycles = tsc_watch.elapsedFromLastTime();
+    probe_latency.finish();
 
     if constexpr (construct_tuple)
         printf("%s probe hash table + construct tuple time %llu, size %lu, collision %zu\n", log_head.c_str(), probe_hash_time, offset, collision);
     else
         printf("%s probe hash table time %llu, size %lu, collision %zu\n", log_head.c_str(), probe_hash_time, offset, collision);
 
-    unsigned long long total_time = watch2.elapsedFromLastTime() - flush_cache_time;
+    unsigned long long total_time = build_hash_time + probe_hash_time;
     printf("%s total_time %llu\n", log_head.c_str(), total_time);
+
+    last_join_result = {build_hash_time, probe_hash_time, total_time, offset, build_cycles, probe_cycles};
+    reportJoinCost(log_head, build_size, probe_size, last_join_result, probe_latency);
 }
 
-template<bool construct_tuple, size_t build_payload = 8, size_t probe_payload = 8>
+template<bool construct_tuple, size_t build_payload = 8, size_t probe_payload = 8, typename HashMethod = HashCRC32<uint64_t>, JoinKind kind = JoinKind::Inner, typename Residual = NoResidual>
 std::pair<std::vector<KeyValue<build_payload>>, std::vector<KeyValue<probe_payload>>> TestChained(size_t build_size, size_t probe_size, size_t match_possibility, const std::tuple<std::vector<KeyValue<build_payload>>, std::vector<KeyValue<probe_payload>>> * input = nullptr)
 {
-    std::string log_head = "chained " + std::to_string(build_size) + "/" + std::to_string(probe_size) + "/" + std::to_string(match_possibility) + "/" + std::to_string(construct_tuple);
+    std::string log_head = std::string("chained") + (std::is_same_v<Residual, NoResidual> ? "" : "(residual)") + joinKindSuffix(kind) + " " + std::to_string(build_size) + "/" + std::to_string(probe_size) + "/" + std::to_string(match_possibility) + "/" + std::to_string(construct_tuple);
 
     auto [build_kv, probe_kv] = input ? *input : init<build_payload, probe_payload>(build_size, probe_size, match_possibility);
 
-    auto hash_method = HashCRC32<uint64_t>();
+    BatchedHashes<HashMethod, KeyValue<build_payload>> build_hashes(build_kv);
+    BatchedHashes<HashMethod, KeyValue<probe_payload>> probe_hashes(probe_kv);
 
     Stopwatch watch;
-    Stopwatch watch2;
+    TscStopwatch tsc_watch;
 
     size_t head_size = 1 << (static_cast<size_t>(log2(build_size - 1)) + 2);
     size_t hash_mask = head_size - 1;
     std::vector<KeyValue<build_payload> *> head(head_size);
     for (size_t i = 0; i < build_size; ++i)
     {
-        size_t hash = hash_method(build_kv[i].key);
+        size_t hash = build_hashes.get(i);
         size_t bucket = hash & hash_mask;
         build_kv[i].next = head[bucket];
         head[bucket] = &build_kv[i];
     }
 
     unsigned long long build_hash_time = watch.elapsedFromLastTime();
+    UInt64 build_cycles = tsc_watch.elapsedFromLastTime();
 
     printf("%s build hash table time %llu, head_size %zu\n", log_head.c_str(), build_hash_time, head_size);
 
-    FlushCache();
-    unsigned long long flush_cache_time = watch.elapsedFromLastTime();
-
-    //printf("%s flush cache time %llu\n", log_head.c_str(), flush_cache_time);
+    prepareCache({memoryRange(probe_kv), memoryRange(build_kv), memoryRange(head)});
+    watch.elapsedFromLastTime();
+    tsc_watch.elapsedFromLastTime();
 
     size_t empty = 0;
     for (size_t i = 0; i < probe_size; ++i)
     {
-        size_t hash = hash_method(probe_kv[i].key);
+        size_t hash = probe_hashes.get(i);
         size_t bucket = hash & hash_mask;
         auto & h = head[bucket];
         if (head[bucket] == nullptr)
@@ -327,9 +620,12 @@ std::pair<std::vector<KeyValue<build_payload>>, std::vector<KeyValue<probe_paylo
     }
 
     auto time = watch.elapsedFromLastTime();
+    tsc_watch.elapsedFromLastTime();
     printf("%s just get head array time %llu, empty %zu \n", log_head.c_str(), time, empty);
 
-    flush_cache_time += time;
+    prepareCache({memoryRange(probe_kv), memoryRange(build_kv), memoryRange(head)});
+    watch.elapsedFromLastTime();
+    tsc_watch.elapsedFromLastTime();
 
     std::vector<KeyValue<build_payload>> output_build;
     output_build.reserve(probe_size);
@@ -340,59 +636,88 @@ std::pair<std::vector<KeyValue<build_payload>>, std::vector<KeyValue<probe_paylo
     size_t max_len = 0;
     size_t empty_count = 0;
     size_t offset = 0;
+    BatchLatencyHistogram probe_latency;
+    Residual residual;
+    /// Unused by the inner join, which writes output_build and output_probe itself.
+    KeyValueJoinOutput<kind, construct_tuple, build_payload, probe_payload> output(kind == JoinKind::Inner ? 0 : build_size, kind == JoinKind::Inner ? 0 : probe_size);
     for (size_t i = 0; i < probe_size; ++i)
     {
-        size_t bucket = hash_method(probe_kv[i].key) & hash_mask;
+        probe_latency.step(i);
+        size_t bucket = probe_hashes.get(i) & hash_mask;
         auto * h = head[bucket];
         size_t len = 0;
         while (h != nullptr)
         {
-            if (h->key == probe_kv[i].key)
+            if (h->key == probe_kv[i].key && residual(*h, probe_kv[i]))
             {
-                ++offset;
-                if constexpr (construct_tuple)
+                if constexpr (kind == JoinKind::Inner)
                 {
-                    output_build.emplace_back(*h);
-                    output_probe.emplace_back(probe_kv[i]);
+                    ++offset;
+                    if constexpr (construct_tuple)
+                    {
+                        output_build.emplace_back(*h);
+                        output_probe.emplace_back(probe_kv[i]);
+                    }
+                }
+                else if (!output.match(*h, h - build_kv.data(), probe_kv[i]))
+                {
+                    ++len;
+                    break;
                 }
             }
             ++len;
             h = h->next;
         }
+        if constexpr (kind != JoinKind::Inner)
+            output.probeEnd(probe_kv[i]);
         jump_len_sum += len;
         if (len == 0)
             ++empty_count;
         if (len > max_len)
             max_len = len;
     }
+    if constexpr (kind != JoinKind::Inner)
+    {
+        output.finish([&](size_t row) -> const auto & { return build_kv[row]; });
+        offset = output.size();
+        std::tie(output_build, output_probe) = output.release();
+    }
 
     unsigned long long probe_hash_time = watch.elapsedFromLastTime();
+    UInt64 probe_cycles = tsc_watch.elapsedFromLastTime();
+    probe_latency.finish();
 
     if constexpr (construct_tuple)
         printf("%s probe hash table + construct tuple time %llu, size %lu, max_len %zu, empty_head %zu, jump_len_sum %zu \n", log_head.c_str(), probe_hash_time, offset, max_len, empty_count, jump_len_sum);
     else
         printf("%s probe hash table time %llu, size %lu, max_len %zu, empty_head %zu, jump_len_sum %zu \n", log_head.c_str(), probe_hash_time, offset, max_len, empty_count, jump_len_sum);
 
-    unsigned long long total_time = watch2.elapsedFromLastTime() - flush_cache_time;
+    unsigned long long total_time = build_hash_time + probe_hash_time;
     printf("%s total_time %llu\n", log_head.c_str(), total_time);
 
+    last_join_result = {build_hash_time, probe_hash_time, total_time, offset, build_cycles, probe_cycles};
+    reportJoinCost(log_head, build_size, probe_size, last_join_result, probe_latency);
+
     return std::make_pair(std::move(output_build), std::move(output_probe));
 }
 
-template<bool construct_tuple, size_t build_payload = 8, size_t probe_payload = 8>
+template<bool construct_tuple, size_t build_payload = 8, size_t probe_payload = 8, typename HashMethod = HashCRC32<uint64_t>>
 std::pair<std::vector<KeyValue<build_payload>>, std::vector<KeyValue<probe_payload>>> TestYangChained(size_t build_size, size_t probe_size, size_t match_possibility, const std::tuple<std::vector<KeyValue<build_payload>>, std::vector<KeyValue<probe_payload>>> * input = nullptr)
 {
     std::string log_head = "YangChained " + std::to_string(build_size) + "/" + std::to_string(probe_size) + "/" + std::to_string(match_possibility) + "/" + std::to_string(construct_tuple);
 
     auto [build_kv, probe_kv] = input ? *input : init<build_payload, probe_payload>(build_size, probe_size, match_possibility);
 
-    auto hash_method = HashCRC32<uint64_t>();
+    BatchedHashes<HashMethod, KeyValue<build_payload>> build_hashes(build_kv);
+    BatchedHashes<HashMethod, KeyValue<probe_payload>> probe_hashes(probe_kv);
 
     Stopwatch watch;
-    Stopwatch watch2;
+    TscStopwatch tsc_watch;
 
     size_t head_size = 1 << (static_cast<size_t>(log2(build_size - 1)) + 2);
     size_t hash_mask = head_size - 1;
+    /// The bucket bits are the same for every row of a bucket, only the bits above them are worth keeping in the filter.
+    auto layout = makeHashBitLayout<HashMethod>(1, bucketBitsFor(build_size));
     struct Node
     {
         size_t hash = 0;
@@ -401,26 +726,26 @@ std::pair<std::vector<KeyValue<build_payload>>, std::vector<KeyValue<probe_paylo
     std::vector<Node> head(head_size);
     for (size_t i = 0; i < build_size; ++i)
     {
-        size_t hash = hash_method(build_kv[i].key);
+        size_t hash = build_hashes.get(i);
         size_t bucket = hash & hash_mask;
         build_kv[i].next = static_cast<KeyValue<build_payload>*>(head[bucket].pointer);
         head[bucket].pointer = &build_kv[i];
-        head[bucket].hash |= hash;
+        head[bucket].hash |= layout.tag(hash);
     }
 
     unsigned long long build_hash_time = watch.elapsedFromLastTime();
+    UInt64 build_cycles = tsc_watch.elapsedFromLastTime();
 
     printf("%s build hash table time %llu, head_size %zu\n", log_head.c_str(), build_hash_time, head_size);
 
-    FlushCache();
-    unsigned long long flush_cache_time = watch.elapsedFromLastTime();
-
-    //printf("%s flush cache time %llu\n", log_head.c_str(), flush_cache_time);
+    prepareCache({memoryRange(probe_kv), memoryRange(build_kv), memoryRange(head)});
+    watch.elapsedFromLastTime();
+    tsc_watch.elapsedFromLastTime();
 
     size_t empty = 0;
     for (size_t i = 0; i < probe_size; ++i)
     {
-        size_t hash = hash_method(probe_kv[i].key);
+        size_t hash = probe_hashes.get(i);
         size_t bucket = hash & hash_mask;
         auto & h = head[bucket];
         if (head[bucket].pointer == nullptr)
@@ -428,9 +753,12 @@ std::pair<std::vector<KeyValue<build_payload>>, std::vector<KeyValue<probe_paylo
     }
 
     auto time = watch.elapsedFromLastTime();
+    tsc_watch.elapsedFromLastTime();
     printf("%s just get head array time %llu, empty %zu \n", log_head.c_str(), time, empty);
 
-    flush_cache_time += time;
+    prepareCache({memoryRange(probe_kv), memoryRange(build_kv), memoryRange(head)});
+    watch.elapsedFromLastTime();
+    tsc_watch.elapsedFromLastTime();
 
     std::vector<KeyValue<build_payload>> output_build;
     output_build.reserve(probe_size);
@@ -443,9 +771,11 @@ std::pair<std::vector<KeyValue<build_payload>>, std::vector<KeyValue<probe_paylo
     size_t offset = 0;
     size_t or_hash_stop_count = 0;
 
+    BatchLatencyHistogram probe_latency;
     for (size_t i = 0; i < probe_size; ++i)
     {
-        size_t hash = hash_method(probe_kv[i].key);
+        probe_latency.step(i);
+        size_t hash = probe_hashes.get(i);
         size_t bucket = hash & hash_mask;
         auto & h = head[bucket];
         if (head[bucket].pointer == nullptr)
@@ -453,7 +783,8 @@ std::pair<std::vector<KeyValue<build_payload>>, std::vector<KeyValue<probe_paylo
             ++empty_count;
             continue;
         }
-        if ((hash | head[bucket].hash) != head[bucket].hash)
+        size_t tag = layout.tag(hash);
+        if ((tag | head[bucket].hash) != head[bucket].hash)
         {
             ++or_hash_stop_count;
             continue;
@@ -480,29 +811,35 @@ std::pair<std::vector<KeyValue<build_payload>>, std::vector<KeyValue<probe_paylo
     }
 
     unsigned long long probe_hash_time = watch.elapsedFromLastTime();
+    UInt64 probe_cycles = tsc_watch.elapsedFromLastTime();
+    probe_latency.finish();
 
     if constexpr (construct_tuple)
         printf("%s probe hash table + construct tuple time %llu, size %lu, max_len %zu, empty_head %zu, jump_len_sum %zu, or_hash_stop_count %zu \n", log_head.c_str(), probe_hash_time, offset, max_len, empty_count, jump_len_sum, or_hash_stop_count);
     else
         printf("%s probe hash table time %llu, size %lu, max_len %zu, empty_head %zu, jump_len_sum %zu, or_hash_stop_count %zu \n", log_head.c_str(), probe_hash_time, offset, max_len, empty_count, jump_len_sum, or_hash_stop_count);
 
-    unsigned long long total_time = watch2.elapsedFromLastTime() - flush_cache_time;
+    unsigned long long total_time = build_hash_time + probe_hash_time;
     printf("%s total_time %llu\n", log_head.c_str(), total_time);
 
+    last_join_result = {build_hash_time, probe_hash_time, total_time, offset, build_cycles, probe_cycles};
+    reportJoinCost(log_head, build_size, probe_size, last_join_result, probe_latency);
+
     return std::make_pair(std::move(output_build), std::move(output_probe));
 }
 
-template<bool construct_tuple, size_t build_payload = 8, size_t probe_payload = 8>
+template<bool construct_tuple, size_t build_payload = 8, size_t probe_payload = 8, typename HashMethod = HashCRC32<uint64_t>, typename Residual = NoResidual>
 std::pair<std::vector<KeyValue<build_payload>>, std::vector<KeyValue<probe_payload>>> TestYangHash(size_t build_size, size_t probe_size, size_t match_possibility, const std::tuple<std::vector<KeyValue<build_payload>>, std::vector<KeyValue<probe_payload>>> * input = nullptr)
 {
-    std::string log_head = "YangHash " + std::to_string(build_size) + "/" + std::to_string(probe_size) + "/" + std::to_string(match_possibility) + "/" + std::to_string(construct_tuple);
+    std::string log_head = std::string("YangHash") + (std::is_same_v<Residual, NoResidual> ? "" : "(residual)") + " " + std::to_string(build_size) + "/" + std::to_string(probe_size) + "/" + std::to_string(match_possibility) + "/" + std::to_string(construct_tuple);
 
     auto [build_kv, probe_kv] = input ? *input : init<build_payload, probe_payload>(build_size, probe_size, match_possibility);
 
-    auto hash_method = HashCRC32<uint64_t>();
+    BatchedHashes<HashMethod, KeyValue<build_payload>> build_hashes(build_kv);
+    BatchedHashes<HashMethod, KeyValue<probe_payload>> probe_hashes(probe_kv);
 
     Stopwatch watch;
-    Stopwatch watch2;
+    TscStopwatch tsc_watch;
 
     size_t head_size = 1 << (static_cast<size_t>(log2(build_size - 1)) + 2);
     size_t hash_mask = head_size - 1;
@@ -516,7 +853,7 @@ std::pair<std::vector<KeyValue<build_payload>>, std::vector<KeyValue<probe_paylo
     std::vector<Node> head(head_size);
     for (size_t i = 0; i < build_size; ++i)
     {
-        size_t hash = hash_method(build_kv[i].key);
+        size_t hash = build_hashes.get(i);
         size_t bucket = hash & hash_mask;
         build_kv[i].next = static_cast<KeyValue<build_payload>*>(head[bucket].pointer);
         ++head[bucket].length;
@@ -524,13 +861,13 @@ std::pair<std::vector<KeyValue<build_payload>>, std::vector<KeyValue<probe_paylo
     }
 
     unsigned long long build_hash_time = watch.elapsedFromLastTime();
+    UInt64 build_cycles = tsc_watch.elapsedFromLastTime();
 
     printf("%s build hash table time %llu, head_size %zu\n", log_head.c_str(), build_hash_time, head_size);
 
-    FlushCache();
-    unsigned long long flush_cache_time = watch.elapsedFromLastTime();
-
-    //printf("%s flush cache time %llu\n", log_head.c_str(), flush_cache_time);
+    prepareCache({memoryRange(probe_kv), memoryRange(build_kv), memoryRange(head)});
+    watch.elapsedFromLastTime();
+    tsc_watch.elapsedFromLastTime();
 
     std::vector<KeyValue<build_payload>> output_build;
     output_build.reserve(probe_size);
@@ -550,9 +887,12 @@ std::pair<std::vector<KeyValue<build_payload>>, std::vector<KeyValue<probe_paylo
     size_t empty_count = 0;
     size_t offset = 0;
     size_t reconstruct_time = 0;
+    Residual residual;
+    BatchLatencyHistogram probe_latency;
     for (size_t i = 0; i < probe_size; ++i)
     {
-        size_t bucket = hash_method(probe_kv[i].key) & hash_mask;
+        probe_latency.step(i);
+        size_t bucket = probe_hashes.get(i) & hash_mask;
         auto & h = head[bucket];
         if (h.pointer == nullptr)
         {
@@ -567,7 +907,7 @@ std::pair<std::vector<KeyValue<build_payload>>, std::vector<KeyValue<probe_paylo
                 auto * p = static_cast<KeyPointer*>(h.pointer);
                 for (size_t j = 0; j < h.length; ++j)
                 {
-                    if (p[j].key == probe_kv[i].key)
+                    if (p[j].key == probe_kv[i].key && residual(*p[j].pointer, probe_kv[i]))
                     {
                         if (p[j].pointer->key == probe_kv[i].key)
                             ++offset;
@@ -593,7 +933,7 @@ std::pair<std::vector<KeyValue<build_payload>>, std::vector<KeyValue<probe_paylo
                     new_p[j].key = p->key;
                     new_p[j].pointer = p;
                     ++j;
-                    if (p->key == probe_kv[i].key)
+                    if (p->key == probe_kv[i].key && residual(*p, probe_kv[i]))
                     {
                         ++offset;
                         if constexpr (construct_tuple)
@@ -615,7 +955,7 @@ std::pair<std::vector<KeyValue<build_payload>>, std::vector<KeyValue<probe_paylo
         auto * p = static_cast<KeyValue<build_payload>*>(h.pointer);
         while (p != nullptr)
         {
-            if (p->key == probe_kv[i].key)
+            if (p->key == probe_kv[i].key && residual(*p, probe_kv[i]))
             {
                 ++offset;
                 if constexpr (construct_tuple)
@@ -632,164 +972,607 @@ std::pair<std::vector<KeyValue<build_payload>>, std::vector<KeyValue<probe_paylo
     }
 
     unsigned long long probe_hash_time = watch.elapsedFromLastTime();
+    UInt64 probe_cycles = tsc_watch.elapsedFromLastTime();
+    probe_latency.finish();
 
     if constexpr (construct_tuple)
         printf("%s probe hash table + construct tuple time %llu, size %lu, max_len %zu, empty_head %zu, jump_len_sum %zu, reconstruct_time %zu \n", log_head.c_str(), probe_hash_time, offset, max_len, empty_count, jump_len_sum, reconstruct_time);
     else
         printf("%s probe hash table time %llu, size %lu, max_len %zu, empty_head %zu, jump_len_sum %zu, reconstruct_time %zu \n", log_head.c_str(), probe_hash_time, offset, max_len, empty_count, jump_len_sum, reconstruct_time);
 
-    unsigned long long total_time = watch2.elapsedFromLastTime() - flush_cache_time;
+    unsigned long long total_time = build_hash_time + probe_hash_time;
     printf("%s total_time %llu\n", log_head.c_str(), total_time);
 
+    last_join_result = {build_hash_time, probe_hash_time, total_time, offset, build_cycles, probe_cycles};
+    reportJoinCost(log_head, build_size, probe_size, last_join_result, probe_latency);
+
     return std::make_pair(std::move(output_build), std::move(output_probe));
 }
 
-template<bool construct_tuple, size_t build_payload = 8, size_t probe_payload = 8>
-void TestChainedPrefetch(size_t build_size, size_t probe_size, size_t match_possibility)
+/// Threads of the parallel builds and probes, --threads.
+inline size_t build_threads = std::max(1U, std::thread::hardware_concurrency());
+
+/// How the parallel probes hand out the probe rows, --schedule=static|steal, and the morsel size of stealing, --morsel.
+inline Schedule probe_schedule = Schedule::Stealing;
+inline size_t probe_morsel_size = WorkStealingScheduler::DEFAULT_GRAIN;
+
+inline std::string scheduleSuffix()
 {
-    std::string log_head = "chained(prefetch) " + std::to_string(build_size) + "/" + std::to_string(probe_size) + "/" + std::to_string(match_possibility) + "/" + std::to_string(construct_tuple);
+    return std::string(", ") + toString(probe_schedule);
+}
 
-    auto [build_kv, probe_kv] = init<build_payload, probe_payload>(build_size, probe_size, match_possibility);
+/** Run f(thread, begin, end) on `threads` threads, each with one contiguous range of [0, size).
+  * The calling thread runs the last range. Threads are pinned by `pin_policy`.
+  */
+template<typename F>
+void parallelFor(size_t threads, size_t size, F && f)
+{
+    std::vector<std::thread> pool;
+    pool.reserve(threads - 1);
+    for (size_t thread = 0; thread + 1 < threads; ++thread)
+    {
+        pool.emplace_back([&f, thread, threads, size]
+        {
+            pinWorker(thread, threads);
+            f(thread, size * thread / threads, size * (thread + 1) / threads);
+        });
+    }
+    pinWorker(threads - 1, threads);
+    f(threads - 1, size * (threads - 1) / threads, size);
+    for (auto & t : pool)
+        t.join();
+}
 
-    auto hash_method = HashCRC32<uint64_t>();
+/** TestChained with a build on `build_threads` threads into one shared head array.
+  * A row is pushed onto its bucket with a CAS on the head pointer, there are no locks and no per-thread tables to merge.
+  * The order of the rows within a chain depends on the thread interleaving.
+  * The probe runs on as many threads with the WorkStealingScheduler, as chains of skewed keys make a static split uneven.
+  */
+template<bool construct_tuple, size_t build_payload = 8, size_t probe_payload = 8, typename HashMethod = HashCRC32<uint64_t>>
+void TestChainedParallel(size_t build_size, size_t probe_size, size_t match_possibility)
+{
+    size_t threads = std::max<size_t>(1, std::min(build_threads, build_size));
+    std::string log_head = "chained(" + std::to_string(threads) + " threads" + scheduleSuffix() + ") " + std::to_string(build_size) + "/" + std::to_string(probe_size) + "/" + std::to_string(match_possibility) + "/" + std::to_string(construct_tuple);
 
-    Stopwatch watch;
-    Stopwatch watch2;
+    auto [build_kv, probe_kv] = init<build_payload, probe_payload>(build_size, probe_size, match_possibility);
 
+    using Pointer = KeyValue<build_payload> *;
     size_t head_size = 1 << (static_cast<size_t>(log2(build_size - 1)) + 2);
     size_t hash_mask = head_size - 1;
-    std::vector<KeyValue<build_payload> *> head(head_size);
-    for (size_t i = 0; i < build_size; ++i)
+    std::vector<std::atomic<Pointer>> head(head_size);
+
+    Stopwatch watch;
+    TscStopwatch tsc_watch;
+
+    parallelFor(threads, build_size, [&](size_t, size_t begin, size_t end)
     {
-        size_t hash = hash_method(build_kv[i].key);
-        size_t bucket = hash & hash_mask;
-        build_kv[i].next = head[bucket];
-        head[bucket] = &build_kv[i];
-    }
+        BatchedHashes<HashMethod, KeyValue<build_payload>> build_hashes(build_kv.data() + begin, end - begin);
+        for (size_t i = begin; i < end; ++i)
+        {
+            auto & bucket = head[build_hashes.get(i - begin) & hash_mask];
+            Pointer row = &build_kv[i];
+            Pointer next = bucket.load(std::memory_order_relaxed);
+            do
+                row->next = next;
+            while (!bucket.compare_exchange_weak(next, row, std::memory_order_release, std::memory_order_relaxed));
+        }
+    });
 
     unsigned long long build_hash_time = watch.elapsedFromLastTime();
+    UInt64 build_cycles = tsc_watch.elapsedFromLastTime();
 
     printf("%s build hash table time %llu, head_size %zu\n", log_head.c_str(), build_hash_time, head_size);
 
-    FlushCache();
-    unsigned long long flush_cache_time = watch.elapsedFromLastTime();
-
-    //printf("%s flush cache time %llu\n", log_head.c_str(), flush_cache_time);
+    prepareCache({memoryRange(probe_kv), memoryRange(build_kv), memoryRange(head)});
+    watch.elapsedFromLastTime();
+    tsc_watch.elapsedFromLastTime();
 
-    std::vector<KeyValue<build_payload>> output_build;
-    output_build.reserve(probe_size);
-    std::vector<KeyValue<probe_payload>> output_probe;
-    output_probe.reserve(probe_size);
+    std::vector<size_t> offsets(threads);
+    std::vector<std::vector<KeyValue<build_payload>>> output_build(threads);
+    std::vector<std::vector<KeyValue<probe_payload>>> output_probe(threads);
 
-    size_t offset = 0;
-    const size_t PREFETCH = 16;
-    struct State
-    {
-        uint32_t stage = 0;
-        uint32_t bucket;
-        uint64_t key;
-        KeyValue<build_payload> * pointer;
-    };
-    State states[PREFETCH];
-    size_t k = 0, current = 0;
-    while (current < probe_size)
+    BatchLatencyHistogram probe_latency;
+    WorkStealingScheduler scheduler(threads, probe_morsel_size);
+    const auto & worker_stats = scheduler.run(probe_schedule, probe_size, [&](size_t worker, size_t begin, size_t end)
     {
-        k = k == PREFETCH ? 0 : k;
-        State & s = states[k];
-        if (s.stage == 0)
-        {
-            s.stage = 1;
-            s.key = probe_kv[current].key;
-            s.bucket = hash_method(s.key) & hash_mask;
-            __builtin_prefetch(head.data() + s.bucket);
-            ++current;
-            ++k;
-        }
-        else if (s.stage == 1)
-        {
-            s.pointer = head[s.bucket];
-            if (s.pointer == nullptr)
-            {
-                s.stage = 0;
-            }
-            else
-            {
-                s.stage = 2;
-                __builtin_prefetch(s.pointer);
-                ++k;
-            }
-        }
-        else if (s.stage == 2)
+        BatchedHashes<HashMethod, KeyValue<probe_payload>> probe_hashes(probe_kv.data() + begin, end - begin);
+        size_t offset = 0;
+        for (size_t i = begin; i < end; ++i)
         {
-            if (s.pointer->key == s.key)
+            if (worker + 1 == threads)
+                probe_latency.step(i);
+            for (Pointer h = head[probe_hashes.get(i - begin) & hash_mask].load(std::memory_order_relaxed); h != nullptr; h = h->next)
             {
-                ++offset;
-            }
-            if (s.pointer->next == nullptr)
-            {
-                s.stage = 0;
-            }
-            else
-            {
-                s.pointer = s.pointer->next;
-                __builtin_prefetch(s.pointer);
-                ++k;
+                if (h->key == probe_kv[i].key)
+                {
+                    ++offset;
+                    if constexpr (construct_tuple)
+                    {
+                        output_build[worker].emplace_back(*h);
+                        output_probe[worker].emplace_back(probe_kv[i]);
+                    }
+                }
             }
         }
-    }
+        offsets[worker] += offset;
+    });
 
-    for (size_t i = 0; i < PREFETCH; ++i)
-    {
-        State & s = states[i];
-        if (s.stage == 0)
-            continue;
-        if (s.stage == 1)
-        {
-            s.pointer = head[s.bucket];
-        }
-        while (s.pointer != nullptr)
-        {
-            if (s.pointer->key == s.key)
-            {
-                ++offset;
-            }
-            s.pointer = s.pointer->next;
-        }
-    }
+    size_t offset = 0;
+    for (size_t worker_offset : offsets)
+        offset += worker_offset;
 
     unsigned long long probe_hash_time = watch.elapsedFromLastTime();
+    UInt64 probe_cycles = tsc_watch.elapsedFromLastTime();
+    probe_latency.finish();
 
     if constexpr (construct_tuple)
         printf("%s probe hash table + construct tuple time %llu, size %lu\n", log_head.c_str(), probe_hash_time, offset);
     else
         printf("%s probe hash table time %llu, size %lu\n", log_head.c_str(), probe_hash_time, offset);
 
-    unsigned long long total_time = watch2.elapsedFromLastTime() - flush_cache_time;
+    unsigned long long total_time = build_hash_time + probe_hash_time;
     printf("%s total_time %llu\n", log_head.c_str(), total_time);
+
+    last_join_result = {build_hash_time, probe_hash_time, total_time, offset, build_cycles, probe_cycles};
+    reportJoinCost(log_head, build_size, probe_size, last_join_result, probe_latency);
+    printWorkerStats(log_head + " probe", worker_stats);
 }
 
-template<bool construct_tuple, size_t build_payload = 8, size_t probe_payload = 8>
-void TestMyLinear(size_t build_size, size_t probe_size, size_t match_possibility)
+/// Segments of the shared table of TestConcurrent, enough that threads seldom wait on the same segment lock.
+static constexpr size_t CONCURRENT_SEGMENTS = 64;
+
+/** Build and probe of one ConcurrentHashMap, both on `build_threads` threads.
+  * The build emplaces with the hashes of BatchedHashes and chains the duplicate keys under the segment write lock.
+  * The probe hashes BatchedHashes::BATCH_SIZE keys at a time with hashBatch() and looks them up with findBatch(),
+  *  each worker of the WorkStealingScheduler produces its own output. The probe latency histogram is of the last worker, the calling thread.
+  */
+template<bool construct_tuple, size_t build_payload = 8, size_t probe_payload = 8, typename HashMethod = HashCRC32<uint64_t>>
+void TestConcurrent(size_t build_size, size_t probe_size, size_t match_possibility)
 {
-    std::string log_head = "my linear " + std::to_string(build_size) + "/" + std::to_string(probe_size) + "/" + std::to_string(match_possibility) + "/" + std::to_string(construct_tuple);
+    size_t threads = std::max<size_t>(1, std::min(build_threads, build_size));
+    std::string log_head = "concurrent(" + std::to_string(threads) + " threads" + scheduleSuffix() + ") " + std::to_string(build_size) + "/" + std::to_string(probe_size) + "/" + std::to_string(match_possibility) + "/" + std::to_string(construct_tuple);
 
     auto [build_kv, probe_kv] = init<build_payload, probe_payload>(build_size, probe_size, match_possibility);
 
     struct Cell
     {
-        uint64_t key = 0;
-        KeyValue<build_payload> * value = nullptr;
+        KeyValue<build_payload> * kv = nullptr;
     };
 
-    auto hash_method = HashCRC32<uint64_t>();
+    using CKHashTable = ConcurrentHashMap<uint64_t, Cell, HashMethod>;
+    CKHashTable hash_table(CONCURRENT_SEGMENTS);
 
     Stopwatch watch;
-    Stopwatch watch2;
-
-    Allocator<true> alloc;
-
-    Cell * hashmap;
-    hashmap = static_cast<Cell*>(alloc.alloc((build_size) * sizeof(Cell)));
+    TscStopwatch tsc_watch;
+
+    parallelFor(threads, build_size, [&](size_t, size_t begin, size_t end)
+    {
+        BatchedHashes<HashMethod, KeyValue<build_payload>> build_hashes(build_kv.data() + begin, end - begin);
+        for (size_t i = begin; i < end; ++i)
+        {
+            typename CKHashTable::SegmentType::IteratorWithLock it;
+            bool inserted;
+            hash_table.emplace(build_kv[i].key, it, inserted, build_hashes.get(i - begin));
+            if (inserted)
+                new (&it.first->getMapped()) Cell{&build_kv[i]};
+            else
+            {
+                build_kv[i].next = it.first->getMapped().kv->next;
+                it.first->getMapped().kv->next = &build_kv[i];
+            }
+        }
+    });
+
+    unsigned long long build_hash_time = watch.elapsedFromLastTime();
+    UInt64 build_cycles = tsc_watch.elapsedFromLastTime();
+
+    printf("%s build hash table time %llu, size %zu, segments %zu\n", log_head.c_str(), build_hash_time, hash_table.rowCount(), hash_table.getSegmentSize());
+
+    prepareCache({memoryRange(probe_kv), memoryRange(build_kv)});
+    watch.elapsedFromLastTime();
+    tsc_watch.elapsedFromLastTime();
+
+    std::vector<size_t> offsets(threads);
+    std::vector<std::vector<KeyValue<build_payload>>> output_build(threads);
+    std::vector<std::vector<KeyValue<probe_payload>>> output_probe(threads);
+
+    const CKHashTable & probe_table = hash_table;
+    BatchLatencyHistogram probe_latency;
+    if constexpr (construct_tuple)
+    {
+        for (size_t thread = 0; thread < threads; ++thread)
+        {
+            output_build[thread].reserve(probe_size / threads);
+            output_probe[thread].reserve(probe_size / threads);
+        }
+    }
+    WorkStealingScheduler scheduler(threads, probe_morsel_size);
+    const auto & worker_stats = scheduler.run(probe_schedule, probe_size, [&](size_t thread, size_t begin, size_t end)
+    {
+        size_t offset = 0;
+        size_t hashes[BatchedHashes<HashMethod, KeyValue<probe_payload>>::BATCH_SIZE];
+        /// Batches are aligned to multiples of their size, so that the latency histogram sees every multiple of its batch size.
+        for (size_t batch_begin = begin, batch_end; batch_begin < end; batch_begin = batch_end)
+        {
+            batch_end = std::min(end, (batch_begin / std::size(hashes) + 1) * std::size(hashes));
+            if (thread + 1 == threads)
+                probe_latency.step(batch_begin);
+            size_t batch_size = batch_end - batch_begin;
+            const auto * rows = &probe_kv[batch_begin];
+            hashBatch<HashMethod>(&rows->key, sizeof(*rows), batch_size, hashes);
+            probe_table.findBatch(&rows->key, sizeof(*rows), hashes, batch_size, [&](size_t i, const auto * cell)
+            {
+                if constexpr (construct_tuple)
+                {
+                    for (auto * p = cell->getMapped().kv; p != nullptr; p = p->next)
+                    {
+                        output_build[thread].emplace_back(*p);
+                        output_probe[thread].emplace_back(rows[i]);
+                        ++offset;
+                    }
+                }
+                else
+                {
+                    ++offset;
+                }
+            });
+        }
+        offsets[thread] += offset;
+    });
+
+    size_t offset = 0;
+    for (size_t thread_offset : offsets)
+        offset += thread_offset;
+
+    unsigned long long probe_hash_time = watch.elapsedFromLastTime();
+    UInt64 probe_cycles = tsc_watch.elapsedFromLastTime();
+    probe_latency.finish();
+
+    if constexpr (construct_tuple)
+        printf("%s probe hash table + construct tuple time %llu, size %lu\n", log_head.c_str(), probe_hash_time, offset);
+    else
+        printf("%s probe hash table time %llu, size %lu\n", log_head.c_str(), probe_hash_time, offset);
+
+    unsigned long long total_time = build_hash_time + probe_hash_time;
+    printf("%s total_time %llu\n", log_head.c_str(), total_time);
+
+    last_join_result = {build_hash_time, probe_hash_time, total_time, offset, build_cycles, probe_cycles};
+    reportJoinCost(log_head, build_size, probe_size, last_join_result, probe_latency);
+    printWorkerStats(log_head + " probe", worker_stats);
+}
+
+/// Radix partitions of TestLinearThreadLocal, as many as TestConcurrent has segments so both split the keys alike.
+static constexpr size_t THREAD_LOCAL_PARTITIONS = CONCURRENT_SEGMENTS;
+
+/** Parallel build without shared state: every thread builds its own set of THREAD_LOCAL_PARTITIONS HashMaps
+  *  from its range of build rows, the partition taken from the top bits of the hash.
+  * Then partitions are merged in parallel, each by one thread, so no locks are needed: the per-thread tables of a
+  *  partition are merged into its largest one with mergeToViaEmplace, and the chains of duplicate keys are concatenated.
+  * The probe is scheduled like the one of TestConcurrent, with a prefetch PREFETCH_DISTANCE rows ahead.
+  */
+template<bool construct_tuple, size_t build_payload = 8, size_t probe_payload = 8, typename HashMethod = HashCRC32<uint64_t>>
+void TestLinearThreadLocal(size_t build_size, size_t probe_size, size_t match_possibility)
+{
+    static constexpr size_t PREFETCH_DISTANCE = 16;
+
+    size_t threads = std::max<size_t>(1, std::min(build_threads, build_size));
+    std::string log_head = "linear(" + std::to_string(threads) + " threads, thread local" + scheduleSuffix() + ") " + std::to_string(build_size) + "/" + std::to_string(probe_size) + "/" + std::to_string(match_possibility) + "/" + std::to_string(construct_tuple);
+
+    auto [build_kv, probe_kv] = init<build_payload, probe_payload>(build_size, probe_size, match_possibility);
+
+    struct Cell
+    {
+        KeyValue<build_payload> * kv = nullptr;
+    };
+
+    using CKHashTable = HashMap<uint64_t, Cell, HashMethod>;
+    using MappedType = typename CKHashTable::mapped_type;
+    auto layout = makeHashBitLayout<HashMethod>(THREAD_LOCAL_PARTITIONS, 0);
+
+    Stopwatch watch;
+    TscStopwatch tsc_watch;
+
+    std::vector<std::vector<CKHashTable>> local_tables(threads);
+    parallelFor(threads, build_size, [&](size_t thread, size_t begin, size_t end)
+    {
+        auto & tables = local_tables[thread];
+        tables.resize(THREAD_LOCAL_PARTITIONS);
+        BatchedHashes<HashMethod, KeyValue<build_payload>> build_hashes(build_kv.data() + begin, end - begin);
+        for (size_t i = begin; i < end; ++i)
+        {
+            size_t hash = build_hashes.get(i - begin);
+            typename CKHashTable::LookupResult it;
+            bool inserted;
+            tables[layout.partition(hash)].emplace(build_kv[i].key, it, inserted, hash);
+            if (inserted)
+                new (&it->getMapped()) MappedType(Cell{&build_kv[i]});
+            else
+            {
+                build_kv[i].next = it->getMapped().kv->next;
+                it->getMapped().kv->next = &build_kv[i];
+            }
+        }
+    });
+
+    unsigned long long local_build_time = watch.elapsedFromLastTime();
+
+    std::vector<CKHashTable> hash_table(THREAD_LOCAL_PARTITIONS);
+    parallelFor(std::min(threads, THREAD_LOCAL_PARTITIONS), THREAD_LOCAL_PARTITIONS, [&](size_t, size_t begin, size_t end)
+    {
+        for (size_t part = begin; part < end; ++part)
+        {
+            size_t largest = 0;
+            for (size_t thread = 1; thread < threads; ++thread)
+                if (local_tables[thread][part].size() > local_tables[largest][part].size())
+                    largest = thread;
+
+            auto & dst = hash_table[part];
+            dst = std::move(local_tables[largest][part]);
+            for (size_t thread = 0; thread < threads; ++thread)
+            {
+                if (thread == largest)
+                    continue;
+                auto & src = local_tables[thread][part];
+                src.mergeToViaEmplace(dst, [](Cell & dst_cell, Cell & src_cell, bool inserted)
+                {
+                    if (inserted)
+                    {
+                        new (&dst_cell) MappedType(src_cell);
+                        return;
+                    }
+                    auto * tail = src_cell.kv;
+                    while (tail->next != nullptr)
+                        tail = tail->next;
+                    tail->next = dst_cell.kv;
+                    dst_cell.kv = src_cell.kv;
+                });
+                src.clearAndShrink();
+            }
+        }
+    });
+
+    unsigned long long merge_time = watch.elapsedFromLastTime();
+    unsigned long long build_hash_time = local_build_time + merge_time;
+    UInt64 build_cycles = tsc_watch.elapsedFromLastTime();
+
+    size_t table_size = 0;
+    for (const auto & table : hash_table)
+        table_size += table.size();
+    printf("%s build hash table time %llu (local build %llu, merge %llu), size %zu, partitions %zu\n",
+           log_head.c_str(), build_hash_time, local_build_time, merge_time, table_size, hash_table.size());
+
+    prepareCache({memoryRange(probe_kv), memoryRange(build_kv)});
+    watch.elapsedFromLastTime();
+    tsc_watch.elapsedFromLastTime();
+
+    std::vector<size_t> offsets(threads);
+    std::vector<std::vector<KeyValue<build_payload>>> output_build(threads);
+    std::vector<std::vector<KeyValue<probe_payload>>> output_probe(threads);
+
+    BatchLatencyHistogram probe_latency;
+    if constexpr (construct_tuple)
+    {
+        for (size_t thread = 0; thread < threads; ++thread)
+        {
+            output_build[thread].reserve(probe_size / threads);
+            output_probe[thread].reserve(probe_size / threads);
+        }
+    }
+    WorkStealingScheduler scheduler(threads, probe_morsel_size);
+    const auto & worker_stats = scheduler.run(probe_schedule, probe_size, [&](size_t thread, size_t begin, size_t end)
+    {
+        size_t offset = 0;
+        size_t hashes[BatchedHashes<HashMethod, KeyValue<probe_payload>>::BATCH_SIZE];
+        /// Batches are aligned to multiples of their size, so that the latency histogram sees every multiple of its batch size.
+        for (size_t batch_begin = begin, batch_end; batch_begin < end; batch_begin = batch_end)
+        {
+            batch_end = std::min(end, (batch_begin / std::size(hashes) + 1) * std::size(hashes));
+            if (thread + 1 == threads)
+                probe_latency.step(batch_begin);
+            size_t batch_size = batch_end - batch_begin;
+            const auto * rows = &probe_kv[batch_begin];
+            hashBatch<HashMethod>(&rows->key, sizeof(*rows), batch_size, hashes);
+            for (size_t i = 0; i < batch_size; ++i)
+            {
+                if (i + PREFETCH_DISTANCE < batch_size)
+                    hash_table[layout.partition(hashes[i + PREFETCH_DISTANCE])].prefetch(hashes[i + PREFETCH_DISTANCE]);
+                auto * it = hash_table[layout.partition(hashes[i])].find(rows[i].key, hashes[i]);
+                if (it == nullptr)
+                    continue;
+                if constexpr (construct_tuple)
+                {
+                    for (auto * p = it->getMapped().kv; p != nullptr; p = p->next)
+                    {
+                        output_build[thread].emplace_back(*p);
+                        output_probe[thread].emplace_back(rows[i]);
+                        ++offset;
+                    }
+                }
+                else
+                {
+                    ++offset;
+                }
+            }
+        }
+        offsets[thread] += offset;
+    });
+
+    size_t offset = 0;
+    for (size_t thread_offset : offsets)
+        offset += thread_offset;
+
+    unsigned long long probe_hash_time = watch.elapsedFromLastTime();
+    UInt64 probe_cycles = tsc_watch.elapsedFromLastTime();
+    probe_latency.finish();
+
+    if constexpr (construct_tuple)
+        printf("%s probe hash table + construct tuple time %llu, size %lu\n", log_head.c_str(), probe_hash_time, offset);
+    else
+        printf("%s probe hash table time %llu, size %lu\n", log_head.c_str(), probe_hash_time, offset);
+
+    unsigned long long total_time = build_hash_time + probe_hash_time;
+    printf("%s total_time %llu\n", log_head.c_str(), total_time);
+
+    last_join_result = {build_hash_time, probe_hash_time, total_time, offset, build_cycles, probe_cycles};
+    reportJoinCost(log_head, build_size, probe_size, last_join_result, probe_latency);
+    printWorkerStats(log_head + " probe", worker_stats);
+}
+
+template<bool construct_tuple, size_t build_payload = 8, size_t probe_payload = 8, typename HashMethod = HashCRC32<uint64_t>>
+void TestChainedPrefetch(size_t build_size, size_t probe_size, size_t match_possibility)
+{
+    std::string log_head = "chained(prefetch) " + std::to_string(build_size) + "/" + std::to_string(probe_size) + "/" + std::to_string(match_possibility) + "/" + std::to_string(construct_tuple);
+
+    auto [build_kv, probe_kv] = init<build_payload, probe_payload>(build_size, probe_size, match_possibility);
+
+    BatchedHashes<HashMethod, KeyValue<build_payload>> build_hashes(build_kv);
+    BatchedHashes<HashMethod, KeyValue<probe_payload>> probe_hashes(probe_kv);
+
+    Stopwatch watch;
+    TscStopwatch tsc_watch;
+
+    size_t head_size = 1 << (static_cast<size_t>(log2(build_size - 1)) + 2);
+    size_t hash_mask = head_size - 1;
+    std::vector<KeyValue<build_payload> *> head(head_size);
+    for (size_t i = 0; i < build_size; ++i)
+    {
+        size_t hash = build_hashes.get(i);
+        size_t bucket = hash & hash_mask;
+        build_kv[i].next = head[bucket];
+        head[bucket] = &build_kv[i];
+    }
+
+    unsigned long long build_hash_time = watch.elapsedFromLastTime();
+    UInt64 build_cycles = tsc_watch.elapsedFromLastTime();
+
+    printf("%s build hash table time %llu, head_size %zu\n", log_head.c_str(), build_hash_time, head_size);
+
+    prepareCache({memoryRange(probe_kv), memoryRange(build_kv), memoryRange(head)});
+    watch.elapsedFromLastTime();
+    tsc_watch.elapsedFromLastTime();
+
+    std::vector<KeyValue<build_payload>> output_build;
+    output_build.reserve(probe_size);
+    std::vector<KeyValue<probe_payload>> output_probe;
+    output_probe.reserve(probe_size);
+
+    size_t offset = 0;
+    const size_t PREFETCH = 16;
+    struct State
+    {
+        uint32_t stage = 0;
+        uint32_t bucket;
+        uint64_t key;
+        KeyValue<build_payload> * pointer;
+    };
+    State states[PREFETCH];
+    BatchLatencyHistogram probe_latency;
+    size_t k = 0, current = 0;
+    while (current < probe_size)
+    {
+        k = k == PREFETCH ? 0 : k;
+        State & s = states[k];
+        if (s.stage == 0)
+        {
+            probe_latency.step(current);
+            s.stage = 1;
+            s.key = probe_kv[current].key;
+            s.bucket = probe_hashes.get(current) & hash_mask;
+            __builtin_prefetch(head.data() + s.bucket);
+            ++current;
+            ++k;
+        }
+        else if (s.stage == 1)
+        {
+            s.pointer = head[s.bucket];
+            if (s.pointer == nullptr)
+            {
+                s.stage = 0;
+            }
+            else
+            {
+                s.stage = 2;
+                __builtin_prefetch(s.pointer);
+                ++k;
+            }
+        }
+        else if (s.stage == 2)
+        {
+            if (s.pointer->key == s.key)
+            {
+                ++offset;
+            }
+            if (s.pointer->next == nullptr)
+            {
+                s.stage = 0;
+            }
+            else
+            {
+                s.pointer = s.pointer->next;
+                __builtin_prefetch(s.pointer);
+                ++k;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < PREFETCH; ++i)
+    {
+        State & s = states[i];
+        if (s.stage == 0)
+            continue;
+        if (s.stage == 1)
+        {
+            s.pointer = head[s.bucket];
+        }
+        while (s.pointer != nullptr)
+        {
+            if (s.pointer->key == s.key)
+            {
+                ++offset;
+            }
+            s.pointer = s.pointer->next;
+        }
+    }
+
+    unsigned long long probe_hash_time = watch.elapsedFromLastTime();
+    UInt64 probe_cycles = tsc_watch.elapsedFromLastTime();
+    probe_latency.finish();
+
+    if constexpr (construct_tuple)
+        printf("%s probe hash table + construct tuple time %llu, size %lu\n", log_head.c_str(), probe_hash_time, offset);
+    else
+        printf("%s probe hash table time %llu, size %lu\n", log_head.c_str(), probe_hash_time, offset);
+
+    unsigned long long total_time = build_hash_time + probe_hash_time;
+    printf("%s total_time %llu\n", log_head.c_str(), total_time);
+
+    last_join_result = {build_hash_time, probe_hash_time, total_time, offset, build_cycles, probe_cycles};
+    reportJoinCost(log_head, build_size, probe_size, last_join_result, probe_latency);
+}
+
+template<bool construct_tuple, size_t build_payload = 8, size_t probe_payload = 8, typename HashMethod = HashCRC32<uint64_t>>
+void TestMyLinear(size_t build_size, size_t probe_size, size_t match_possibility)
+{
+    std::string log_head = "my linear " + std::to_string(build_size) + "/" + std::to_string(probe_size) + "/" + std::to_string(match_possibility) + "/" + std::to_string(construct_tuple);
+
+    auto [build_kv, probe_kv] = init<build_payload, probe_payload>(build_size, probe_size, match_possibility);
+
+    struct Cell
+    {
+        uint64_t key = 0;
+        KeyValue<build_payload> * value = nullptr;
+    };
+
+    BatchedHashes<HashMethod, KeyValue<build_payload>> build_hashes(build_kv);
+    BatchedHashes<HashMethod, KeyValue<probe_payload>> probe_hashes(probe_kv);
+
+    Stopwatch watch;
+    TscStopwatch tsc_watch;
+
+    Allocator<true> alloc;
+
+    Cell * hashmap;
+    hashmap = static_cast<Cell*>(alloc.alloc((build_size) * sizeof(Cell)));
 
     size_t bucket_size = 1 << (static_cast<size_t>(log2(build_size - 1)) + 2);
     size_t hash_mask = bucket_size - 1;
@@ -797,7 +1580,7 @@ void TestMyLinear(size_t build_size, size_t probe_size, size_t match_possibility
 
     for (size_t i = 0; i < build_size; ++i)
     {
-        size_t hash = hash_method(build_kv[i].key);
+        size_t hash = build_hashes.get(i);
         size_t bucket = hash & hash_mask;
         ++buckets[bucket + 1];
     }
@@ -809,7 +1592,7 @@ void TestMyLinear(size_t build_size, size_t probe_size, size_t match_possibility
 
     for (size_t i = 0; i < build_size; ++i)
     {
-        size_t hash = hash_method(build_kv[i].key);
+        size_t hash = build_hashes.get(i);
         size_t bucket = hash & hash_mask;
 
         size_t pos = buckets[bucket];
@@ -831,13 +1614,13 @@ void TestMyLinear(size_t build_size, size_t probe_size, size_t match_possibility
     }
 
     unsigned long long build_hash_time = watch.elapsedFromLastTime();
+    UInt64 build_cycles = tsc_watch.elapsedFromLastTime();
 
     printf("%s build hash table time %llu, bucket_size %zu\n", log_head.c_str(), build_hash_time, bucket_size);
 
-    FlushCache();
-    unsigned long long flush_cache_time = watch.elapsedFromLastTime();
-
-    //printf("%s flush cache time %llu\n", log_head.c_str(), flush_cache_time);
+    prepareCache({memoryRange(probe_kv), memoryRange(build_kv), memoryRange(buckets), {hashmap, build_size * sizeof(Cell)}});
+    watch.elapsedFromLastTime();
+    tsc_watch.elapsedFromLastTime();
 
     std::vector<KeyValue<build_payload>> output_build;
     output_build.reserve(probe_size);
@@ -846,9 +1629,11 @@ void TestMyLinear(size_t build_size, size_t probe_size, size_t match_possibility
 
     size_t max_len = 0;
     size_t offset = 0;
+    BatchLatencyHistogram probe_latency;
     for (size_t i = 0; i < probe_size; ++i)
     {
-        size_t bucket = hash_method(probe_kv[i].key) & hash_mask;
+        probe_latency.step(i);
+        size_t bucket = probe_hashes.get(i) & hash_mask;
         size_t pos = buckets[bucket];
         size_t end_pos = buckets[bucket + 1];
         for (size_t j = pos; j < end_pos; ++j)
@@ -877,17 +1662,22 @@ void TestMyLinear(size_t build_size, size_t probe_size, size_t match_possibility
     }
 
     unsigned long long probe_hash_time = watch.elapsedFromLastTime();
+    UInt64 probe_cycles = tsc_watch.elapsedFromLastTime();
+    probe_latency.finish();
 
     if constexpr (construct_tuple)
         printf("%s probe hash table + construct tuple time %llu, size %lu, max_len %zu\n", log_head.c_str(), probe_hash_time, offset, max_len);
     else
         printf("%s probe hash table time %llu, size %lu, max_len %zu\n", log_head.c_str(), probe_hash_time, offset, max_len);
 
-    unsigned long long total_time = watch2.elapsedFromLastTime() - flush_cache_time;
+    unsigned long long total_time = build_hash_time + probe_hash_time;
     printf("%s total_time %llu\n", log_head.c_str(), total_time);
+
+    last_join_result = {build_hash_time, probe_hash_time, total_time, offset, build_cycles, probe_cycles};
+    reportJoinCost(log_head, build_size, probe_size, last_join_result, probe_latency);
 }
 
-template<bool construct_tuple, size_t build_payload = 8, size_t probe_payload = 8>
+template<bool construct_tuple, size_t build_payload = 8, size_t probe_payload = 8, typename HashMethod = HashCRC32<uint64_t>>
 void TestMyLinear2(size_t build_size, size_t probe_size, size_t match_possibility)
 {
     std::string log_head = "my linear2 " + std::to_string(build_size) + "/" + std::to_string(probe_size) + "/" + std::to_string(match_possibility) + "/" + std::to_string(construct_tuple);
@@ -901,10 +1691,11 @@ void TestMyLinear2(size_t build_size, size_t probe_size, size_t match_possibilit
         KeyValue<build_payload> * value = nullptr;
     };
 
-    auto hash_method = HashCRC32<uint64_t>();
+    BatchedHashes<HashMethod, KeyValue<build_payload>> build_hashes(build_kv);
+    BatchedHashes<HashMethod, KeyValue<probe_payload>> probe_hashes(probe_kv);
 
     Stopwatch watch;
-    Stopwatch watch2;
+    TscStopwatch tsc_watch;
 
     Allocator<true> alloc;
 
@@ -921,7 +1712,7 @@ void TestMyLinear2(size_t build_size, size_t probe_size, size_t match_possibilit
 
     for (size_t i = 0; i < build_size; ++i)
     {
-        size_t hash = hash_method(build_kv[i].key);
+        size_t hash = build_hashes.get(i);
         size_t bucket = hash & hash_mask;
         ++buckets[bucket];
     }
@@ -968,7 +1759,7 @@ void TestMyLinear2(size_t build_size, size_t probe_size, size_t match_possibilit
 
     for (size_t i = 0; i < build_size; ++i)
     {
-        size_t hash = hash_method(build_kv[i].key);
+        size_t hash = build_hashes.get(i);
         size_t bucket = hash & hash_mask;
 
         size_t pos = hashmap[bucket].pos;
@@ -992,13 +1783,13 @@ void TestMyLinear2(size_t build_size, size_t probe_size, size_t match_possibilit
     }
 
     unsigned long long build_hash_time = watch.elapsedFromLastTime();
+    UInt64 build_cycles = tsc_watch.elapsedFromLastTime();
 
     printf("%s build hash table time %llu\n", log_head.c_str(), build_hash_time);
 
-    FlushCache();
-    unsigned long long flush_cache_time = watch.elapsedFromLastTime();
-
-    //printf("%s flush cache time %llu\n", log_head.c_str(), flush_cache_time);
+    prepareCache({memoryRange(probe_kv), memoryRange(build_kv), {hashmap, (bucket_size + 1) * sizeof(Cell)}});
+    watch.elapsedFromLastTime();
+    tsc_watch.elapsedFromLastTime();
 
     std::vector<KeyValue<build_payload>> output_build;
     output_build.reserve(probe_size);
@@ -1007,9 +1798,11 @@ void TestMyLinear2(size_t build_size, size_t probe_size, size_t match_possibilit
 
     size_t max_len = 0;
     size_t offset = 0;
+    BatchLatencyHistogram probe_latency;
     for (size_t i = 0; i < probe_size; ++i)
     {
-        size_t bucket = hash_method(probe_kv[i].key) & hash_mask;
+        probe_latency.step(i);
+        size_t bucket = probe_hashes.get(i) & hash_mask;
         if (hashmap[bucket].key == probe_kv[i].key)
         {
             if constexpr (construct_tuple)
@@ -1063,102 +1856,1061 @@ void TestMyLinear2(size_t build_size, size_t probe_size, size_t match_possibilit
     }
 
     unsigned long long probe_hash_time = watch.elapsedFromLastTime();
+    UInt64 probe_cycles = tsc_watch.elapsedFromLastTime();
+    probe_latency.finish();
 
     if constexpr (construct_tuple)
         printf("%s probe hash table + construct tuple time %llu, size %lu, max_len %zu\n", log_head.c_str(), probe_hash_time, offset, max_len);
     else
         printf("%s probe hash table time %llu, size %lu, max_len %zu\n", log_head.c_str(), probe_hash_time, offset, max_len);
 
-    unsigned long long total_time = watch2.elapsedFromLastTime() - flush_cache_time;
+    unsigned long long total_time = build_hash_time + probe_hash_time;
     printf("%s total_time %llu\n", log_head.c_str(), total_time);
+
+    last_join_result = {build_hash_time, probe_hash_time, total_time, offset, build_cycles, probe_cycles};
+    reportJoinCost(log_head, build_size, probe_size, last_join_result, probe_latency);
 }
 
-void benchHashTable(int argc, char** argv)
+/** Key types of the string key joins. `string` is one ColumnString, `composite` is (UInt64, String),
+  *  which is hashed and compared as the serialized row like a multi-column join key.
+  */
+enum class JoinKeyType
 {
-    /*auto input = init<8, 8>(1000, 10000, 25);
-    auto [a1, a2] = TestChained<true>(1000, 10000, 25, &input);
-    auto [b1, b2] = TestYangHash<true>(1000, 10000, 25, &input);
+    UInt64,
+    String,
+    Composite,
+};
 
-    if (!compare(a1, b1))
+inline const char * toString(JoinKeyType type)
+{
+    switch (type)
     {
-        printf("a1 != b1");
-        return;
+        case JoinKeyType::UInt64: return "uint64";
+        case JoinKeyType::String: return "string";
+        case JoinKeyType::Composite: return "composite";
     }
-    if (!compare(a2, b2))
+    return "unknown";
+}
+
+inline bool parseJoinKeyType(const std::string & name, JoinKeyType & type)
+{
+    if (name == "uint64")
+        type = JoinKeyType::UInt64;
+    else if (name == "string")
+        type = JoinKeyType::String;
+    else if (name == "composite")
+        type = JoinKeyType::Composite;
+    else
+        return false;
+    return true;
+}
+
+/// Maximum length of a generated string key, --key_length.
+inline size_t string_key_max_length = 24;
+
+struct JoinKeyColumns
+{
+    Columns build;
+    Columns probe;
+};
+
+/** Same distribution as generate(): build keys are random and may repeat, a probe row copies a random build row
+  *  with probability match_possibility%. Strings have a uniform length in [1, max_length].
+  * Not stored in the dataset cache, the cache only knows rows of integer keys.
+  */
+JoinKeyColumns generateKeyColumns(JoinKeyType type, size_t build_size, size_t probe_size, size_t match_possibility, UInt64 seed, size_t max_length)
+{
+    static constexpr char alphabet[] = "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ";
+    std::mt19937_64 rng(seed ? seed : std::random_device()());
+    std::uniform_int_distribution<size_t> length_dist(1, std::max<size_t>(max_length, 1));
+    std::uniform_int_distribution<size_t> char_dist(0, sizeof(alphabet) - 2);
+    std::uniform_int_distribution<UInt64> int_dist(0, std::numeric_limits<UInt32>::max());
+
+    auto make_columns = [&]
     {
-        printf("a2 != b2");
-        return;
-    }*/
+        Columns columns;
+        if (type == JoinKeyType::Composite)
+            columns.emplace_back(std::make_unique<ColumnVector<UInt64>>());
+        columns.emplace_back(std::make_unique<ColumnString>());
+        return columns;
+    };
 
-    if (argc < 6)
+    JoinKeyColumns res{make_columns(), make_columns()};
+    auto & build_string = static_cast<ColumnString &>(*res.build.back());
+    auto & probe_string = static_cast<ColumnString &>(*res.probe.back());
+
+    std::string str;
+    for (size_t i = 0; i < build_size; ++i)
     {
-        printf("lack argument\n");
-        return;
+        str.resize(length_dist(rng));
+        for (auto & c : str)
+            c = alphabet[char_dist(rng)];
+        build_string.insertData(str.data(), str.size());
+        if (type == JoinKeyType::Composite)
+        {
+            UInt64 value = int_dist(rng);
+            res.build[0]->insertData(reinterpret_cast<const char *>(&value), sizeof(value));
+        }
     }
 
-    size_t RUN, n, m, match, construct_tuple;
-    sscanf(argv[1], "%zu", &RUN);
-    sscanf(argv[2], "%zu", &n);
-    sscanf(argv[3], "%zu", &m);
-    sscanf(argv[4], "%zu", &match);
-    sscanf(argv[5], "%zu", &construct_tuple);
+    std::uniform_int_distribution<size_t> row_dist(0, build_size ? build_size - 1 : 0);
+    std::uniform_int_distribution<size_t> match_dist(0, 99);
+    for (size_t i = 0; i < probe_size; ++i)
+    {
+        if (build_size && match_dist(rng) < match_possibility)
+        {
+            size_t row = row_dist(rng);
+            for (size_t col = 0; col < res.build.size(); ++col)
+            {
+                auto value = res.build[col]->getDataAt(row);
+                res.probe[col]->insertData(value.data, value.size);
+            }
+            continue;
+        }
+
+        str.resize(length_dist(rng));
+        for (auto & c : str)
+            c = alphabet[char_dist(rng)];
+        probe_string.insertData(str.data(), str.size());
+        if (type == JoinKeyType::Composite)
+        {
+            UInt64 value = int_dist(rng);
+            res.probe[0]->insertData(reinterpret_cast<const char *>(&value), sizeof(value));
+        }
+    }
+    return res;
+}
+
+/// The key of row i as one contiguous piece of `pool`, the caller owns the memory.
+inline StringRef serializeKeysToPoolContiguous(size_t i, const Columns & columns, Arena & pool)
+{
+    const char * begin = nullptr;
+    size_t sum_size = 0;
+    for (const auto & column : columns)
+        sum_size += column->serializeValueIntoArena(i, pool, begin).size;
+    return {begin, sum_size};
+}
+
+inline void appendMemoryRanges(const Columns & columns, std::vector<MemoryRange> & ranges)
+{
+    for (const auto & column : columns)
+    {
+        if (const auto * string_column = dynamic_cast<const ColumnString *>(column.get()))
+        {
+            ranges.push_back(memoryRange(string_column->getOffsets()));
+            ranges.push_back(memoryRange(string_column->getChars()));
+        }
+        else if (column->size())
+            ranges.push_back({column->getDataAt(0).data, column->size() * column->getDataAt(0).size});
+    }
+}
+
+/** Linear probing join on string or composite keys, the matched key columns are materialized by JoinOutputSink.
+  * A single string column is looked up with the StringRef into the column and copied into the Arena on insert,
+  *  multiple columns are serialized into the Arena first and a duplicate key gives the memory back.
+  * Rows with equal keys are chained through `next` like KeyValue::next.
+  */
+template<bool construct_tuple, bool saved_hash = false>
+void TestStringKeyLinear(JoinKeyType key_type, size_t build_size, size_t probe_size, size_t match_possibility)
+{
+    std::string log_head = std::string(saved_hash ? "linear(saved hash) " : "linear ") + toString(key_type) + " " + std::to_string(build_size) + "/" + std::to_string(probe_size) + "/" + std::to_string(match_possibility) + "/" + std::to_string(construct_tuple);
+
+    auto [build_columns, probe_columns] = generateKeyColumns(key_type, build_size, probe_size, match_possibility, dataset_options.seed, string_key_max_length);
+    bool serialize = build_columns.size() > 1;
+
+    static constexpr UInt32 END = std::numeric_limits<UInt32>::max();
+    using CKHashTable = std::conditional_t<saved_hash, HashMapWithSavedHash<StringRef, UInt32, StringRefHash>, HashMap<StringRef, UInt32, StringRefHash>>;
+
+    CKHashTable hash_table;
+    Arena pool;
+    std::vector<UInt32> next(build_size, END);
+
+    Stopwatch watch;
+    TscStopwatch tsc_watch;
+
+    for (size_t i = 0; i < build_size; ++i)
+    {
+        typename CKHashTable::LookupResult it;
+        bool inserted;
+        if (serialize)
+        {
+            StringRef key = serializeKeysToPoolContiguous(i, build_columns, pool);
+            hash_table.emplace(SerializedKeyHolder{key, pool}, it, inserted, hashStringCRC32(key.data, key.size));
+        }
+        else
+        {
+            StringRef key = build_columns[0]->getDataAt(i);
+            hash_table.emplace(ArenaKeyHolder{key, pool}, it, inserted, hashStringCRC32(key.data, key.size));
+        }
+
+        if (inserted)
+            new (&it->getMapped()) UInt32(i);
+        else
+        {
+            next[i] = next[it->getMapped()];
+            next[it->getMapped()] = i;
+        }
+    }
+
+    size_t collision = hash_table.getCollisions();
+    unsigned long long build_hash_time = watch.elapsedFromLastTime();
+    UInt64 build_cycles = tsc_watch.elapsedFromLastTime();
+
+    printf("%s build hash table time %llu, size %zu, buf %zu, collision %zu, arena %zu\n", log_head.c_str(), build_hash_time, hash_table.size(), hash_table.bufSize(), collision, pool.size());
+
+    std::vector<MemoryRange> ranges;
+    appendMemoryRanges(probe_columns, ranges);
+    ranges.push_back(memoryRange(next));
+    ranges.push_back({hash_table.getCell(0), hash_table.getBufferSizeInBytes()});
+    prepareCache(ranges);
+    watch.elapsedFromLastTime();
+    tsc_watch.elapsedFromLastTime();
+
+    JoinOutputSink sink(build_columns, probe_columns);
+    if constexpr (construct_tuple)
+        sink.reserve(probe_size);
+
+    Arena probe_pool;
+    size_t offset = 0;
+    BatchLatencyHistogram probe_latency;
+    for (size_t i = 0; i < probe_size; ++i)
+    {
+        probe_latency.step(i);
+        StringRef key = serialize ? serializeKeysToPoolContiguous(i, probe_columns, probe_pool) : probe_columns[0]->getDataAt(i);
+        auto * it = hash_table.find(key, hashStringCRC32(key.data, key.size));
+        if (serialize)
+            probe_pool.rollback(key.size);
+        if (it != nullptr)
+        {
+            if constexpr (construct_tuple)
+            {
+                for (UInt32 row = it->getMapped(); row != END; row = next[row])
+                {
+                    sink.add(row, i);
+                    ++offset;
+                }
+            }
+            else
+            {
+                ++offset;
+            }
+        }
+    }
+    sink.flush();
 
+    collision = hash_table.getCollisions() - collision;
+    unsigned long long probe_hash_time = watch.elapsedFromLastTime();
+    UInt64 probe_cycles = tsc_watch.elapsedFromLastTime();
+    probe_latency.finish();
+
+    if constexpr (construct_tuple)
+        printf("%s probe hash table + construct tuple time %llu, size %lu, collision %zu\n", log_head.c_str(), probe_hash_time, offset, collision);
+    else
+        printf("%s probe hash table time %llu, size %lu, collision %zu\n", log_head.c_str(), probe_hash_time, offset, collision);
+
+    unsigned long long total_time = build_hash_time + probe_hash_time;
+    printf("%s total_time %llu\n", log_head.c_str(), total_time);
+
+    last_join_result = {build_hash_time, probe_hash_time, total_time, offset, build_cycles, probe_cycles};
+    reportJoinCost(log_head, build_size, probe_size, last_join_result, probe_latency);
+}
+
+/// The rows as columns: the key and the payload as payload / 8 UInt64 columns, like a table with that many attributes.
+template<size_t payload>
+Columns toColumns(const std::vector<KeyValue<payload>> & kv)
+{
+    static_assert(payload % sizeof(UInt64) == 0);
+    Columns columns;
+    auto key = std::make_unique<ColumnVector<UInt64>>();
+    key->getData().reserve(kv.size());
+    for (const auto & row : kv)
+        key->getData().push_back(row.key);
+    columns.push_back(std::move(key));
+
+    for (size_t offset = 0; offset < payload; offset += sizeof(UInt64))
+    {
+        auto column = std::make_unique<ColumnVector<UInt64>>();
+        column->getData().resize(kv.size());
+        for (size_t i = 0; i < kv.size(); ++i)
+            memcpy(&column->getData()[i], kv[i].value.p + offset, sizeof(UInt64));
+        columns.push_back(std::move(column));
+    }
+    return columns;
+}
+
+inline std::vector<MemoryRange> memoryRanges(const Columns & columns)
+{
+    std::vector<MemoryRange> ranges;
+    appendMemoryRanges(columns, ranges);
+    return ranges;
+}
+
+/** TestLinear on columnar input with columnar output: the table maps a key to its first build row, equal keys
+  *  are chained through `next`, and the matches are gathered into output columns by JoinOutputSink.
+  * This is the cost an engine that works on blocks of columns pays, including materializing every payload column.
+  */
+template<bool construct_tuple, size_t build_payload = 8, size_t probe_payload = 8, typename HashMethod = HashCRC32<uint64_t>>
+void TestLinearColumnar(size_t build_size, size_t probe_size, size_t match_possibility)
+{
+    std::string log_head = "linear(columnar) " + std::to_string(build_size) + "/" + std::to_string(probe_size) + "/" + std::to_string(match_possibility) + "/" + std::to_string(construct_tuple);
+
+    Columns build_columns, probe_columns;
+    {
+        auto [build_kv, probe_kv] = init<build_payload, probe_payload>(build_size, probe_size, match_possibility);
+        build_columns = toColumns(build_kv);
+        probe_columns = toColumns(probe_kv);
+    }
+    const auto & build_keys = static_cast<const ColumnVector<UInt64> &>(*build_columns[0]).getData();
+    const auto & probe_keys = static_cast<const ColumnVector<UInt64> &>(*probe_columns[0]).getData();
+
+    static constexpr UInt32 END = std::numeric_limits<UInt32>::max();
+    using CKHashTable = HashMap<uint64_t, UInt32, HashMethod>;
+
+    CKHashTable hash_table;
+    std::vector<UInt32> next(build_size, END);
+
+    BatchedHashes<HashMethod, UInt64> build_hashes(build_keys);
+    BatchedHashes<HashMethod, UInt64> probe_hashes(probe_keys);
+
+    Stopwatch watch;
+    TscStopwatch tsc_watch;
+
+    for (size_t i = 0; i < build_size; ++i)
+    {
+        typename CKHashTable::LookupResult it;
+        bool inserted;
+        hash_table.emplace(build_keys[i], it, inserted, build_hashes.get(i));
+        if (inserted)
+            new (&it->getMapped()) UInt32(i);
+        else
+        {
+            next[i] = next[it->getMapped()];
+            next[it->getMapped()] = i;
+        }
+    }
+
+    size_t collision = hash_table.getCollisions();
+    unsigned long long build_hash_time = watch.elapsedFromLastTime();
+    UInt64 build_cycles = tsc_watch.elapsedFromLastTime();
+
+    printf("%s build hash table time %llu, size %zu, buf %zu, collision %zu\n", log_head.c_str(), build_hash_time, hash_table.size(), hash_table.bufSize(), collision);
+
+    auto ranges = memoryRanges(probe_columns);
+    appendMemoryRanges(build_columns, ranges);
+    ranges.push_back(memoryRange(next));
+    ranges.push_back({hash_table.getCell(0), hash_table.getBufferSizeInBytes()});
+    prepareCache(ranges);
+    watch.elapsedFromLastTime();
+    tsc_watch.elapsedFromLastTime();
+
+    JoinOutputSink sink(build_columns, probe_columns);
+    if constexpr (construct_tuple)
+        sink.reserve(probe_size);
+
+    size_t offset = 0;
+    BatchLatencyHistogram probe_latency;
+    for (size_t i = 0; i < probe_size; ++i)
+    {
+        probe_latency.step(i);
+        auto * it = hash_table.find(probe_keys[i], probe_hashes.get(i));
+        if (it != nullptr)
+        {
+            if constexpr (construct_tuple)
+            {
+                for (UInt32 row = it->getMapped(); row != END; row = next[row])
+                {
+                    sink.add(row, i);
+                    ++offset;
+                }
+            }
+            else
+            {
+                ++offset;
+            }
+        }
+    }
+    sink.flush();
+
+    collision = hash_table.getCollisions() - collision;
+    unsigned long long probe_hash_time = watch.elapsedFromLastTime();
+    UInt64 probe_cycles = tsc_watch.elapsedFromLastTime();
+    probe_latency.finish();
+
+    if constexpr (construct_tuple)
+        printf("%s probe hash table + materialize time %llu, size %lu, collision %zu, output %zu columns %zu bytes\n", log_head.c_str(), probe_hash_time, offset, collision,
+               sink.getBuildOutput().size() + sink.getProbeOutput().size(), byteSize(sink.getBuildOutput()) + byteSize(sink.getProbeOutput()));
+    else
+        printf("%s probe hash table time %llu, size %lu, collision %zu\n", log_head.c_str(), probe_hash_time, offset, collision);
+
+    unsigned long long total_time = build_hash_time + probe_hash_time;
+    printf("%s total_time %llu\n", log_head.c_str(), total_time);
+
+    last_join_result = {build_hash_time, probe_hash_time, total_time, offset, build_cycles, probe_cycles};
+    reportJoinCost(log_head, build_size, probe_size, last_join_result, probe_latency);
+}
+
+/// Call f() with a fixed dataset seed, so that several joins inside see the same keys.
+template<typename F>
+void withFixedSeed(F && f)
+{
+    UInt64 seed = dataset_options.seed;
+    if (dataset_options.seed == 0)
+        dataset_options.seed = std::random_device()() | 1;
+    f();
+    dataset_options.seed = seed;
+}
+
+void reportSavedHashChange(const std::string & log_head, const JoinResult & plain, const JoinResult & saved, size_t cell_size, size_t saved_cell_size)
+{
+    auto change = [](UInt64 before, UInt64 after) { return before ? (static_cast<double>(after) / before - 1) * 100 : 0.0; };
+    printf("%s saved hash vs plain: build %+.1f%%, probe %+.1f%%, total %+.1f%%, cell %zu -> %zu bytes\n",
+           log_head.c_str(),
+           change(plain.build_cycles, saved.build_cycles), change(plain.probe_cycles, saved.probe_cycles),
+           change(plain.build_cycles + plain.probe_cycles, saved.build_cycles + saved.probe_cycles),
+           cell_size, saved_cell_size);
+}
+
+/// Run the shared ConcurrentHashMap join and the thread-local build with partition-wise merge on the same input.
+template<bool construct_tuple, size_t build_payload, size_t probe_payload, typename HashMethod>
+void compareParallelBuild(size_t build_size, size_t probe_size, size_t match_possibility)
+{
+    JoinResult concurrent, thread_local_build;
+    withFixedSeed([&] {
+        TestConcurrent<construct_tuple, build_payload, probe_payload, HashMethod>(build_size, probe_size, match_possibility);
+        concurrent = last_join_result;
+        TestLinearThreadLocal<construct_tuple, build_payload, probe_payload, HashMethod>(build_size, probe_size, match_possibility);
+        thread_local_build = last_join_result;
+    });
+
+    auto change = [](UInt64 before, UInt64 after) { return before ? (static_cast<double>(after) / before - 1) * 100 : 0.0; };
+    printf("parallel build %zu threads %zu/%zu/%zu/%d thread local vs concurrent: build %+.1f%%, probe %+.1f%%, total %+.1f%%%s\n",
+           std::max<size_t>(1, std::min(build_threads, build_size)), build_size, probe_size, match_possibility, construct_tuple,
+           change(concurrent.build_time, thread_local_build.build_time), change(concurrent.probe_time, thread_local_build.probe_time),
+           change(concurrent.total_time, thread_local_build.total_time),
+           concurrent.output_size == thread_local_build.output_size ? "" : ", output sizes differ");
+}
+
+/// Run TestLinear with and without saved hashes on the same input and print what the saved hash changes.
+template<bool construct_tuple, size_t build_payload, size_t probe_payload, typename HashMethod>
+void compareSavedHash(size_t build_size, size_t probe_size, size_t match_possibility)
+{
+    JoinResult plain, saved;
+    withFixedSeed([&] {
+        TestLinear<construct_tuple, build_payload, probe_payload, HashMethod, false>(build_size, probe_size, match_possibility);
+        plain = last_join_result;
+        TestLinear<construct_tuple, build_payload, probe_payload, HashMethod, true>(build_size, probe_size, match_possibility);
+        saved = last_join_result;
+    });
+
+    std::string log_head = "linear " + std::to_string(build_size) + "/" + std::to_string(probe_size) + "/" + std::to_string(match_possibility) + "/" + std::to_string(construct_tuple);
+    reportSavedHashChange(log_head, plain, saved,
+        sizeof(HashMapCell<uint64_t, void *, HashMethod>), sizeof(HashMapCellWithSavedHash<uint64_t, void *, HashMethod>));
+}
+
+template<bool construct_tuple>
+void compareStringKeySavedHash(JoinKeyType key_type, size_t build_size, size_t probe_size, size_t match_possibility)
+{
+    JoinResult plain, saved;
+    withFixedSeed([&] {
+        TestStringKeyLinear<construct_tuple, false>(key_type, build_size, probe_size, match_possibility);
+        plain = last_join_result;
+        TestStringKeyLinear<construct_tuple, true>(key_type, build_size, probe_size, match_possibility);
+        saved = last_join_result;
+    });
+
+    std::string log_head = std::string("linear ") + toString(key_type) + " " + std::to_string(build_size) + "/" + std::to_string(probe_size) + "/" + std::to_string(match_possibility) + "/" + std::to_string(construct_tuple);
+    reportSavedHashChange(log_head, plain, saved,
+        sizeof(HashMapCell<StringRef, UInt32, StringRefHash>), sizeof(HashMapCellWithSavedHash<StringRef, UInt32, StringRefHash>));
+}
+
+/// RUN 0 is the linear probing join, RUN 8 compares it with and without saved hashes.
+bool runStringKeyHashJoin(JoinKeyType key_type, size_t RUN, size_t n, size_t m, size_t match, size_t construct_tuple)
+{
     if (RUN == 0)
     {
         if (construct_tuple)
-            TestLinear<true>(n, m, match);
+            TestStringKeyLinear<true>(key_type, n, m, match);
         else
-            TestLinear<false>(n, m, match);
+            TestStringKeyLinear<false>(key_type, n, m, match);
+    }
+    else if (RUN == 8)
+    {
+        if (construct_tuple)
+            compareStringKeySavedHash<true>(key_type, n, m, match);
+        else
+            compareStringKeySavedHash<false>(key_type, n, m, match);
+    }
+    else
+    {
+        printf("RUN %zu doesn't support --key=%s\n", RUN, toString(key_type));
+        return false;
+    }
+    return true;
+}
+
+template<size_t build_payload, size_t probe_payload, typename HashMethod = HashCRC32<uint64_t>>
+bool runHashJoin(size_t RUN, size_t n, size_t m, size_t match, size_t construct_tuple)
+{
+    if (RUN == 0)
+    {
+        if (construct_tuple)
+            TestLinear<true, build_payload, probe_payload, HashMethod>(n, m, match);
+        else
+            TestLinear<false, build_payload, probe_payload, HashMethod>(n, m, match);
     }
     else if (RUN == 1)
     {
         if (construct_tuple)
-            TestLinearPrefetch<true>(n, m, match);
+            TestLinearPrefetch<true, build_payload, probe_payload, HashMethod>(n, m, match);
         else
-            TestLinearPrefetch<false>(n, m, match);
+            TestLinearPrefetch<false, build_payload, probe_payload, HashMethod>(n, m, match);
     }
     else if (RUN == 2)
     {
         if (construct_tuple)
-            TestChained<true>(n, m, match);
+            TestChained<true, build_payload, probe_payload, HashMethod>(n, m, match);
         else
-            TestChained<false>(n, m, match);
+            TestChained<false, build_payload, probe_payload, HashMethod>(n, m, match);
     }
     else if (RUN == 3)
     {
-        TestChainedPrefetch<false>(n, m, match);
+        TestChainedPrefetch<false, build_payload, probe_payload, HashMethod>(n, m, match);
     }
     else if (RUN == 4)
     {
         if (construct_tuple)
-            TestMyLinear<true>(n, m, match);
+            TestMyLinear<true, build_payload, probe_payload, HashMethod>(n, m, match);
         else
-            TestMyLinear<false>(n, m, match);
+            TestMyLinear<false, build_payload, probe_payload, HashMethod>(n, m, match);
     }
     else if (RUN == 5)
     {
         if (construct_tuple)
-            TestMyLinear2<true>(n, m, match);
+            TestMyLinear2<true, build_payload, probe_payload, HashMethod>(n, m, match);
         else
-            TestMyLinear2<false>(n, m, match);
+            TestMyLinear2<false, build_payload, probe_payload, HashMethod>(n, m, match);
     }
     else if (RUN == 6)
     {
         if (construct_tuple)
-            TestYangHash<true>(n, m, match);
+            TestYangHash<true, build_payload, probe_payload, HashMethod>(n, m, match);
         else
-            TestYangHash<false>(n, m, match);
+            TestYangHash<false, build_payload, probe_payload, HashMethod>(n, m, match);
     }
     else if (RUN == 7)
     {
         if (construct_tuple)
-            TestYangChained<true>(n, m, match);
+            TestYangChained<true, build_payload, probe_payload, HashMethod>(n, m, match);
+        else
+            TestYangChained<false, build_payload, probe_payload, HashMethod>(n, m, match);
+    }
+    else if (RUN == 8)
+    {
+        if (construct_tuple)
+            compareSavedHash<true, build_payload, probe_payload, HashMethod>(n, m, match);
+        else
+            compareSavedHash<false, build_payload, probe_payload, HashMethod>(n, m, match);
+    }
+    else if (RUN == 9)
+    {
+        if (construct_tuple)
+            TestLinearColumnar<true, build_payload, probe_payload, HashMethod>(n, m, match);
+        else
+            TestLinearColumnar<false, build_payload, probe_payload, HashMethod>(n, m, match);
+    }
+    else if (RUN == 10)
+    {
+        if (construct_tuple)
+            TestChainedParallel<true, build_payload, probe_payload, HashMethod>(n, m, match);
+        else
+            TestChainedParallel<false, build_payload, probe_payload, HashMethod>(n, m, match);
+    }
+    else if (RUN == 11)
+    {
+        if (construct_tuple)
+            TestConcurrent<true, build_payload, probe_payload, HashMethod>(n, m, match);
+        else
+            TestConcurrent<false, build_payload, probe_payload, HashMethod>(n, m, match);
+    }
+    else if (RUN == 12)
+    {
+        if (construct_tuple)
+            TestLinearThreadLocal<true, build_payload, probe_payload, HashMethod>(n, m, match);
+        else
+            TestLinearThreadLocal<false, build_payload, probe_payload, HashMethod>(n, m, match);
+    }
+    else if (RUN == 13)
+    {
+        if (construct_tuple)
+            compareParallelBuild<true, build_payload, probe_payload, HashMethod>(n, m, match);
         else
-            TestYangChained<false>(n, m, match);
+            compareParallelBuild<false, build_payload, probe_payload, HashMethod>(n, m, match);
     }
     else
     {
         printf("unknown type: %zu\n", RUN);
+        return false;
+    }
+    return true;
+}
+
+/// Payload widths (in bytes) that have a compiled instantiation of every variant.
+static constexpr size_t PAYLOAD_WIDTHS[] = {0, 8, 16, 32, 64, 128, 256};
+
+/// Instantiating every (build, probe) pair makes the build several minutes long,
+///  so only equal widths and pairs with one side at the default width of 8 are compiled.
+constexpr bool isPayloadPairInstantiated(size_t build_width, size_t probe_width)
+{
+    return build_width == probe_width || build_width == 8 || probe_width == 8;
+}
+
+/// Call f(std::integral_constant<size_t, width>) for a runtime width. Returns false if the width is not instantiated.
+template<typename F>
+bool dispatchPayloadWidth(size_t width, F && f)
+{
+    switch (width)
+    {
+        case 0: f(std::integral_constant<size_t, 0>()); return true;
+        case 8: f(std::integral_constant<size_t, 8>()); return true;
+        case 16: f(std::integral_constant<size_t, 16>()); return true;
+        case 32: f(std::integral_constant<size_t, 32>()); return true;
+        case 64: f(std::integral_constant<size_t, 64>()); return true;
+        case 128: f(std::integral_constant<size_t, 128>()); return true;
+        case 256: f(std::integral_constant<size_t, 256>()); return true;
+        default: return false;
+    }
+}
+
+/// Call f(HashMethod()) for a hash policy name: crc32, murmur, mulshift or mul128. Returns false for an unknown name.
+template<typename F>
+bool dispatchHashMethod(const std::string & name, F && f)
+{
+    if (name == "crc32")
+        f(HashCRC32<uint64_t>());
+    else if (name == "murmur")
+        f(HashIntHash64());
+    else if (name == "mulshift")
+        f(HashMultiplyShift());
+    else if (name == "mul128")
+        f(HashMul128Fold());
+    else
+        return false;
+    return true;
+}
+
+/// Other hash methods than the default are only instantiated for the default payload widths, to keep the build time bounded.
+/// Call f(std::integral_constant<JoinKind, kind>) for a runtime join kind.
+template<typename F>
+void dispatchJoinKind(JoinKind kind, F && f)
+{
+    switch (kind)
+    {
+        case JoinKind::Inner: f(std::integral_constant<JoinKind, JoinKind::Inner>()); break;
+        case JoinKind::Left: f(std::integral_constant<JoinKind, JoinKind::Left>()); break;
+        case JoinKind::Right: f(std::integral_constant<JoinKind, JoinKind::Right>()); break;
+        case JoinKind::Full: f(std::integral_constant<JoinKind, JoinKind::Full>()); break;
+        case JoinKind::Semi: f(std::integral_constant<JoinKind, JoinKind::Semi>()); break;
+        case JoinKind::Anti: f(std::integral_constant<JoinKind, JoinKind::Anti>()); break;
+    }
+}
+
+/// Join kinds other than inner are compiled for the linear (RUN 0) and chained (RUN 2) variants with the default payload widths.
+bool runHashJoinWithKind(size_t RUN, size_t n, size_t m, size_t match, size_t construct_tuple, JoinKind kind)
+{
+    if (RUN != 0 && RUN != 2)
+    {
+        printf("RUN %zu doesn't support --join=%s\n", RUN, toString(kind));
+        return false;
+    }
+
+    dispatchJoinKind(kind, [&](auto join_kind) {
+        static constexpr JoinKind K = decltype(join_kind)::value;
+        using HashMethod = HashCRC32<uint64_t>;
+        if (RUN == 0 && construct_tuple)
+            TestLinear<true, 8, 8, HashMethod, false, K>(n, m, match);
+        else if (RUN == 0)
+            TestLinear<false, 8, 8, HashMethod, false, K>(n, m, match);
+        else if (construct_tuple)
+            TestChained<true, 8, 8, HashMethod, K>(n, m, match);
+        else
+            TestChained<false, 8, 8, HashMethod, K>(n, m, match);
+    });
+    return true;
+}
+
+bool runHashJoinWithHash(size_t RUN, size_t n, size_t m, size_t match, size_t construct_tuple, const std::string & hash)
+{
+    bool res = false;
+    bool dispatched = dispatchHashMethod(hash, [&](auto hash_method) {
+        res = runHashJoin<8, 8, decltype(hash_method)>(RUN, n, m, match, construct_tuple);
+    });
+    if (!dispatched)
+        printf("unknown hash method: %s\n", hash.c_str());
+    return dispatched && res;
+}
+
+bool runHashJoinWithPayload(size_t RUN, size_t n, size_t m, size_t match, size_t construct_tuple, size_t build_width, size_t probe_width)
+{
+    bool res = false;
+    bool dispatched = dispatchPayloadWidth(build_width, [&](auto build_payload) {
+        dispatchPayloadWidth(probe_width, [&](auto probe_payload) {
+            if constexpr (isPayloadPairInstantiated(decltype(build_payload)::value, decltype(probe_payload)::value))
+                res = runHashJoin<decltype(build_payload)::value, decltype(probe_payload)::value>(RUN, n, m, match, construct_tuple);
+        });
+    });
+    if (!dispatched || !res)
+        printf("unsupported payload width: build %zu, probe %zu\n", build_width, probe_width);
+    return dispatched && res;
+}
+
+/** Run one variant for every payload width and print how the throughput changes with the row width.
+  * `sweep` is "build", "probe" or "both": which side gets the swept width, the other side keeps its fixed width,
+  *  which has to be 8 for a one-sided sweep (see isPayloadPairInstantiated).
+  */
+void sweepPayloadWidth(size_t RUN, size_t n, size_t m, size_t match, size_t construct_tuple, const std::string & sweep, size_t build_width, size_t probe_width)
+{
+    struct Row
+    {
+        size_t build_width;
+        size_t probe_width;
+        JoinResult result;
+    };
+    std::vector<Row> rows;
+
+    for (size_t width : PAYLOAD_WIDTHS)
+    {
+        size_t b = sweep == "probe" ? build_width : width;
+        size_t p = sweep == "build" ? probe_width : width;
+        if (!runHashJoinWithPayload(RUN, n, m, match, construct_tuple, b, p))
+            return;
+        rows.push_back({b, p, last_join_result});
+    }
+
+    printf("payload sweep %zu %zu/%zu/%zu/%zu\n", RUN, n, m, match, construct_tuple);
+    printf("build_payload probe_payload build_time probe_time total_time output build_Mrows/s probe_Mrows/s build_cycles/row probe_cycles/row probe_slowdown\n");
+    for (const auto & row : rows)
+    {
+        const auto & r = row.result;
+        printf("%zu %zu %lu %lu %lu %zu %.2f %.2f %.2f %.2f %.2f\n",
+               row.build_width, row.probe_width, r.build_time, r.probe_time, r.total_time, r.output_size,
+               r.build_time ? n * 1e3 / r.build_time : 0.0,
+               r.probe_time ? m * 1e3 / r.probe_time : 0.0,
+               n ? static_cast<double>(r.build_cycles) / n : 0.0,
+               m ? static_cast<double>(r.probe_cycles) / m : 0.0,
+               rows[0].result.probe_time ? static_cast<double>(r.probe_time) / rows[0].result.probe_time : 0.0);
+    }
+}
+
+/// Selectivities in percent of the residual condition for --residual_sweep=all.
+static constexpr size_t RESIDUAL_SELECTIVITIES[] = {1, 10, 25, 50, 100};
+
+/// A comma separated list of numbers, e.g. "1,10,50". Items that are not numbers are skipped.
+inline std::vector<size_t> parseSizeList(const std::string & str)
+{
+    std::vector<size_t> res;
+    size_t pos = 0;
+    while (pos < str.size())
+    {
+        size_t end = str.find(',', pos);
+        if (end == std::string::npos)
+            end = str.size();
+        size_t value;
+        if (sscanf(str.substr(pos, end - pos).c_str(), "%zu", &value) == 1)
+            res.push_back(value);
+        pos = end + 1;
+    }
+    return res;
+}
+
+/// "all" or a comma separated list of percents.
+inline std::vector<size_t> parseSelectivities(const std::string & str)
+{
+    if (str == "all")
+        return {std::begin(RESIDUAL_SELECTIVITIES), std::end(RESIDUAL_SELECTIVITIES)};
+
+    std::vector<size_t> res;
+    for (size_t value : parseSizeList(str))
+    {
+        if (value <= 100)
+            res.push_back(value);
+    }
+    return res;
+}
+
+/** The residual condition build.ts < probe.ts evaluated in two ways on the same input: as a filter over the output
+  *  the equi-join materialized, and fused into the chain walk of the probe.
+  * RUN 2 is the chained table and RUN 6 YangHash, with the default payload widths. The output is always constructed.
+  */
+void sweepResidual(size_t RUN, size_t n, size_t m, size_t match, const std::vector<size_t> & selectivities)
+{
+    if (RUN != 2 && RUN != 6)
+    {
+        printf("RUN %zu doesn't support --residual_sweep\n", RUN);
+        return;
+    }
+
+    using HashMethod = HashCRC32<uint64_t>;
+    auto join = [&](auto residual, auto & input)
+    {
+        using Residual = decltype(residual);
+        if (RUN == 2)
+            return TestChained<true, 8, 8, HashMethod, JoinKind::Inner, Residual>(n, m, match, &input);
+        return TestYangHash<true, 8, 8, HashMethod, Residual>(n, m, match, &input);
+    };
+
+    struct Row
+    {
+        size_t selectivity;
+        JoinResult post;
+        UInt64 filter_time;
+        size_t post_output;
+        JoinResult fused;
+    };
+    std::vector<Row> rows;
+
+    for (size_t selectivity : selectivities)
+    {
+        auto input = init<8, 8>(n, m, match);
+        setTimestamps(std::get<0>(input), std::get<1>(input), selectivity, dataset_options.seed);
+
+        Row row{selectivity, {}, 0, 0, {}};
+        {
+            auto [output_build, output_probe] = join(NoResidual(), input);
+            row.post = last_join_result;
+
+            Stopwatch watch;
+            std::vector<KeyValue<8>> filtered_build;
+            std::vector<KeyValue<8>> filtered_probe;
+            TimestampLess residual;
+            for (size_t i = 0; i < output_build.size(); ++i)
+            {
+                if (residual(output_build[i], output_probe[i]))
+                {
+                    filtered_build.emplace_back(output_build[i]);
+                    filtered_probe.emplace_back(output_probe[i]);
+                }
+            }
+            row.filter_time = watch.elapsed();
+            row.post_output = filtered_build.size();
+        }
+
+        join(TimestampLess(), input);
+        row.fused = last_join_result;
+        rows.push_back(row);
+    }
+
+    printf("residual sweep %zu %zu/%zu/%zu\n", RUN, n, m, match);
+    printf("selectivity post_probe_time filter_time post_total_time fused_probe_time fused_total_time output speedup\n");
+    for (const auto & row : rows)
+    {
+        UInt64 post_total = row.post.total_time + row.filter_time;
+        printf("%zu%% %lu %lu %lu %lu %lu %zu%s %.2f\n",
+               row.selectivity, row.post.probe_time, row.filter_time, post_total, row.fused.probe_time, row.fused.total_time,
+               row.fused.output_size, row.fused.output_size == row.post_output ? "" : " (mismatch)",
+               row.fused.total_time ? static_cast<double>(post_total) / row.fused.total_time : 0.0);
+    }
+}
+
+/// "all" is every power of two up to the number of hardware threads, and the number itself.
+inline std::vector<size_t> parseThreadCounts(const std::string & str)
+{
+    size_t max_threads = std::max(1U, std::thread::hardware_concurrency());
+    if (str != "all")
+        return parseSizeList(str);
+
+    std::vector<size_t> res;
+    for (size_t threads = 1; threads < max_threads; threads *= 2)
+        res.push_back(threads);
+    res.push_back(max_threads);
+    return res;
+}
+
+/// Run a parallel variant with every thread count and print how the build and the probe scale.
+void sweepThreads(size_t RUN, size_t n, size_t m, size_t match, size_t construct_tuple, const std::vector<size_t> & thread_counts)
+{
+    struct Row
+    {
+        size_t threads;
+        JoinResult result;
+    };
+    std::vector<Row> rows;
+
+    withFixedSeed([&] {
+        for (size_t threads : thread_counts)
+        {
+            build_threads = std::max<size_t>(threads, 1);
+            if (!runHashJoinWithPayload(RUN, n, m, match, construct_tuple, 8, 8))
+                return;
+            rows.push_back({build_threads, last_join_result});
+        }
+    });
+
+    printf("thread sweep %zu %zu/%zu/%zu/%zu\n", RUN, n, m, match, construct_tuple);
+    printf("threads build_time probe_time build_Mrows/s build_speedup probe_Mrows/s probe_speedup\n");
+    for (const auto & row : rows)
+    {
+        const auto & r = row.result;
+        printf("%zu %lu %lu %.2f %.2f %.2f %.2f\n", row.threads, r.build_time, r.probe_time,
+               r.build_time ? n * 1e3 / r.build_time : 0.0,
+               r.build_time ? static_cast<double>(rows[0].result.build_time) / r.build_time : 0.0,
+               r.probe_time ? m * 1e3 / r.probe_time : 0.0,
+               r.probe_time ? static_cast<double>(rows[0].result.probe_time) / r.probe_time : 0.0);
+    }
+}
+
+/// --threads, --morsel and --schedule=static|steal of the parallel variants.
+inline bool applyThreadOptions(int argc, char ** argv)
+{
+    build_threads = std::max<size_t>(getOption(argc, argv, "threads", build_threads), 1);
+    probe_morsel_size = getOption(argc, argv, "morsel", probe_morsel_size);
+    if (!parseSchedule(getOption(argc, argv, "schedule", std::string(toString(probe_schedule))), probe_schedule))
+    {
+        printf("unknown schedule, --schedule takes static or steal\n");
+        return false;
+    }
+    return true;
+}
+
+/// --pin=none|cores|smt places the join workers, see PinPolicy.
+inline bool applyPinOption(int argc, char ** argv)
+{
+    if (!parsePinPolicy(getOption(argc, argv, "pin", std::string(toString(pin_policy))), pin_policy))
+    {
+        printf("unknown pin policy, --pin takes none, cores or smt\n");
+        return false;
+    }
+    CpuTopology::get().print();
+    printf("pin %s\n", toString(pin_policy));
+    return true;
+}
+
+/// --arch=default|sse42|avx2|avx512 overrides the target of the dispatched kernels, e.g. to measure the baseline on a new host.
+inline bool applyTargetArchOption(int argc, char ** argv)
+{
+    std::string name = getOption(argc, argv, "arch", std::string(toString(target_arch)));
+    TargetArch arch;
+    if (!parseTargetArch(name, arch) || !isArchSupported(arch))
+    {
+        printf("unknown or unsupported target arch: %s\n", name.c_str());
+        return false;
+    }
+    target_arch = arch;
+    printf("target arch %s, best supported %s\n", toString(target_arch), toString(detectTargetArch()));
+    return true;
+}
+
+void benchHashTable(int argc, char** argv)
+{
+    /*auto input = init<8, 8>(1000, 10000, 25);
+    auto [a1, a2] = TestChained<true>(1000, 10000, 25, &input);
+    auto [b1, b2] = TestYangHash<true>(1000, 10000, 25, &input);
+
+    if (!compare(a1, b1))
+    {
+        printf("a1 != b1");
+        return;
+    }
+    if (!compare(a2, b2))
+    {
+        printf("a2 != b2");
+        return;
+    }*/
+
+    if (argc < 6)
+    {
+        printf("lack argument\n");
+        return;
+    }
+
+    size_t RUN, n, m, match, construct_tuple;
+    sscanf(argv[1], "%zu", &RUN);
+    sscanf(argv[2], "%zu", &n);
+    sscanf(argv[3], "%zu", &m);
+    sscanf(argv[4], "%zu", &match);
+    sscanf(argv[5], "%zu", &construct_tuple);
+
+    /// The dataset cache is keyed by seed, so a cached run always uses a fixed one.
+    dataset_options.dir = getOption(argc, argv, "dataset", std::string());
+    dataset_options.seed = getOption(argc, argv, "seed", dataset_options.dir.empty() ? 0 : 1);
+    dataset_options.zipf = strtod(getOption(argc, argv, "zipf", std::string("0")).c_str(), nullptr);
+
+    if (!parseCacheMode(getOption(argc, argv, "cache", std::string("cold")), cache_options.mode)
+        || !parseEvictMethod(getOption(argc, argv, "evict", std::string("clflush")), cache_options.evict))
+    {
+        printf("unknown cache mode or evict method\n");
+        return;
+    }
+    printf("cache mode %s, evict %s, llc %zu\n", toString(cache_options.mode), toString(cache_options.evict), detectLLCSize());
+
+    if (!applyTargetArchOption(argc, argv) || !applyPinOption(argc, argv))
         return;
+
+    size_t build_width = getOption(argc, argv, "build_payload", 8);
+    size_t probe_width = getOption(argc, argv, "probe_payload", 8);
+    std::string sweep = getOption(argc, argv, "payload_sweep", std::string());
+    std::string hash = getOption(argc, argv, "hash", std::string("crc32"));
+
+    JoinKeyType key_type;
+    if (!parseJoinKeyType(getOption(argc, argv, "key", std::string("uint64")), key_type))
+    {
+        printf("unknown key type\n");
+        return;
+    }
+    string_key_max_length = getOption(argc, argv, "key_length", string_key_max_length);
+
+    JoinKind kind;
+    if (!parseJoinKind(getOption(argc, argv, "join", std::string("inner")), kind))
+    {
+        printf("unknown join kind\n");
+        return;
+    }
+
+    if (!applyThreadOptions(argc, argv))
+        return;
+
+    if (hasOption(argc, argv, "thread_sweep"))
+    {
+        auto thread_counts = parseThreadCounts(getOption(argc, argv, "thread_sweep", std::string()));
+        if (thread_counts.empty())
+            printf("--thread_sweep takes \"all\" or a list of thread counts, e.g. 1,2,4\n");
+        else if (kind != JoinKind::Inner || key_type != JoinKeyType::UInt64 || hash != "crc32" || build_width != 8 || probe_width != 8 || !sweep.empty())
+            printf("--thread_sweep only supports inner joins on uint64 keys, the crc32 hash and the default payload widths\n");
+        else
+            sweepThreads(RUN, n, m, match, construct_tuple, thread_counts);
     }
+    else if (hasOption(argc, argv, "residual_sweep"))
+    {
+        auto selectivities = parseSelectivities(getOption(argc, argv, "residual_sweep", std::string()));
+        if (selectivities.empty())
+            printf("--residual_sweep takes \"all\" or a list of percents, e.g. 1,10,50\n");
+        else if (kind != JoinKind::Inner || key_type != JoinKeyType::UInt64 || hash != "crc32" || build_width != 8 || probe_width != 8 || !sweep.empty())
+            printf("--residual_sweep only supports inner joins on uint64 keys, the crc32 hash and the default payload widths\n");
+        else
+            sweepResidual(RUN, n, m, match, selectivities);
+    }
+    else if (kind != JoinKind::Inner)
+    {
+        if (key_type != JoinKeyType::UInt64 || hash != "crc32" || build_width != 8 || probe_width != 8 || !sweep.empty())
+            printf("--join=%s only supports uint64 keys, the crc32 hash and the default payload widths\n", toString(kind));
+        else
+            runHashJoinWithKind(RUN, n, m, match, construct_tuple, kind);
+    }
+    else if (key_type != JoinKeyType::UInt64)
+    {
+        if (hash != "crc32" || build_width != 8 || probe_width != 8 || !sweep.empty())
+            printf("--key=%s only supports the crc32 hash and no payload\n", toString(key_type));
+        else
+            runStringKeyHashJoin(key_type, RUN, n, m, match, construct_tuple);
+    }
+    else if (hash != "crc32")
+    {
+        if (build_width != 8 || probe_width != 8 || !sweep.empty())
+            printf("--hash other than crc32 only supports the default payload widths\n");
+        else
+            runHashJoinWithHash(RUN, n, m, match, construct_tuple, hash);
+    }
+    else if (!sweep.empty())
+        sweepPayloadWidth(RUN, n, m, match, construct_tuple, sweep, build_width, probe_width);
+    else
+        runHashJoinWithPayload(RUN, n, m, match, construct_tuple, build_width, probe_width);
 }
@@ -1,8 +1,12 @@
 #pragma once
 
+#include <memory>
+#include <optional>
+
 #include "BenchHashJoin.h"
+#include "Spill.h"
 
-template<size_t payload>
+template<size_t payload, typename HashMethod = HashCRC32<uint64_t>>
 std::vector<std::vector<KeyValue<payload>>> partition(const std::vector<KeyValue<payload>> & input, size_t partition_num)
 {
     std::vector<std::vector<KeyValue<payload>>> ret;
@@ -15,11 +19,11 @@ std::vector<std::vector<KeyValue<payload>>> partition(const std::vector<KeyValue
         ret[i].reserve(expected_size);
     }
 
-    auto hash_method = HashCRC32<uint64_t>();
+    auto layout = makeHashBitLayout<HashMethod>(partition_num, 0);
+    BatchedHashes<HashMethod, KeyValue<payload>> hashes(input);
     for (size_t i = 0; i < size; ++i)
     {
-        uint32_t hash = hash_method(input[i].key);
-        size_t partition = (hash * partition_num) >> 32;
+        size_t partition = layout.partition(hashes.get(i));
         ret[partition].emplace_back(input[i]);
         //__builtin_prefetch(ret[partition].data() + ret[partition].size());
     }
@@ -27,10 +31,10 @@ std::vector<std::vector<KeyValue<payload>>> partition(const std::vector<KeyValue
     return ret;
 }
 
-template<size_t build_payload = 8, size_t probe_payload = 8>
+template<size_t build_payload = 8, size_t probe_payload = 8, typename HashMethod = HashCRC32<uint64_t>, JoinKind kind = JoinKind::Inner>
 void TestPartitionLinear(size_t build_size, size_t probe_size, size_t match_possibility, size_t partition_num)
 {
-    std::string log_head = "partition linear " + std::to_string(build_size) + "/" + std::to_string(probe_size) + "/" + std::to_string(match_possibility);
+    std::string log_head = "partition linear" + joinKindSuffix(kind) + " " + std::to_string(build_size) + "/" + std::to_string(probe_size) + "/" + std::to_string(match_possibility);
 
     auto [build_kv, probe_kv] = init<build_payload, probe_payload>(build_size, probe_size, match_possibility);
 
@@ -39,7 +43,7 @@ void TestPartitionLinear(size_t build_size, size_t probe_size, size_t match_poss
         KeyValue<build_payload> * kv = nullptr;
     };
 
-    using CKHashTable = HashMap<uint64_t, Cell, HashCRC32<uint64_t>>;
+    using CKHashTable = HashMap<uint64_t, Cell, HashMethod>;
 
     std::vector<CKHashTable> hash_table(partition_num);
 
@@ -48,7 +52,7 @@ void TestPartitionLinear(size_t build_size, size_t probe_size, size_t match_poss
     Stopwatch watch;
     Stopwatch watch2;
 
-    auto build_partition_kv = partition<build_payload>(build_kv, partition_num);
+    auto build_partition_kv = partition<build_payload, HashMethod>(build_kv, partition_num);
     printf("%s partition build time %llu\n", log_head.c_str(), watch.elapsedFromLastTime());
 
     for (size_t part = 0; part < partition_num; ++part)
@@ -56,16 +60,17 @@ void TestPartitionLinear(size_t build_size, size_t probe_size, size_t match_poss
         auto & build = build_partition_kv[part];
         auto & ht = hash_table[part];
         size_t size = build.size();
+        BatchedHashes<HashMethod, KeyValue<build_payload>> build_hashes(build);
         for (size_t i = 0; i < size; ++i)
         {
             typename CKHashTable::LookupResult it;
             bool inserted;
-            ht.emplace(build[i].key, it, inserted);
+            ht.emplace(build[i].key, it, inserted, build_hashes.get(i));
             if (inserted)
-                new(&it->getMapped()) MappedType(Cell{&build_kv[i]});
+                new(&it->getMapped()) MappedType(Cell{&build[i]});
             else {
-                build_kv[i].next = it->getMapped().kv->next;
-                it->getMapped().kv->next = &build_kv[i];
+                build[i].next = it->getMapped().kv->next;
+                it->getMapped().kv->next = &build[i];
             }
         }
     }
@@ -81,7 +86,7 @@ void TestPartitionLinear(size_t build_size, size_t probe_size, size_t match_poss
     }
     printf("%s build hash table time %llu, size %zu, buf %zu\n", log_head.c_str(), build_hash_time, hash_table_size, hash_table_buf_size);
 
-    auto probe_partition_kv = partition<probe_payload>(probe_kv, partition_num);
+    auto probe_partition_kv = partition<probe_payload, HashMethod>(probe_kv, partition_num);
     printf("%s partition probe time %llu\n", log_head.c_str(), watch.elapsedFromLastTime());
 
     std::vector<KeyValue<build_payload>> output_build;
@@ -89,41 +94,553 @@ void TestPartitionLinear(size_t build_size, size_t probe_size, size_t match_poss
     std::vector<KeyValue<probe_payload>> output_probe;
     output_probe.reserve(probe_size);
 
+    /// Build rows are numbered partition after partition for the matched map of RIGHT and FULL joins.
+    std::vector<size_t> build_row_begin(partition_num + 1);
+    for (size_t part = 0; part < partition_num; ++part)
+        build_row_begin[part + 1] = build_row_begin[part] + build_partition_kv[part].size();
+    KeyValueJoinOutput<kind, true, build_payload, probe_payload> output(kind == JoinKind::Inner ? 0 : build_size, kind == JoinKind::Inner ? 0 : probe_size);
+
     for (size_t part = 0; part < partition_num; ++part)
     {
         auto & probe = probe_partition_kv[part];
+        auto & build = build_partition_kv[part];
         auto & ht = hash_table[part];
         size_t size = probe.size();
+        BatchedHashes<HashMethod, KeyValue<probe_payload>> probe_hashes(probe);
         for (size_t i = 0; i < size; ++i)
         {
-            auto * it = ht.find(probe[i].key);
-            if (it != ht.end())
+            auto * it = ht.find(probe[i].key, probe_hashes.get(i));
+            if constexpr (kind == JoinKind::Inner)
+            {
+                if (it != ht.end())
+                {
+                    for (auto * p = it->getMapped().kv; p != nullptr; p = p->next)
+                    {
+                        output_build.emplace_back(*p);
+                        output_probe.emplace_back(probe[i]);
+                    }
+                }
+            }
+            else
             {
-                for (auto * p = it->getMapped().kv; p != nullptr; p = p->next)
+                if (it != ht.end())
                 {
-                    output_build.emplace_back(*p);
-                    output_probe.emplace_back(probe_kv[i]);
+                    for (auto * p = it->getMapped().kv; p != nullptr && output.match(*p, build_row_begin[part] + (p - build.data()), probe[i]); p = p->next)
+                        ;
                 }
+                output.probeEnd(probe[i]);
             }
         }
     }
 
+    size_t output_size = output_probe.size();
+    if constexpr (kind != JoinKind::Inner)
+    {
+        output.finish([&](size_t row) -> const auto & {
+            size_t part = std::upper_bound(build_row_begin.begin(), build_row_begin.end(), row) - build_row_begin.begin() - 1;
+            return build_partition_kv[part][row - build_row_begin[part]];
+        });
+        output_size = output.size();
+    }
+
     unsigned long long probe_hash_time = watch.elapsedFromLastTime();
 
-    printf("%s probe hash table + construct tuple time %llu, size %lu\n", log_head.c_str(), probe_hash_time, output_build.size());
+    printf("%s probe hash table + construct tuple time %llu, size %lu\n", log_head.c_str(), probe_hash_time, output_size);
 
     unsigned long long total_time = watch2.elapsedFromLastTime();
     printf("%s total_time %llu\n", log_head.c_str(), total_time);
+
+    /// The tables of all partitions have about the same size, the first one tells how many bucket bits they use.
+    auto layout = makeHashBitLayout<HashMethod>(partition_num, static_cast<size_t>(std::log2(hash_table[0].bufSize())));
+    layout.print(log_head);
+    reportPartitionOccupancy<HashMethod>(log_head, build_partition_kv, layout);
 }
 
-template<size_t build_payload = 8, size_t probe_payload = 8>
+/** TestPartitionLinear without the barriers between its phases. Once both inputs are partitioned, the workers of a
+  *  WorkStealingScheduler take one partition at a time: build its table, probe it, and free the table and the rows
+  *  of the partition right away. Only the tables of the partitions in flight are resident, about one per worker
+  *  instead of all of them, and a big partition doesn't hold up the others.
+  * The resident bytes are counted when a table is built, the peak is reported next to what all tables take together.
+  */
+template<size_t build_payload = 8, size_t probe_payload = 8, typename HashMethod = HashCRC32<uint64_t>>
+void TestPartitionPipelined(size_t build_size, size_t probe_size, size_t match_possibility, size_t partition_num)
+{
+    size_t threads = std::max<size_t>(1, std::min(build_threads, partition_num));
+    std::string log_head = "partition pipelined(" + std::to_string(threads) + " threads" + scheduleSuffix() + ") " + std::to_string(build_size) + "/" + std::to_string(probe_size) + "/" + std::to_string(match_possibility);
+
+    auto [build_kv, probe_kv] = init<build_payload, probe_payload>(build_size, probe_size, match_possibility);
+
+    struct Cell
+    {
+        KeyValue<build_payload> * kv = nullptr;
+    };
+
+    using CKHashTable = HashMap<uint64_t, Cell, HashMethod>;
+    using MappedType = typename CKHashTable::mapped_type;
+
+    Stopwatch watch;
+    Stopwatch watch2;
+
+    auto build_partition_kv = partition<build_payload, HashMethod>(build_kv, partition_num);
+    auto probe_partition_kv = partition<probe_payload, HashMethod>(probe_kv, partition_num);
+    printf("%s partition time %llu\n", log_head.c_str(), watch.elapsedFromLastTime());
+
+    std::vector<std::vector<KeyValue<build_payload>>> output_build(threads);
+    std::vector<std::vector<KeyValue<probe_payload>>> output_probe(threads);
+    for (size_t worker = 0; worker < threads; ++worker)
+    {
+        output_build[worker].reserve(probe_size / threads);
+        output_probe[worker].reserve(probe_size / threads);
+    }
+
+    std::atomic<size_t> resident_bytes{0};
+    std::atomic<size_t> peak_bytes{0};
+    std::atomic<size_t> all_tables_bytes{0};
+
+    WorkStealingScheduler scheduler(threads, 1);
+    const auto & worker_stats = scheduler.run(probe_schedule, partition_num, [&](size_t worker, size_t begin, size_t end)
+    {
+        for (size_t part = begin; part < end; ++part)
+        {
+            auto & build = build_partition_kv[part];
+            auto & probe = probe_partition_kv[part];
+            {
+                CKHashTable ht;
+                BatchedHashes<HashMethod, KeyValue<build_payload>> build_hashes(build);
+                for (size_t i = 0; i < build.size(); ++i)
+                {
+                    typename CKHashTable::LookupResult it;
+                    bool inserted;
+                    ht.emplace(build[i].key, it, inserted, build_hashes.get(i));
+                    if (inserted)
+                        new (&it->getMapped()) MappedType(Cell{&build[i]});
+                    else
+                    {
+                        build[i].next = it->getMapped().kv->next;
+                        it->getMapped().kv->next = &build[i];
+                    }
+                }
+
+                size_t bytes = ht.getBufferSizeInBytes();
+                size_t resident = resident_bytes.fetch_add(bytes) + bytes;
+                size_t peak = peak_bytes.load();
+                while (resident > peak && !peak_bytes.compare_exchange_weak(peak, resident))
+                    ;
+                all_tables_bytes += bytes;
+
+                BatchedHashes<HashMethod, KeyValue<probe_payload>> probe_hashes(probe);
+                for (size_t i = 0; i < probe.size(); ++i)
+                {
+                    auto * it = ht.find(probe[i].key, probe_hashes.get(i));
+                    if (it == nullptr)
+                        continue;
+                    for (auto * p = it->getMapped().kv; p != nullptr; p = p->next)
+                    {
+                        output_build[worker].emplace_back(*p);
+                        output_probe[worker].emplace_back(probe[i]);
+                    }
+                }
+                resident_bytes -= bytes;
+            }
+            std::vector<KeyValue<build_payload>>().swap(build);
+            std::vector<KeyValue<probe_payload>>().swap(probe);
+        }
+    });
+
+    size_t output_size = 0;
+    for (const auto & output : output_probe)
+        output_size += output.size();
+
+    unsigned long long join_time = watch.elapsedFromLastTime();
+    printf("%s build and probe + construct tuple time %llu, size %lu, peak table bytes %zu, all tables %zu\n",
+           log_head.c_str(), join_time, output_size, peak_bytes.load(), all_tables_bytes.load());
+
+    unsigned long long total_time = watch2.elapsedFromLastTime();
+    printf("%s total_time %llu\n", log_head.c_str(), total_time);
+    printWorkerStats(log_head + " join", worker_stats);
+}
+
+/** One level of the partitioning of a Grace hash join. Every level splits by the top log2(fanout) bits of the hash
+  *  that the levels above didn't use, so a partition that is still too big is split again by fresh bits.
+  */
+struct SpillLevel
+{
+    HashBitLayout layout;
+    size_t used_bits = 0;
+
+    size_t fanout() const { return layout.partition_num; }
+    size_t bits() const { return layout.partition_bits; }
+    /// Whether `fanout` more partitions can be told apart by the bits left.
+    bool canSplit() const { return used_bits + bits() <= layout.hash_bits; }
+
+    size_t partition(size_t hash) const
+    {
+        size_t mask = layout.hash_bits >= 64 ? ~0ULL : (1ULL << layout.hash_bits) - 1;
+        return layout.partition((hash << used_bits) & mask);
+    }
+};
+
+/** Inner join of inputs that don't fit into `memory_budget`, by the Grace hash join.
+  * Both inputs are partitioned into spill files by the same hash bits. Then the partitions are joined one at a time:
+  *  the build rows of a partition are read back and put into a hash table, and its probe rows are streamed through it.
+  * A partition whose build side would still take more than the budget is partitioned again by the next bits of the hash,
+  *  recursively. A partition that doesn't get smaller this way, e.g. a key with too many duplicates, is joined over
+  *  the budget and counted in SpillStats::oversized.
+  * The budget covers the build rows and the hash table of a partition; the spill buffers and the joined output are outside it.
+  */
+template<size_t build_payload, size_t probe_payload, typename HashMethod>
+class GraceHashJoin
+{
+public:
+    using BuildRow = KeyValue<build_payload>;
+    using ProbeRow = KeyValue<probe_payload>;
+
+    /// Every spill file has its own write buffer, this bounds the buffers to MAX_FANOUT * SpillFile::BUFFER_BYTES.
+    static constexpr size_t MAX_FANOUT = 256;
+
+    GraceHashJoin(size_t memory_budget_, size_t probe_size)
+        : memory_budget(std::max<size_t>(memory_budget_, 1))
+    {
+        output_build.reserve(probe_size);
+        output_probe.reserve(probe_size);
+    }
+
+    /// The memory a partition of `rows` build rows takes in the join: the rows and a table at most half full.
+    static size_t buildBytes(size_t rows) { return rows * (sizeof(BuildRow) + 2 * sizeof(HashMapCell<uint64_t, void *, HashMethod>)); }
+
+    bool fits(size_t rows) const { return buildBytes(rows) <= memory_budget; }
+
+    /// The power of two fanout below `used_bits` that brings partitions of `rows` rows under the budget.
+    SpillLevel level(size_t rows, size_t used_bits, size_t fanout = 0) const
+    {
+        if (fanout == 0)
+        {
+            fanout = 2;
+            while (fanout < MAX_FANOUT && buildBytes(rows) / fanout > memory_budget)
+                fanout *= 2;
+        }
+        fanout = std::min<size_t>(1ULL << static_cast<size_t>(std::ceil(std::log2(std::max<size_t>(fanout, 2)))), MAX_FANOUT);
+        return {makeHashBitLayout<HashMethod>(fanout, 0), used_bits};
+    }
+
+    template<typename Row>
+    SpillFile<Row> makeFile() { return SpillFile<Row>(stats); }
+
+    template<typename Row>
+    std::vector<SpillFile<Row>> makeFiles(size_t count)
+    {
+        std::vector<SpillFile<Row>> res;
+        res.reserve(count);
+        for (size_t i = 0; i < count; ++i)
+            res.emplace_back(stats);
+        return res;
+    }
+
+    /// Append every row to the file of its partition.
+    template<typename Row>
+    static void spill(const Row * rows, size_t count, const SpillLevel & level, std::vector<SpillFile<Row>> & files)
+    {
+        BatchedHashes<HashMethod, Row> hashes(rows, count);
+        for (size_t i = 0; i < count; ++i)
+            files[level.partition(hashes.get(i))].append(rows[i]);
+    }
+
+    template<typename Row>
+    static void finishWrite(std::vector<SpillFile<Row>> & files)
+    {
+        for (auto & file : files)
+            file.finishWrite();
+    }
+
+    /// Join one pair of spilled partitions that were split by `used_bits` bits of the hash.
+    void joinSpilled(SpillFile<BuildRow> & build, SpillFile<ProbeRow> & probe, size_t used_bits, size_t depth, bool splittable = true)
+    {
+        /// Nothing of an inner join comes out of a partition without build rows, its probe rows are not even read.
+        if (build.size() == 0)
+            return;
+
+        if (!fits(build.size()))
+        {
+            auto next = level(build.size(), used_bits);
+            if (splittable && next.canSplit())
+            {
+                repartition(build, probe, next, depth + 1);
+                return;
+            }
+            ++stats.oversized;
+        }
+
+        std::vector<BuildRow> rows;
+        build.readAll(rows);
+        build.release();
+        joinInMemory(rows, [&](auto && f) { probe.forEachChunk(f); });
+        probe.release();
+    }
+
+    /// The hash table of one partition, the rows with the same key are chained through their `next` pointers.
+    class PartitionTable
+    {
+    public:
+        explicit PartitionTable(std::vector<BuildRow> & build)
+        {
+            BatchedHashes<HashMethod, BuildRow> build_hashes(build);
+            for (size_t i = 0; i < build.size(); ++i)
+            {
+                typename CKHashTable::LookupResult it;
+                bool inserted;
+                build[i].next = nullptr;
+                ht.emplace(build[i].key, it, inserted, build_hashes.get(i));
+                if (inserted)
+                    new (&it->getMapped()) MappedType(Cell{&build[i]});
+                else
+                {
+                    build[i].next = it->getMapped().kv->next;
+                    it->getMapped().kv->next = &build[i];
+                }
+            }
+        }
+
+        size_t bytes() const { return ht.getBufferSizeInBytes(); }
+
+        /// The chain of build rows with the key of `probe`, nullptr without a match.
+        const BuildRow * ALWAYS_INLINE find(const ProbeRow & probe, size_t hash) const
+        {
+            const auto * it = ht.find(probe.key, hash);
+            return it == nullptr ? nullptr : it->getMapped().kv;
+        }
+
+    private:
+        struct Cell
+        {
+            BuildRow * kv = nullptr;
+        };
+        using CKHashTable = HashMap<uint64_t, Cell, HashMethod>;
+        using MappedType = typename CKHashTable::mapped_type;
+
+        CKHashTable ht;
+    };
+
+    void ALWAYS_INLINE probe(const PartitionTable & table, const ProbeRow & row, size_t hash)
+    {
+        for (const auto * p = table.find(row, hash); p != nullptr; p = p->next)
+        {
+            output_build.emplace_back(*p);
+            output_probe.emplace_back(row);
+        }
+    }
+
+    /** Build a table of `build` rows and probe it with the rows that for_each_probe_chunk(f) passes to
+      *  f(const ProbeRow * rows, size_t count).
+      */
+    template<typename ForEachProbeChunk>
+    void joinInMemory(std::vector<BuildRow> & build, ForEachProbeChunk && for_each_probe_chunk)
+    {
+        PartitionTable table(build);
+        peak_bytes = std::max(peak_bytes, build.capacity() * sizeof(BuildRow) + table.bytes());
+
+        for_each_probe_chunk([&](const ProbeRow * rows, size_t count)
+        {
+            BatchedHashes<HashMethod, ProbeRow> probe_hashes(rows, count);
+            for (size_t i = 0; i < count; ++i)
+                probe(table, rows[i], probe_hashes.get(i));
+        });
+    }
+
+    /// For the memory the caller keeps itself, e.g. the resident partitions of a hybrid hash join.
+    void notePeakBytes(size_t bytes) { peak_bytes = std::max(peak_bytes, bytes); }
+
+    size_t outputSize() const { return output_probe.size(); }
+    size_t peakBytes() const { return peak_bytes; }
+    const SpillStats & spillStats() const { return stats; }
+
+private:
+    void repartition(SpillFile<BuildRow> & build, SpillFile<ProbeRow> & probe, const SpillLevel & next, size_t depth)
+    {
+        stats.max_depth = std::max(stats.max_depth, depth);
+
+        auto build_files = makeFiles<BuildRow>(next.fanout());
+        build.forEachChunk([&](const BuildRow * rows, size_t count) { spill(rows, count, next, build_files); });
+        finishWrite(build_files);
+        size_t parent_rows = build.size();
+        build.release();
+
+        auto probe_files = makeFiles<ProbeRow>(next.fanout());
+        probe.forEachChunk([&](const ProbeRow * rows, size_t count) { spill(rows, count, next, probe_files); });
+        finishWrite(probe_files);
+        probe.release();
+
+        for (size_t part = 0; part < next.fanout(); ++part)
+            joinSpilled(build_files[part], probe_files[part], next.used_bits + next.bits(), depth, build_files[part].size() < parent_rows);
+    }
+
+    size_t memory_budget;
+    SpillStats stats;
+    size_t peak_bytes = 0;
+    std::vector<BuildRow> output_build;
+    std::vector<ProbeRow> output_probe;
+};
+
+/** Grace hash join of the whole input under spill_options.memory_budget. `partition_num` is the fanout of the first
+  *  level, 0 derives it from the budget.
+  * Both inputs are released once they are spilled, so that only the partition in the join is in memory.
+  */
+template<size_t build_payload = 8, size_t probe_payload = 8, typename HashMethod = HashCRC32<uint64_t>>
+void TestPartitionGrace(size_t build_size, size_t probe_size, size_t match_possibility, size_t partition_num)
+{
+    std::string log_head = "partition grace " + std::to_string(build_size) + "/" + std::to_string(probe_size) + "/" + std::to_string(match_possibility);
+
+    auto [build_kv, probe_kv] = init<build_payload, probe_payload>(build_size, probe_size, match_possibility);
+
+    using Join = GraceHashJoin<build_payload, probe_payload, HashMethod>;
+
+    Stopwatch watch;
+    Stopwatch watch2;
+
+    Join join(spill_options.memory_budget, probe_size);
+    auto level = join.level(build_size, 0, partition_num);
+
+    auto build_files = join.template makeFiles<typename Join::BuildRow>(level.fanout());
+    Join::spill(build_kv.data(), build_kv.size(), level, build_files);
+    Join::finishWrite(build_files);
+    std::vector<KeyValue<build_payload>>().swap(build_kv);
+
+    auto probe_files = join.template makeFiles<typename Join::ProbeRow>(level.fanout());
+    Join::spill(probe_kv.data(), probe_kv.size(), level, probe_files);
+    Join::finishWrite(probe_files);
+    std::vector<KeyValue<probe_payload>>().swap(probe_kv);
+
+    printf("%s partition time %llu, fanout %zu, budget %zu, build needs %zu\n", log_head.c_str(), watch.elapsedFromLastTime(),
+           level.fanout(), spill_options.memory_budget, Join::buildBytes(build_size));
+
+    for (size_t part = 0; part < level.fanout(); ++part)
+        join.joinSpilled(build_files[part], probe_files[part], level.bits(), 0);
+
+    unsigned long long join_time = watch.elapsedFromLastTime();
+    printf("%s join partitions + construct tuple time %llu, size %lu, peak partition bytes %zu\n",
+           log_head.c_str(), join_time, join.outputSize(), join.peakBytes());
+    join.spillStats().print(log_head);
+
+    unsigned long long total_time = watch2.elapsedFromLastTime();
+    printf("%s total_time %llu\n", log_head.c_str(), total_time);
+}
+
+/// The default fanout of the hybrid hash join makes a partition about this fraction of the memory budget.
+inline constexpr size_t HYBRID_PARTITIONS_PER_BUDGET = 8;
+
+/** Hybrid hash join under spill_options.memory_budget, a Grace hash join that keeps as many build partitions in memory
+  *  as the budget holds.
+  * The build rows are partitioned into memory. Whenever they outgrow the budget, the resident partition with the highest
+  *  number is written to its spill file, and its later rows go straight there. So a build side a bit over the budget
+  *  spills a partition or two, and the spilled share grows with the build side instead of jumping to all of it.
+  * The probe rows of the resident partitions are joined while the probe side is partitioned. Only the probe rows of
+  *  the spilled partitions are written, and these partitions are joined afterwards by GraceHashJoin::joinSpilled.
+  * `partition_num` is the fanout, 0 derives it from the budget, see HYBRID_PARTITIONS_PER_BUDGET.
+  */
+template<size_t build_payload = 8, size_t probe_payload = 8, typename HashMethod = HashCRC32<uint64_t>>
+void TestPartitionHybrid(size_t build_size, size_t probe_size, size_t match_possibility, size_t partition_num)
+{
+    std::string log_head = "partition hybrid " + std::to_string(build_size) + "/" + std::to_string(probe_size) + "/" + std::to_string(match_possibility);
+
+    auto [build_kv, probe_kv] = init<build_payload, probe_payload>(build_size, probe_size, match_possibility);
+
+    using Join = GraceHashJoin<build_payload, probe_payload, HashMethod>;
+    using BuildRow = typename Join::BuildRow;
+    using ProbeRow = typename Join::ProbeRow;
+
+    Stopwatch watch;
+    Stopwatch watch2;
+
+    Join join(spill_options.memory_budget, probe_size);
+    auto level = join.level(build_size * HYBRID_PARTITIONS_PER_BUDGET, 0, partition_num);
+    size_t fanout = level.fanout();
+
+    /// The partitions from `spilled_from` on are on disk.
+    size_t spilled_from = fanout;
+    size_t resident_rows = 0;
+    std::vector<std::vector<BuildRow>> resident(fanout);
+    std::vector<std::optional<SpillFile<BuildRow>>> build_files(fanout);
+
+    BatchedHashes<HashMethod, BuildRow> build_hashes(build_kv);
+    for (size_t i = 0; i < build_kv.size(); ++i)
+    {
+        size_t part = level.partition(build_hashes.get(i));
+        if (part >= spilled_from)
+        {
+            build_files[part]->append(build_kv[i]);
+            continue;
+        }
+        resident[part].emplace_back(build_kv[i]);
+        ++resident_rows;
+        while (!join.fits(resident_rows) && spilled_from > 0)
+        {
+            --spilled_from;
+            auto & file = build_files[spilled_from].emplace(join.template makeFile<BuildRow>());
+            for (const auto & row : resident[spilled_from])
+                file.append(row);
+            resident_rows -= resident[spilled_from].size();
+            std::vector<BuildRow>().swap(resident[spilled_from]);
+        }
+    }
+    for (size_t part = spilled_from; part < fanout; ++part)
+        build_files[part]->finishWrite();
+    std::vector<KeyValue<build_payload>>().swap(build_kv);
+
+    std::vector<std::unique_ptr<typename Join::PartitionTable>> tables(spilled_from);
+    size_t resident_bytes = 0;
+    for (size_t part = 0; part < spilled_from; ++part)
+    {
+        tables[part] = std::make_unique<typename Join::PartitionTable>(resident[part]);
+        resident_bytes += resident[part].capacity() * sizeof(BuildRow) + tables[part]->bytes();
+    }
+    join.notePeakBytes(resident_bytes);
+
+    printf("%s build time %llu, fanout %zu, resident partitions %zu, resident bytes %zu, budget %zu, build needs %zu\n",
+           log_head.c_str(), watch.elapsedFromLastTime(), fanout, spilled_from, resident_bytes, spill_options.memory_budget, Join::buildBytes(build_size));
+
+    std::vector<std::optional<SpillFile<ProbeRow>>> probe_files(fanout);
+    for (size_t part = spilled_from; part < fanout; ++part)
+        probe_files[part].emplace(join.template makeFile<ProbeRow>());
+
+    BatchedHashes<HashMethod, ProbeRow> probe_hashes(probe_kv);
+    for (size_t i = 0; i < probe_kv.size(); ++i)
+    {
+        size_t hash = probe_hashes.get(i);
+        size_t part = level.partition(hash);
+        if (part < spilled_from)
+            join.probe(*tables[part], probe_kv[i], hash);
+        else
+            probe_files[part]->append(probe_kv[i]);
+    }
+    for (size_t part = spilled_from; part < fanout; ++part)
+        probe_files[part]->finishWrite();
+    std::vector<KeyValue<probe_payload>>().swap(probe_kv);
+
+    /// The spilled partitions get the whole budget.
+    tables.clear();
+    resident.clear();
+    printf("%s probe resident partitions + construct tuple time %llu, size %lu\n", log_head.c_str(), watch.elapsedFromLastTime(), join.outputSize());
+
+    for (size_t part = spilled_from; part < fanout; ++part)
+        join.joinSpilled(*build_files[part], *probe_files[part], level.bits(), 0);
+
+    unsigned long long join_time = watch.elapsedFromLastTime();
+    printf("%s join spilled partitions + construct tuple time %llu, size %lu, peak partition bytes %zu\n",
+           log_head.c_str(), join_time, join.outputSize(), join.peakBytes());
+    join.spillStats().print(log_head);
+
+    unsigned long long total_time = watch2.elapsedFromLastTime();
+    printf("%s total_time %llu\n", log_head.c_str(), total_time);
+}
+
+template<size_t build_payload = 8, size_t probe_payload = 8, typename HashMethod = HashCRC32<uint64_t>>
 void TestPartitionChained(size_t build_size, size_t probe_size, size_t match_possibility, size_t partition_num)
 {
     std::string log_head = "chained " + std::to_string(build_size) + "/" + std::to_string(probe_size) + "/" + std::to_string(match_possibility);
 
     auto [build_kv, probe_kv] = init<build_payload, probe_payload>(build_size, probe_size, match_possibility);
 
-    auto hash_method = HashCRC32<uint64_t>();
+    BatchedHashes<HashMethod, KeyValue<build_payload>> build_hashes(build_kv);
+    BatchedHashes<HashMethod, KeyValue<probe_payload>> probe_hashes(probe_kv);
 
     Stopwatch watch;
     Stopwatch watch2;
@@ -131,7 +648,7 @@ void TestPartitionChained(size_t build_size, size_t probe_size, size_t match_pos
     size_t head_size = 1 << (static_cast<size_t>(log2(build_size - 1)) + 2);
     size_t hash_mask = head_size - 1;
 
-    auto build_partition_kv = partition<build_payload>(build_kv, partition_num);
+    auto build_partition_kv = partition<build_payload, HashMethod>(build_kv, partition_num);
     printf("%s partition build time %llu\n", log_head.c_str(), watch.elapsedFromLastTime());
 
     for (size_t part = 0; part < partition_num; ++part)
@@ -147,7 +664,7 @@ void TestPartitionChained(size_t build_size, size_t probe_size, size_t match_pos
     printf("size %zu, %zu\n", build_size, head_size);
     for (size_t i = 0; i < build_size; ++i)
     {
-        size_t hash = hash_method(build_kv[i].key);
+        size_t hash = build_hashes.get(i);
         size_t bucket = hash & hash_mask;
         build_kv[i].next = head[bucket];
         head[bucket] = &build_kv[i];
@@ -167,7 +684,7 @@ void TestPartitionChained(size_t build_size, size_t probe_size, size_t match_pos
     size_t empty_count = 0;
     for (size_t i = 0; i < probe_size; ++i)
     {
-        size_t bucket = hash_method(probe_kv[i].key) & hash_mask;
+        size_t bucket = probe_hashes.get(i) & hash_mask;
         auto * h = head[bucket];
         size_t len = 0;
         while (h != nullptr)
@@ -195,6 +712,25 @@ void TestPartitionChained(size_t build_size, size_t probe_size, size_t match_pos
     printf("%s total_time %llu\n", log_head.c_str(), total_time);
 }
 
+/** Partitions for a partition count of 0 on the command line: the smallest power of two for which the hash table of
+  *  one partition fits into the LLC share of one of `workers` workers, placed by pin_policy or else one per core.
+  * A HashMap is at most half full, so the table of `rows` rows takes about 2 * rows cells.
+  */
+template<typename HashMethod>
+size_t partitionsForLLC(size_t build_size, size_t workers)
+{
+    const auto & topology = CpuTopology::get();
+    auto cpus = topology.selectCpus(workers, pin_policy == PinPolicy::None ? PinPolicy::Cores : pin_policy);
+    size_t llc_share = topology.llcBytesPerWorker(cpus);
+    size_t table_bytes = 2 * build_size * sizeof(HashMapCell<uint64_t, void *, HashMethod>);
+
+    size_t partitions = 1;
+    while (partitions < build_size && table_bytes / partitions > llc_share)
+        partitions *= 2;
+    printf("partitions %zu, llc share %zu bytes per worker, %zu workers\n", partitions, llc_share, workers);
+    return partitions;
+}
+
 void benchPartitionHashTable(int argc, char** argv)
 {
     if (argc < 6)
@@ -209,13 +745,47 @@ void benchPartitionHashTable(int argc, char** argv)
     sscanf(argv[4], "%zu", &match);
     sscanf(argv[5], "%zu", &part);
 
-    if (RUN == 0)
-    {
-        TestPartitionLinear(n, m, match, part);
-    }
-    else
+    dataset_options.dir = getOption(argc, argv, "dataset", std::string());
+    dataset_options.seed = getOption(argc, argv, "seed", dataset_options.dir.empty() ? 0 : 1);
+    dataset_options.zipf = strtod(getOption(argc, argv, "zipf", std::string("0")).c_str(), nullptr);
+
+    if (!applyTargetArchOption(argc, argv) || !applyPinOption(argc, argv) || !applyThreadOptions(argc, argv))
+        return;
+
+    spill_options.dir = getOption(argc, argv, "spill_dir", spill_options.dir);
+    if (hasOption(argc, argv, "memory"))
+        spill_options.memory_budget = parseCacheSize(getOption(argc, argv, "memory", std::string()));
+
+    std::string hash = getOption(argc, argv, "hash", std::string("crc32"));
+    JoinKind kind;
+    if (!parseJoinKind(getOption(argc, argv, "join", std::string("inner")), kind))
     {
-        printf("unknown type: %zu\n", RUN);
+        printf("unknown join kind\n");
         return;
     }
-}
\ No newline at end of file
+
+    bool dispatched = dispatchHashMethod(hash, [&](auto hash_method) {
+        using HashMethod = decltype(hash_method);
+        /// The fanout of the spilling joins follows from the memory budget instead.
+        if (part == 0 && RUN < 2)
+            part = partitionsForLLC<HashMethod>(n, RUN == 1 ? build_threads : 1);
+        if (RUN == 2 && kind == JoinKind::Inner)
+            TestPartitionGrace<8, 8, HashMethod>(n, m, match, part);
+        else if (RUN == 3 && kind == JoinKind::Inner)
+            TestPartitionHybrid<8, 8, HashMethod>(n, m, match, part);
+        else if (RUN == 1 && kind == JoinKind::Inner)
+            TestPartitionPipelined<8, 8, HashMethod>(n, m, match, part);
+        else if (RUN >= 1 && RUN <= 3)
+            printf("RUN %zu doesn't support --join=%s\n", RUN, toString(kind));
+        else if (RUN != 0)
+            printf("unknown type: %zu\n", RUN);
+        else if (kind == JoinKind::Inner)
+            TestPartitionLinear<8, 8, HashMethod>(n, m, match, part);
+        else if (std::is_same_v<HashMethod, HashCRC32<uint64_t>>)
+            dispatchJoinKind(kind, [&](auto join_kind) { TestPartitionLinear<8, 8, HashCRC32<uint64_t>, decltype(join_kind)::value>(n, m, match, part); });
+        else
+            printf("--join=%s only supports the crc32 hash\n", toString(kind));
+    });
+    if (!dispatched)
+        printf("unknown hash method: %s\n", hash.c_str());
+}
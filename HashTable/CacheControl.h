@@ -0,0 +1,235 @@
+#pragma once
+
+#include <cstdio>
+#include <fstream>
+#include <initializer_list>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#if defined(__x86_64__)
+#include <emmintrin.h>
+#endif
+
+#include "Defines.h"
+#include "Types.h"
+
+/** Controls the state of the CPU caches right before a measured phase.
+  *
+  * cold   - the data the phase reads is evicted, every access goes to memory;
+  * warm   - the caches are left as the previous phase (usually the build) left them;
+  * steady - the data the phase reads is touched right before, approximating the state after many probes.
+  *
+  * Eviction either flushes exactly the given ranges with clflush, or sweeps a buffer twice the size of the LLC,
+  *  which also evicts everything else but costs time proportional to the LLC size.
+  */
+enum class CacheMode
+{
+    Cold,
+    Warm,
+    Steady,
+};
+
+enum class EvictMethod
+{
+    Flush,
+    Sweep,
+};
+
+struct CacheOptions
+{
+    CacheMode mode = CacheMode::Cold;
+    EvictMethod evict = EvictMethod::Flush;
+};
+
+inline CacheOptions cache_options;
+
+static constexpr size_t CACHE_LINE_SIZE = 64;
+
+inline const char * toString(CacheMode mode)
+{
+    switch (mode)
+    {
+        case CacheMode::Cold: return "cold";
+        case CacheMode::Warm: return "warm";
+        case CacheMode::Steady: return "steady";
+    }
+    return "unknown";
+}
+
+inline const char * toString(EvictMethod method)
+{
+    return method == EvictMethod::Flush ? "clflush" : "sweep";
+}
+
+inline bool parseCacheMode(const std::string & name, CacheMode & mode)
+{
+    if (name == "cold")
+        mode = CacheMode::Cold;
+    else if (name == "warm")
+        mode = CacheMode::Warm;
+    else if (name == "steady")
+        mode = CacheMode::Steady;
+    else
+        return false;
+    return true;
+}
+
+inline bool parseEvictMethod(const std::string & name, EvictMethod & method)
+{
+    if (name == "clflush")
+        method = EvictMethod::Flush;
+    else if (name == "sweep")
+        method = EvictMethod::Sweep;
+    else
+        return false;
+    return true;
+}
+
+/// Parse a size from sysfs, e.g. "48K" or "300M".
+inline size_t parseCacheSize(const std::string & str)
+{
+    size_t value = 0;
+    char unit = 0;
+    if (sscanf(str.c_str(), "%zu%c", &value, &unit) < 1)
+        return 0;
+    if (unit == 'K')
+        value <<= 10;
+    else if (unit == 'M')
+        value <<= 20;
+    else if (unit == 'G')
+        value <<= 30;
+    return value;
+}
+
+/// Size in bytes of the last level cache of cpu0.
+inline size_t detectLLCSize()
+{
+    static const size_t llc_size = []
+    {
+        size_t best_level = 0;
+        size_t best_size = 0;
+        for (size_t index = 0;; ++index)
+        {
+            std::string dir = "/sys/devices/system/cpu/cpu0/cache/index" + std::to_string(index);
+            std::ifstream level_file(dir + "/level");
+            std::ifstream type_file(dir + "/type");
+            std::ifstream size_file(dir + "/size");
+            if (!level_file || !size_file)
+                break;
+
+            size_t level = 0;
+            std::string type, size;
+            level_file >> level;
+            type_file >> type;
+            size_file >> size;
+            if (type == "Instruction")
+                continue;
+            if (level > best_level)
+            {
+                best_level = level;
+                best_size = parseCacheSize(size);
+            }
+        }
+
+#if defined(_SC_LEVEL3_CACHE_SIZE)
+        if (best_size == 0 && sysconf(_SC_LEVEL3_CACHE_SIZE) > 0)
+            best_size = sysconf(_SC_LEVEL3_CACHE_SIZE);
+        if (best_size == 0 && sysconf(_SC_LEVEL2_CACHE_SIZE) > 0)
+            best_size = sysconf(_SC_LEVEL2_CACHE_SIZE);
+#endif
+        return best_size ? best_size : 32UL << 20;
+    }();
+    return llc_size;
+}
+
+/// A piece of memory the measured phase reads.
+struct MemoryRange
+{
+    const void * data;
+    size_t size;
+};
+
+template <typename T>
+MemoryRange memoryRange(const std::vector<T> & vec)
+{
+    return {vec.data(), vec.size() * sizeof(T)};
+}
+
+inline void flushRange(const MemoryRange & range)
+{
+    const char * begin = static_cast<const char *>(range.data);
+    const char * end = begin + range.size;
+    for (const char * p = begin; p < end; p += CACHE_LINE_SIZE)
+    {
+#if defined(__x86_64__)
+        _mm_clflush(p);
+#elif defined(__aarch64__)
+        asm volatile("dc civac, %0" : : "r"(p) : "memory");
+#endif
+    }
+}
+
+inline void touchRange(const MemoryRange & range)
+{
+    const volatile char * begin = static_cast<const volatile char *>(range.data);
+    const volatile char * end = begin + range.size;
+    for (const volatile char * p = begin; p < end; p += CACHE_LINE_SIZE)
+        (void)*p;
+}
+
+/// Write one byte of every cache line of a buffer twice the LLC size. The buffer is allocated on the first sweep and reused.
+inline void sweepLLC()
+{
+    static std::vector<char> buf(2 * detectLLCSize());
+    for (size_t i = 0; i < buf.size(); i += CACHE_LINE_SIZE)
+        ++buf[i];
+}
+
+inline void memoryFence()
+{
+#if defined(__x86_64__)
+    _mm_mfence();
+#elif defined(__aarch64__)
+    asm volatile("dsb ish" : : : "memory");
+#endif
+}
+
+/** Bring the caches into the state of `cache_options.mode` for a phase that reads `ranges`.
+  * For the steady mode the ranges are touched in order, so pass the most important data last.
+  */
+template <typename Ranges>
+void prepareCacheRanges(const Ranges & ranges)
+{
+    switch (cache_options.mode)
+    {
+        case CacheMode::Cold:
+            if (cache_options.evict == EvictMethod::Flush)
+            {
+                for (const auto & range : ranges)
+                    flushRange(range);
+            }
+            else
+                sweepLLC();
+            break;
+        case CacheMode::Warm:
+            break;
+        case CacheMode::Steady:
+            for (const auto & range : ranges)
+                touchRange(range);
+            break;
+    }
+    memoryFence();
+}
+
+inline void prepareCache(std::initializer_list<MemoryRange> ranges)
+{
+    prepareCacheRanges(ranges);
+}
+
+/// For phases whose inputs are only known at run time, e.g. a list of columns.
+inline void prepareCache(const std::vector<MemoryRange> & ranges)
+{
+    prepareCacheRanges(ranges);
+}
@@ -1,70 +1,260 @@
 
 #pragma once
 
+#include <cstring>
+#include <iostream>
+#include <type_traits>
+#include <typeinfo>
 #include <vector>
 
+#include "Arena.h"
+#include "StringRef.h"
+
 class IColumn
 {
 public:
+    virtual ~IColumn() = default;
+
     virtual void insertData(const char * pos, size_t length) = 0;
-    virtual size_t size() = 0;
+    virtual size_t size() const = 0;
+
+    /// The bytes of row n, e.g. to use a single column as a join key.
+    virtual StringRef getDataAt(size_t n) const = 0;
+
+    /** Append row n to the contiguous piece of the Arena that starts at `begin`, see Arena::allocContinue.
+      * Serializing several columns one after another gives the key of a multi-column row.
+      */
+    virtual StringRef serializeValueIntoArena(size_t n, Arena & arena, char const *& begin) const = 0;
+
+    /** Batched appends, one virtual call per batch instead of one per row. `src` must have the same type as this column.
+      * insertRangeFrom appends rows [start, start + length) of src, insertIndicesFrom appends the rows of src at
+      *  `indices` in their order, e.g. the matched build rows of a join.
+      */
+    virtual void insertRangeFrom(const IColumn & src, size_t start, size_t length) = 0;
+    virtual void insertIndicesFrom(const IColumn & src, const UInt32 * indices, size_t size) = 0;
+
+    /// Reserve room for `n` rows in total.
+    virtual void reserve(size_t n) = 0;
 };
 
 template<typename T>
 class ColumnVector final : public IColumn
 {
 public:
+    using Container = std::vector<T>;
+
     void insertData(const char * pos, size_t) override
     {
         vec.push_back(*reinterpret_cast<const T*>(pos));
     }
-    size_t size() override
+    size_t size() const override
     {
         return vec.size();
     }
+    StringRef getDataAt(size_t n) const override
+    {
+        return {reinterpret_cast<const char *>(&vec[n]), sizeof(T)};
+    }
+    StringRef serializeValueIntoArena(size_t n, Arena & arena, char const *& begin) const override
+    {
+        char * pos = arena.allocContinue(sizeof(T), begin);
+        memcpy(pos, &vec[n], sizeof(T));
+        return {pos, sizeof(T)};
+    }
+    void insertRangeFrom(const IColumn & src, size_t start, size_t length) override
+    {
+        const auto & src_vec = static_cast<const ColumnVector &>(src).vec;
+        vec.insert(vec.end(), src_vec.begin() + start, src_vec.begin() + start + length);
+    }
+    /// A plain gather loop without aliasing, the compiler vectorizes it for the targets with a gather instruction.
+    void insertIndicesFrom(const IColumn & src, const UInt32 * indices, size_t size) override
+    {
+        const T * __restrict src_data = static_cast<const ColumnVector &>(src).vec.data();
+        size_t old_size = vec.size();
+        vec.resize(old_size + size);
+        T * __restrict dst = vec.data() + old_size;
+        for (size_t i = 0; i < size; ++i)
+            dst[i] = src_data[indices[i]];
+    }
+    void reserve(size_t n) override
+    {
+        vec.reserve(n);
+    }
+
+    Container & getData() { return vec; }
+    const Container & getData() const { return vec; }
 private:
-    std::vector<T> vec;
+    Container vec;
 };
 
+/** All strings are stored one after another in `chars`, `offsets[i]` is the end of row i in `chars`.
+  * There is no terminating zero byte.
+  */
 class ColumnString final : public IColumn
 {
 public:
+    using Chars = std::vector<uint8_t>;
+    using Offsets = std::vector<uint64_t>;
+
     void insertData(const char * pos, size_t length) override
     {
-        size_t size = vec.size();
-        vec.resize(size + length);
-        memcpy(vec.data() + size, pos, length);
+        size_t old_size = chars.size();
+        chars.resize(old_size + length);
+        memcpy(chars.data() + old_size, pos, length);
+        offsets.push_back(chars.size());
     }
-    size_t size() override
+    size_t size() const override
     {
-        return vec.size();
+        return offsets.size();
+    }
+    StringRef getDataAt(size_t n) const override
+    {
+        return {reinterpret_cast<const char *>(chars.data()) + offsetAt(n), sizeAt(n)};
+    }
+    /// The size goes first, so that ("ab", "c") and ("a", "bc") are different keys.
+    StringRef serializeValueIntoArena(size_t n, Arena & arena, char const *& begin) const override
+    {
+        size_t string_size = sizeAt(n);
+        char * pos = arena.allocContinue(sizeof(string_size) + string_size, begin);
+        memcpy(pos, &string_size, sizeof(string_size));
+        memcpy(pos + sizeof(string_size), chars.data() + offsetAt(n), string_size);
+        return {pos, sizeof(string_size) + string_size};
+    }
+    void insertRangeFrom(const IColumn & src, size_t start, size_t length) override
+    {
+        if (length == 0)
+            return;
+        const auto & src_column = static_cast<const ColumnString &>(src);
+        size_t chars_begin = src_column.offsetAt(start);
+        size_t chars_end = src_column.offsets[start + length - 1];
+        size_t old_chars_size = chars.size();
+        chars.insert(chars.end(), src_column.chars.begin() + chars_begin, src_column.chars.begin() + chars_end);
+
+        size_t old_size = offsets.size();
+        offsets.resize(old_size + length);
+        for (size_t i = 0; i < length; ++i)
+            offsets[old_size + i] = src_column.offsets[start + i] - chars_begin + old_chars_size;
+    }
+    /// Two passes: the offsets first, so that `chars` grows once, then the bytes.
+    void insertIndicesFrom(const IColumn & src, const UInt32 * indices, size_t size) override
+    {
+        const auto & src_column = static_cast<const ColumnString &>(src);
+        size_t old_size = offsets.size();
+        offsets.resize(old_size + size);
+        size_t chars_size = chars.size();
+        for (size_t i = 0; i < size; ++i)
+        {
+            chars_size += src_column.sizeAt(indices[i]);
+            offsets[old_size + i] = chars_size;
+        }
+
+        size_t pos = chars.size();
+        chars.resize(chars_size);
+        for (size_t i = 0; i < size; ++i)
+        {
+            size_t string_size = src_column.sizeAt(indices[i]);
+            memcpy(chars.data() + pos, src_column.chars.data() + src_column.offsetAt(indices[i]), string_size);
+            pos += string_size;
+        }
+    }
+    /// Only the offsets, the size of the strings is unknown.
+    void reserve(size_t n) override
+    {
+        offsets.reserve(n);
     }
+
+    size_t offsetAt(size_t n) const { return n == 0 ? 0 : offsets[n - 1]; }
+    size_t sizeAt(size_t n) const { return offsets[n] - offsetAt(n); }
+
+    Chars & getChars() { return chars; }
+    const Chars & getChars() const { return chars; }
+    Offsets & getOffsets() { return offsets; }
+    const Offsets & getOffsets() const { return offsets; }
 private:
-    std::vector<uint8_t> vec;
+    Chars chars;
+    Offsets offsets;
+};
+
+template <typename... Ts>
+struct TypeList
+{
+    static constexpr size_t size = sizeof...(Ts);
 };
 
-int getColumnType(IColumn * column)
+/// Every concrete column type. A type missing here is not found by dispatchColumn.
+using ColumnTypes = TypeList<
+    ColumnVector<uint8_t>, ColumnVector<uint16_t>, ColumnVector<uint32_t>, ColumnVector<uint64_t>,
+    ColumnVector<int8_t>, ColumnVector<int16_t>, ColumnVector<int32_t>, ColumnVector<int64_t>,
+    ColumnString>;
+
+template <typename T>
+struct IsColumnVector : std::false_type
+{};
+
+template <typename T>
+struct IsColumnVector<ColumnVector<T>> : std::true_type
+{};
+
+template <typename... Columns, typename Column, typename F>
+bool castColumnToEither(TypeList<Columns...>, Column & column, F && f)
+{
+    using Base = std::conditional_t<std::is_const_v<Column>, const IColumn, IColumn>;
+    Base & base = column;
+    const std::type_info & type = typeid(base);
+    return ((type == typeid(Columns) && (f(static_cast<std::conditional_t<std::is_const_v<Column>, const Columns, Columns> &>(base)), true)) || ...);
+}
+
+/** Resolve the concrete type of `column` once and call f(ConcreteColumn &), so that f is instantiated for every type
+  *  and its inner loop runs without virtual calls or type checks. Returns false if the type is not in ColumnTypes.
+  *
+  * Example:
+  *   dispatchColumn(column, [&](auto & typed) { for (...) typed.insertData(...); });
+  */
+template <typename Column, typename F>
+bool dispatchColumn(Column & column, F && f)
+{
+    return castColumnToEither(ColumnTypes{}, column, std::forward<F>(f));
+}
+
+/// The same for a pair of columns, f(Source &, Dest &) is instantiated for every pair of types.
+template <typename F>
+bool dispatchColumns(const IColumn & src, IColumn & dst, F && f)
+{
+    bool found = false;
+    dispatchColumn(src, [&](auto & typed_src) {
+        found = dispatchColumn(dst, [&](auto & typed_dst) { f(typed_src, typed_dst); });
+    });
+    return found;
+}
+
+/** Append the rows of `src` at `indices` to `dst`, converting between the numeric types like static_cast.
+  * Strings only go to strings. Returns false if there is no conversion.
+  */
+inline bool insertIndicesConvert(const IColumn & src, IColumn & dst, const UInt32 * indices, size_t size)
 {
-    std::type_index ti(typeid(*column));
-    if (ti == std::type_index(typeid(ColumnVector<uint8_t>)))
-        return 1;
-    else if (ti == std::type_index(typeid(ColumnVector<uint16_t>)))
-        return 2;
-    else if (ti == std::type_index(typeid(ColumnVector<uint32_t>)))
-        return 3;
-    else if (ti == std::type_index(typeid(ColumnVector<uint64_t>)))
-        return 4;
-    else if (ti == std::type_index(typeid(ColumnVector<int8_t>)))
-        return 5;
-    else if (ti == std::type_index(typeid(ColumnVector<int16_t>)))
-        return 6;
-    else if (ti == std::type_index(typeid(ColumnVector<int32_t>)))
-        return 7;
-    else if (ti == std::type_index(typeid(ColumnVector<int64_t>)))
-        return 8;
-    else if (ti == std::type_index(typeid(ColumnString)))
-        return 9;
-    return -1;
+    bool converted = false;
+    bool found = dispatchColumns(src, dst, [&](auto & typed_src, auto & typed_dst) {
+        using Source = std::decay_t<decltype(typed_src)>;
+        using Dest = std::decay_t<decltype(typed_dst)>;
+        if constexpr (std::is_same_v<Source, Dest>)
+        {
+            typed_dst.insertIndicesFrom(typed_src, indices, size);
+            converted = true;
+        }
+        else if constexpr (IsColumnVector<Source>::value && IsColumnVector<Dest>::value)
+        {
+            using T = typename Dest::Container::value_type;
+            const auto * __restrict src_data = typed_src.getData().data();
+            auto & dst_data = typed_dst.getData();
+            size_t old_size = dst_data.size();
+            dst_data.resize(old_size + size);
+            T * __restrict dst_pos = dst_data.data() + old_size;
+            for (size_t i = 0; i < size; ++i)
+                dst_pos[i] = static_cast<T>(src_data[indices[i]]);
+            converted = true;
+        }
+    });
+    return found && converted;
 }
 
 void insertRandom(std::vector<IColumn *> & columns, const std::vector<uint64_t> & inserts)
@@ -81,49 +271,19 @@ void insertRandom(std::vector<IColumn *> & columns, const std::vector<uint64_t>
         std::cout << i << ":" << columns[i]->size() << std::endl;
 }
 
+/// The column type is resolved once per column, the loop over the rows is instantiated for it.
 void insertRandomDevirtualize(std::vector<IColumn *> & columns, const std::vector<uint64_t> & inserts)
 {
     size_t size = columns.size();
-    std::vector<int> types(size);
     for (size_t i = 0; i < size; ++i)
-        types[i] = getColumnType(columns[i]);
-    for (auto & d : inserts)
     {
-        for (size_t i = 0; i < size; ++i)
-        {
-            switch (types[i])
-            {
-                case 1:
-                    static_cast<ColumnVector<uint8_t>*>(columns[i])->insertData(reinterpret_cast<const char*>(&d), 8);
-                    break;
-                case 2:
-                    static_cast<ColumnVector<uint16_t>*>(columns[i])->insertData(reinterpret_cast<const char*>(&d), 8);
-                    break;
-                case 3:
-                    static_cast<ColumnVector<uint32_t>*>(columns[i])->insertData(reinterpret_cast<const char*>(&d), 8);
-                    break;
-                case 4:
-                    static_cast<ColumnVector<uint64_t>*>(columns[i])->insertData(reinterpret_cast<const char*>(&d), 8);
-                    break;
-                case 5:
-                    static_cast<ColumnVector<int8_t>*>(columns[i])->insertData(reinterpret_cast<const char*>(&d), 8);
-                    break;
-                case 6:
-                    static_cast<ColumnVector<int16_t>*>(columns[i])->insertData(reinterpret_cast<const char*>(&d), 8);
-                    break;
-                case 7:
-                    static_cast<ColumnVector<int32_t>*>(columns[i])->insertData(reinterpret_cast<const char*>(&d), 8);
-                    break;
-                case 8:
-                    static_cast<ColumnVector<int64_t>*>(columns[i])->insertData(reinterpret_cast<const char*>(&d), 8);
-                    break;
-                case 9:
-                    static_cast<ColumnString*>(columns[i])->insertData(reinterpret_cast<const char*>(&d), 8);
-                    break;
-                default:
-                    exit(-1);
-            }
-        }
+        bool found = dispatchColumn(*columns[i], [&](auto & column) {
+            column.reserve(column.size() + inserts.size());
+            for (auto & d : inserts)
+                column.insertData(reinterpret_cast<const char*>(&d), 8);
+        });
+        if (!found)
+            exit(-1);
     }
 
     for (size_t i = 0; i < size; ++i)
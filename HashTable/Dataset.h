@@ -0,0 +1,211 @@
+#pragma once
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "Types.h"
+
+/** On-disk cache of the generated join input.
+  * A dataset is identified by (build_size, probe_size, match_possibility, seed, build_payload, probe_payload).
+  * It is generated once, written to `dir`, and later runs map the file read-only instead of generating it again,
+  *  so every variant of a sweep sees exactly the same bytes.
+  *
+  * File layout, all sections start at a multiple of 8 bytes:
+  *   DatasetHeader
+  *   build keys      UInt64[build_size]
+  *   build payloads  char[build_size * build_payload]
+  *   probe keys      UInt64[probe_size]
+  *   probe payloads  char[probe_size * probe_payload]
+  */
+struct DatasetOptions
+{
+    /// Empty means that the dataset is generated in memory on every run.
+    std::string dir;
+    /// 0 means that the generator is seeded from std::random_device.
+    UInt64 seed = 0;
+    /// Zipf exponent of the build keys, 0 keeps them uniform and all but unique.
+    double zipf = 0;
+};
+
+inline DatasetOptions dataset_options;
+
+struct DatasetHeader
+{
+    static constexpr char MAGIC[8] = {'B', 'H', 'J', 'D', 'S', 'E', 'T', '\0'};
+    static constexpr UInt64 VERSION = 2;
+
+    char magic[8];
+    UInt64 version;
+    UInt64 build_size;
+    UInt64 probe_size;
+    UInt64 match_possibility;
+    UInt64 seed;
+    UInt64 build_payload;
+    UInt64 probe_payload;
+    /// DatasetOptions::zipf * 1000.
+    UInt64 zipf_milli;
+
+    DatasetHeader() = default;
+    DatasetHeader(size_t build_size_, size_t probe_size_, size_t match_possibility_, UInt64 seed_, size_t build_payload_, size_t probe_payload_, double zipf_ = 0)
+        : version(VERSION)
+        , build_size(build_size_)
+        , probe_size(probe_size_)
+        , match_possibility(match_possibility_)
+        , seed(seed_)
+        , build_payload(build_payload_)
+        , probe_payload(probe_payload_)
+        , zipf_milli(static_cast<UInt64>(zipf_ * 1000 + 0.5))
+    {
+        memcpy(magic, MAGIC, sizeof(magic));
+    }
+
+    bool operator==(const DatasetHeader & rhs) const { return memcmp(this, &rhs, sizeof(DatasetHeader)) == 0; }
+
+    static size_t align(size_t size) { return (size + 7) / 8 * 8; }
+
+    size_t buildKeysOffset() const { return sizeof(DatasetHeader); }
+    size_t buildPayloadsOffset() const { return buildKeysOffset() + build_size * sizeof(UInt64); }
+    size_t probeKeysOffset() const { return buildPayloadsOffset() + align(build_size * build_payload); }
+    size_t probePayloadsOffset() const { return probeKeysOffset() + probe_size * sizeof(UInt64); }
+    size_t fileSize() const { return probePayloadsOffset() + align(probe_size * probe_payload); }
+};
+
+static_assert(sizeof(DatasetHeader) % 8 == 0);
+
+inline std::string datasetPath(const std::string & dir, const DatasetHeader & header)
+{
+    char name[256];
+    snprintf(name, sizeof(name), "/dataset_%lu_%lu_%lu_%lu_%lu_%lu",
+             header.build_size, header.probe_size, header.match_possibility, header.seed, header.build_payload, header.probe_payload);
+    std::string res = dir + name;
+    if (header.zipf_milli)
+        res += "_zipf" + std::to_string(header.zipf_milli);
+    return res + ".bin";
+}
+
+/// Read-only mapping of a dataset file. The mapping is released in the destructor.
+class MappedDataset
+{
+public:
+    MappedDataset() = default;
+    MappedDataset(const MappedDataset &) = delete;
+    MappedDataset & operator=(const MappedDataset &) = delete;
+
+    ~MappedDataset()
+    {
+        if (data)
+            munmap(data, size);
+    }
+
+    /// Returns false if the file doesn't exist or doesn't describe the expected dataset.
+    bool open(const std::string & path, const DatasetHeader & expected)
+    {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+
+        struct stat st{};
+        if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) != expected.fileSize())
+        {
+            ::close(fd);
+            return false;
+        }
+
+        void * res = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (res == MAP_FAILED)
+            return false;
+
+        data = static_cast<char *>(res);
+        size = st.st_size;
+        if (!(header() == expected))
+        {
+            munmap(data, size);
+            data = nullptr;
+            return false;
+        }
+        /// The whole file is consumed sequentially right after the mapping.
+        madvise(data, size, MADV_SEQUENTIAL);
+        return true;
+    }
+
+    const DatasetHeader & header() const { return *reinterpret_cast<const DatasetHeader *>(data); }
+    const UInt64 * buildKeys() const { return reinterpret_cast<const UInt64 *>(data + header().buildKeysOffset()); }
+    const char * buildPayloads() const { return data + header().buildPayloadsOffset(); }
+    const UInt64 * probeKeys() const { return reinterpret_cast<const UInt64 *>(data + header().probeKeysOffset()); }
+    const char * probePayloads() const { return data + header().probePayloadsOffset(); }
+
+private:
+    char * data = nullptr;
+    size_t size = 0;
+};
+
+/** Writes a dataset section by section. The file is written under a temporary name and renamed on `finish`,
+  *  so concurrent runs never map a half-written dataset.
+  */
+class DatasetWriter
+{
+public:
+    DatasetWriter(const std::string & dir, const DatasetHeader & header_)
+        : header(header_)
+        , path(datasetPath(dir, header_))
+        , tmp_path(path + ".tmp." + std::to_string(getpid()))
+    {
+        mkdir(dir.c_str(), 0755);
+        file = fopen(tmp_path.c_str(), "wb");
+        if (file)
+            write(&header, sizeof(header));
+    }
+
+    ~DatasetWriter()
+    {
+        if (file)
+        {
+            fclose(file);
+            unlink(tmp_path.c_str());
+        }
+    }
+
+    bool ok() const { return file != nullptr && !failed; }
+
+    void write(const void * buf, size_t len)
+    {
+        if (file && fwrite(buf, 1, len, file) != len)
+            failed = true;
+        written += len;
+    }
+
+    /// Pad the current section to a multiple of 8 bytes.
+    void endSection()
+    {
+        static const char zeros[8] = {};
+        write(zeros, DatasetHeader::align(written) - written);
+    }
+
+    bool finish()
+    {
+        if (!file)
+            return false;
+        bool res = fclose(file) == 0 && !failed && written == header.fileSize() && rename(tmp_path.c_str(), path.c_str()) == 0;
+        file = nullptr;
+        if (!res)
+            unlink(tmp_path.c_str());
+        return res;
+    }
+
+    const std::string & getPath() const { return path; }
+
+private:
+    DatasetHeader header;
+    std::string path;
+    std::string tmp_path;
+    FILE * file = nullptr;
+    size_t written = 0;
+    bool failed = false;
+};
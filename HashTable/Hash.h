@@ -13,7 +13,7 @@ inline uint64_t intHash64(uint64_t x)
     return x;
 }
 
-#ifdef __SSE4_2__
+#if defined(__x86_64__)
 #include <nmmintrin.h>
 #endif
 
@@ -22,14 +22,106 @@ inline uint64_t intHash64(uint64_t x)
 #include <arm_neon.h>
 #endif
 
-inline uint64_t intHashCRC32(uint64_t x)
+#include "TargetSpecific.h"
+
+/// Lookup table of CRC32C (reflected polynomial 0x82F63B78), one entry per byte value.
+struct CRC32CTable
+{
+    uint32_t data[256] = {};
+
+    constexpr CRC32CTable()
+    {
+        for (uint32_t i = 0; i < 256; ++i)
+        {
+            uint32_t crc = i;
+            for (size_t bit = 0; bit < 8; ++bit)
+                crc = (crc >> 1) ^ (crc & 1 ? 0x82F63B78U : 0);
+            data[i] = crc;
+        }
+    }
+};
+
+inline constexpr CRC32CTable crc32c_table;
+
+/// The same value as _mm_crc32_u64(crc, x), for hosts without SSE4.2.
+inline uint64_t crc32cSoftware(uint64_t crc, uint64_t x)
+{
+    uint32_t res = crc;
+    for (size_t i = 0; i < 8; ++i)
+    {
+        res = crc32c_table.data[(res ^ x) & 0xFF] ^ (res >> 8);
+        x >>= 8;
+    }
+    return res;
+}
+
+/// crc32c() of each target, all of them return the same value.
+TIFLASH_DECLARE_DEFAULT_CODE(
+inline uint64_t crc32c(uint64_t crc, uint64_t x) { return crc32cSoftware(crc, x); }
+)
+TIFLASH_DECLARE_SSE42_SPECIFIC_CODE(
+inline uint64_t crc32c(uint64_t crc, uint64_t x) { return _mm_crc32_u64(crc, x); }
+)
+TIFLASH_DECLARE_AVX2_SPECIFIC_CODE(
+inline uint64_t crc32c(uint64_t crc, uint64_t x) { return _mm_crc32_u64(crc, x); }
+)
+TIFLASH_DECLARE_AVX512_SPECIFIC_CODE(
+inline uint64_t crc32c(uint64_t crc, uint64_t x) { return _mm_crc32_u64(crc, x); }
+)
+
+/// Continue a CRC32C with 8 more bytes.
+inline uint64_t updateCRC32(uint64_t crc, uint64_t x)
 {
 #ifdef __SSE4_2__
-    return _mm_crc32_u64(-1ULL, x);
+    return _mm_crc32_u64(crc, x);
+#elif defined(__x86_64__)
+    /// The build doesn't assume SSE4.2, so the instruction is chosen at run time. The function call can't be inlined.
+    if (likely(target_arch != TargetArch::Default))
+        return TargetSpecific::SSE42::crc32c(crc, x);
+    return crc32cSoftware(crc, x);
 #elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
-    return __crc32cd(-1U, x);
+    return __crc32cd(crc, x);
 #else
     /// On other platforms we do not have CRC32. NOTE This can be confusing.
+    return intHash64(crc ^ x);
+#endif
+}
+
+inline uint64_t intHashCRC32(uint64_t x)
+{
+#if defined(__x86_64__) || (defined(__aarch64__) && defined(__ARM_FEATURE_CRC32))
+    return updateCRC32(-1ULL, x);
+#else
     return intHash64(x);
 #endif
-}
\ No newline at end of file
+}
+
+/** Hash policies for UInt64 keys. Every join variant and partition() takes one as a template parameter,
+  *  HashCRC32<UInt64> (HashTable.h) is the default.
+  * Consumers use the low bits of the hash for bucket selection and the low 32 bits for partitioning,
+  *  so each policy puts its best bits there.
+  */
+
+/// The murmur3 64-bit finalizer.
+struct HashIntHash64
+{
+    size_t operator()(uint64_t key) const { return intHash64(key); }
+};
+
+/// Multiply by an odd constant and keep the upper 32 bits of the product, which depend on all lower key bits.
+struct HashMultiplyShift
+{
+    static constexpr uint64_t MULTIPLIER = 0x9E3779B97F4A7C15ULL;
+
+    size_t operator()(uint64_t key) const { return (key * MULTIPLIER) >> 32; }
+};
+
+/// Full 64x64->128 multiply, folding the high half into the low half.
+struct HashMul128Fold
+{
+    size_t operator()(uint64_t key) const
+    {
+        __uint128_t res = static_cast<__uint128_t>(key ^ 0xA0761D6478BD642FULL) * 0xE7037ED1A0B428DBULL;
+        return static_cast<uint64_t>(res) ^ static_cast<uint64_t>(res >> 64);
+    }
+};
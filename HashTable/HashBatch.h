@@ -0,0 +1,182 @@
+#pragma once
+
+#include <algorithm>
+#include <type_traits>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "Hash.h"
+#include "HashTable.h"
+#include "TargetSpecific.h"
+
+/** Hashing of a batch of keys into an array of hashes.
+  * The kernels are compiled for every target and the one for `target_arch` is chosen when called,
+  *  so a build without -msse4.2 still hashes with the CRC32 instruction on hosts that have it.
+  *
+  * Keys are read with a stride in bytes, so the kernels work directly on the `key` member of an array of rows.
+  */
+using HashBatchFunction = void (*)(const UInt64 * keys, size_t stride, size_t size, size_t * hashes);
+
+TIFLASH_DECLARE_MULTITARGET_CODE(
+/// The same values as intHashCRC32. There is no vector CRC32, independent keys still overlap in the pipeline.
+inline void hashCRC32Batch(const UInt64 * keys, size_t stride, size_t size, size_t * hashes)
+{
+    const char * base = reinterpret_cast<const char *>(keys);
+    for (size_t i = 0; i < size; ++i)
+        hashes[i] = crc32c(-1ULL, *reinterpret_cast<const UInt64 *>(base + i * stride));
+}
+)
+
+TIFLASH_DECLARE_DEFAULT_CODE(
+inline void hashMultiplyShiftBatch(const UInt64 * keys, size_t stride, size_t size, size_t * hashes)
+{
+    const char * base = reinterpret_cast<const char *>(keys);
+    for (size_t i = 0; i < size; ++i)
+        hashes[i] = HashMultiplyShift()(*reinterpret_cast<const UInt64 *>(base + i * stride));
+}
+)
+
+TIFLASH_DECLARE_SSE42_SPECIFIC_CODE(
+inline void hashMultiplyShiftBatch(const UInt64 * keys, size_t stride, size_t size, size_t * hashes)
+{
+    Default::hashMultiplyShiftBatch(keys, stride, size, hashes);
+}
+)
+
+TIFLASH_DECLARE_AVX2_SPECIFIC_CODE(
+/// 4 keys per iteration. AVX2 has no 64-bit multiply, the low half of the product is lo * lo + ((lo * hi + hi * lo) << 32).
+inline void hashMultiplyShiftBatch(const UInt64 * keys, size_t stride, size_t size, size_t * hashes)
+{
+    const char * base = reinterpret_cast<const char *>(keys);
+    const __m256i offsets = _mm256_setr_epi64x(0, stride, 2 * stride, 3 * stride);
+    const __m256i multiplier_lo = _mm256_set1_epi64x(HashMultiplyShift::MULTIPLIER & 0xFFFFFFFFULL);
+    const __m256i multiplier_hi = _mm256_set1_epi64x(HashMultiplyShift::MULTIPLIER >> 32);
+
+    size_t i = 0;
+    for (; i + 4 <= size; i += 4)
+    {
+        const char * pos = base + i * stride;
+        __m256i key = stride == sizeof(UInt64)
+            ? _mm256_loadu_si256(reinterpret_cast<const __m256i *>(pos))
+            : _mm256_i64gather_epi64(reinterpret_cast<const long long *>(pos), offsets, 1);
+        __m256i key_hi = _mm256_srli_epi64(key, 32);
+        __m256i cross = _mm256_add_epi64(_mm256_mul_epu32(key, multiplier_hi), _mm256_mul_epu32(key_hi, multiplier_lo));
+        __m256i product = _mm256_add_epi64(_mm256_mul_epu32(key, multiplier_lo), _mm256_slli_epi64(cross, 32));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(hashes + i), _mm256_srli_epi64(product, 32));
+    }
+    Default::hashMultiplyShiftBatch(reinterpret_cast<const UInt64 *>(base + i * stride), stride, size - i, hashes + i);
+}
+)
+
+TIFLASH_DECLARE_AVX512_SPECIFIC_CODE(
+/// 8 keys per iteration with the 64-bit multiply of AVX-512DQ.
+inline void hashMultiplyShiftBatch(const UInt64 * keys, size_t stride, size_t size, size_t * hashes)
+{
+    const char * base = reinterpret_cast<const char *>(keys);
+    const __m512i offsets = _mm512_setr_epi64(0, stride, 2 * stride, 3 * stride, 4 * stride, 5 * stride, 6 * stride, 7 * stride);
+    const __m512i multiplier = _mm512_set1_epi64(HashMultiplyShift::MULTIPLIER);
+
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8)
+    {
+        const char * pos = base + i * stride;
+        __m512i key = stride == sizeof(UInt64) ? _mm512_loadu_si512(pos) : _mm512_i64gather_epi64(offsets, pos, 1);
+        __m512i product = _mm512_mullo_epi64(key, multiplier);
+        _mm512_storeu_si512(hashes + i, _mm512_srli_epi64(product, 32));
+    }
+    Default::hashMultiplyShiftBatch(reinterpret_cast<const UInt64 *>(base + i * stride), stride, size - i, hashes + i);
+}
+)
+
+#if defined(__x86_64__)
+#define TIFLASH_SELECT_KERNEL(arch, NAME)                             \
+    switch (arch)                                                     \
+    {                                                                 \
+        case TargetArch::SSE42: return TargetSpecific::SSE42::NAME;   \
+        case TargetArch::AVX2: return TargetSpecific::AVX2::NAME;     \
+        case TargetArch::AVX512: return TargetSpecific::AVX512::NAME; \
+        default: return TargetSpecific::Default::NAME;                \
+    }
+#else
+#define TIFLASH_SELECT_KERNEL(arch, NAME) return TargetSpecific::Default::NAME;
+#endif
+
+inline HashBatchFunction hashCRC32BatchFunction(TargetArch arch)
+{
+    TIFLASH_SELECT_KERNEL(arch, hashCRC32Batch)
+}
+
+inline HashBatchFunction hashMultiplyShiftBatchFunction(TargetArch arch)
+{
+    TIFLASH_SELECT_KERNEL(arch, hashMultiplyShiftBatch)
+}
+
+/// Hash `size` keys `stride` bytes apart with HashMethod, using the vectorized kernel of the policy if there is one.
+template <typename HashMethod>
+void hashBatch(const UInt64 * keys, size_t stride, size_t size, size_t * hashes)
+{
+    if constexpr (std::is_same_v<HashMethod, HashCRC32<UInt64>>)
+        hashCRC32BatchFunction(target_arch)(keys, stride, size, hashes);
+    else if constexpr (std::is_same_v<HashMethod, HashMultiplyShift>)
+        hashMultiplyShiftBatchFunction(target_arch)(keys, stride, size, hashes);
+    else
+    {
+        auto hash_method = HashMethod();
+        const char * base = reinterpret_cast<const char *>(keys);
+        for (size_t i = 0; i < size; ++i)
+            hashes[i] = hash_method(*reinterpret_cast<const UInt64 *>(base + i * stride));
+    }
+}
+
+/** Hashes of the `key` members of an array of rows, computed BATCH_SIZE rows at a time with hashBatch().
+  * A loop asks for get(i) instead of hashing the key itself, and the hashing leaves the critical path of the loop.
+  * Rows should be requested in non-decreasing order, as the probe loops and the partitioner do,
+  *  going back refills the batch at the requested row, so a second pass over the rows is fine.
+  */
+template <typename HashMethod, typename Row>
+class BatchedHashes
+{
+public:
+    static constexpr size_t BATCH_SIZE = 256;
+
+    BatchedHashes(const Row * rows_, size_t size_)
+        : rows(rows_)
+        , size(size_)
+    {}
+
+    explicit BatchedHashes(const std::vector<Row> & rows_)
+        : BatchedHashes(rows_.data(), rows_.size())
+    {}
+
+    size_t ALWAYS_INLINE get(size_t i)
+    {
+        if (unlikely(i >= batch_end || i < batch_begin))
+            fill(i);
+        return hashes[i - batch_begin];
+    }
+
+private:
+    /// Row is either a struct with a `key` member or the key itself, e.g. the data of a key column.
+    static const UInt64 * keyOf(const Row & row)
+    {
+        if constexpr (std::is_same_v<Row, UInt64>)
+            return &row;
+        else
+            return &row.key;
+    }
+
+    void NO_INLINE fill(size_t i)
+    {
+        batch_begin = i;
+        batch_end = std::min(i + BATCH_SIZE, size);
+        hashBatch<HashMethod>(keyOf(rows[i]), sizeof(Row), batch_end - batch_begin, hashes);
+    }
+
+    const Row * rows;
+    size_t size;
+    size_t batch_begin = 0;
+    size_t batch_end = 0;
+    size_t hashes[BATCH_SIZE];
+};
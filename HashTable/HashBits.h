@@ -0,0 +1,122 @@
+#pragma once
+
+#include <cmath>
+#include <cstdio>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "HashBatch.h"
+
+/** How the bits of one hash are split between partition selection, bucket selection and the tag.
+  *
+  *   bit hash_bits - 1                                      bit 0
+  *   [ partition | ...unused... | tag | bucket ]
+  *
+  * The partition is taken from the top and the bucket from the bottom, so the fields are independent
+  *  as long as they fit: partition_bits + tag_bits + bucket_bits <= hash_bits.
+  * Otherwise the fields share `overlap()` bits: with a 32-bit CRC, 256 partitions and 2^25 buckets share one bit,
+  *  and the rows of one partition can only reach half of the buckets of its table.
+  */
+struct HashBitLayout
+{
+    size_t hash_bits = 64;
+    size_t partition_num = 1;
+    size_t partition_bits = 0;
+    size_t bucket_bits = 0;
+    size_t tag_bits = 0;
+
+    HashBitLayout() = default;
+
+    /// Tag bits are what is left above the buckets if `tag_bits_` is not given.
+    HashBitLayout(size_t hash_bits_, size_t partition_num_, size_t bucket_bits_, ssize_t tag_bits_ = -1)
+        : hash_bits(hash_bits_)
+        , partition_num(partition_num_)
+        , partition_bits(partition_num_ > 1 ? static_cast<size_t>(std::ceil(std::log2(partition_num_))) : 0)
+        , bucket_bits(bucket_bits_)
+    {
+        if (tag_bits_ >= 0)
+            tag_bits = tag_bits_;
+        else if (hash_bits > partition_bits + bucket_bits)
+            tag_bits = hash_bits - partition_bits - bucket_bits;
+    }
+
+    size_t overlap() const
+    {
+        size_t used = partition_bits + tag_bits + bucket_bits;
+        return used > hash_bits ? used - hash_bits : 0;
+    }
+
+    /// partition_num needn't be a power of two, the top 32 bits of the hash are scaled to [0, partition_num).
+    size_t partition(size_t hash) const { return (((hash >> (hash_bits - 32)) & 0xFFFFFFFFULL) * partition_num) >> 32; }
+    size_t bucket(size_t hash) const { return hash & mask(bucket_bits); }
+    size_t tag(size_t hash) const { return (hash >> bucket_bits) & mask(tag_bits); }
+
+    void print(const std::string & log_head) const
+    {
+        printf("%s hash bits %zu: partition %zu, tag %zu, bucket %zu, overlap %zu\n",
+               log_head.c_str(), hash_bits, partition_bits, tag_bits, bucket_bits, overlap());
+    }
+
+private:
+    static size_t mask(size_t bits) { return bits >= 64 ? ~0ULL : (1ULL << bits) - 1; }
+};
+
+template <typename HashMethod>
+HashBitLayout makeHashBitLayout(size_t partition_num, size_t bucket_bits, ssize_t tag_bits = -1)
+{
+    return HashBitLayout(hashBits<HashMethod>(), partition_num, bucket_bits, tag_bits);
+}
+
+/// Bucket bits of a table for `size` rows, the head_size of the chained variants.
+inline size_t bucketBitsFor(size_t size)
+{
+    return size > 1 ? static_cast<size_t>(std::log2(size - 1)) + 2 : 1;
+}
+
+/** For every partition, the number of distinct buckets its rows occupy, relative to the expected B * (1 - e^(-n/B))
+  *  for n rows thrown uniformly into B buckets. A ratio well below 1 means that partition and bucket bits are correlated.
+  */
+template <typename HashMethod, typename Row>
+void reportPartitionOccupancy(const std::string & log_head, const std::vector<std::vector<Row>> & partitions, const HashBitLayout & layout)
+{
+    size_t bucket_num = 1ULL << layout.bucket_bits;
+    std::vector<UInt8> used(bucket_num);
+
+    double min_ratio = INFINITY;
+    double max_ratio = 0;
+    double sum_ratio = 0;
+    size_t worst = 0;
+    size_t non_empty = 0;
+    for (size_t part = 0; part < partitions.size(); ++part)
+    {
+        const auto & rows = partitions[part];
+        if (rows.empty())
+            continue;
+
+        std::fill(used.begin(), used.end(), 0);
+        size_t occupied = 0;
+        BatchedHashes<HashMethod, Row> hashes(rows);
+        for (size_t i = 0; i < rows.size(); ++i)
+        {
+            auto & flag = used[layout.bucket(hashes.get(i))];
+            occupied += !flag;
+            flag = 1;
+        }
+
+        double expected = bucket_num * (1 - std::exp(-static_cast<double>(rows.size()) / bucket_num));
+        double ratio = occupied / expected;
+        if (ratio < min_ratio)
+        {
+            min_ratio = ratio;
+            worst = part;
+        }
+        max_ratio = std::max(max_ratio, ratio);
+        sum_ratio += ratio;
+        ++non_empty;
+    }
+
+    if (non_empty)
+        printf("%s bucket occupancy per partition (1.0 is uniform): min %.3f (partition %zu), avg %.3f, max %.3f\n",
+               log_head.c_str(), min_ratio, worst, sum_ratio / non_empty, max_ratio);
+}
@@ -331,19 +331,20 @@ template <
         typename Cell,
         typename Hash,
         typename Grower = HashTableGrower<>,
-        typename Allocator = HashTableAllocator>
-class ConcurrentHashMapTable : public ConcurrentHashTable<HashMapTable<Key, Cell, Hash, Grower, Allocator>>
+        typename Allocator = HashTableAllocator,
+        typename Mutex = RWSpinLock>
+class ConcurrentHashMapTable : public ConcurrentHashTable<HashMapTable<Key, Cell, Hash, Grower, Allocator>, Mutex>
 {
 public:
     using key_type = Key;
     using mapped_type = typename Cell::Mapped;
     using value_type = typename Cell::value_type;
 
-    using ConcurrentHashTable<HashMapTable<Key, Cell, Hash, Grower, Allocator>>::ConcurrentHashTable;
+    using ConcurrentHashTable<HashMapTable<Key, Cell, Hash, Grower, Allocator>, Mutex>::ConcurrentHashTable;
 
     mapped_type & ALWAYS_INLINE operator[](Key x)
     {
-        typename ConcurrentHashMapTable::SegmentType::HashTableType::iterator it;
+        typename ConcurrentHashMapTable::SegmentType::IteratorWithLock it;
         bool inserted;
         this->emplace(x, it, inserted);
 
@@ -364,9 +365,9 @@ public:
           *  do not need extra lock here because even in multi-thread environment, it is guaranteed `inserted` to be true only in one thread
           */
         if (inserted)
-            new (&it->second) mapped_type();
+            new (&it.first->getMapped()) mapped_type();
 
-        return it->second;
+        return it.first->getMapped();
     }
 };
 
@@ -376,8 +377,9 @@ template <
         typename Mapped,
         typename Hash,
         typename Grower = HashTableGrower<>,
-        typename Allocator = HashTableAllocator>
-using ConcurrentHashMap = ConcurrentHashMapTable<Key, HashMapCell<Key, Mapped, Hash>, Hash, Grower, Allocator>;
+        typename Allocator = HashTableAllocator,
+        typename Mutex = RWSpinLock>
+using ConcurrentHashMap = ConcurrentHashMapTable<Key, HashMapCell<Key, Mapped, Hash>, Hash, Grower, Allocator, Mutex>;
 
 
 template <
@@ -385,5 +387,6 @@ template <
         typename Mapped,
         typename Hash,
         typename Grower = HashTableGrower<>,
-        typename Allocator = HashTableAllocator>
-using ConcurrentHashMapWithSavedHash = ConcurrentHashMapTable<Key, HashMapCellWithSavedHash<Key, Mapped, Hash>, Hash, Grower, Allocator>;
+        typename Allocator = HashTableAllocator,
+        typename Mutex = RWSpinLock>
+using ConcurrentHashMapWithSavedHash = ConcurrentHashMapTable<Key, HashMapCellWithSavedHash<Key, Mapped, Hash>, Hash, Grower, Allocator, Mutex>;
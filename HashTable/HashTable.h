@@ -14,8 +14,12 @@
 
 #pragma once
 
+#include <cassert>
 #include <memory>
 #include <mutex>
+#include <shared_mutex>
+#include <type_traits>
+#include <vector>
 #include <math.h>
 #include <string.h>
 
@@ -25,6 +29,8 @@
 #include "Defines.h"
 #include "Types.h"
 #include "Allocator.h"
+#include "Hash.h"
+#include "RWSpinLock.h"
 
 #define DBMS_HASH_MAP_COUNT_COLLISIONS
 
@@ -61,6 +67,16 @@ struct HashCRC32
     }
 };
 
+/// Number of well-mixed bits a hash policy returns. CRC32 and multiply-shift only fill the low 32 bits.
+template <typename HashMethod>
+constexpr size_t hashBits()
+{
+    if constexpr (std::is_same_v<HashMethod, HashCRC32<UInt64>> || std::is_same_v<HashMethod, HashMultiplyShift>)
+        return 32;
+    else
+        return 64;
+}
+
 #ifdef DBMS_HASH_MAP_DEBUG_RESIZES
 #include "Stopwatch.h"
 
@@ -808,6 +824,9 @@ public:
         std::swap(buf, rhs.buf);
         std::swap(m_size, rhs.m_size);
         std::swap(grower, rhs.grower);
+        /// find() probes at most displace_max_step cells past the place of a key.
+        std::swap(displace_max_step, rhs.displace_max_step);
+        std::swap(collisions, rhs.collisions);
 
         Hash::operator=(std::move(rhs));
         Allocator::operator=(std::move(rhs));
@@ -1310,71 +1329,82 @@ public:
 #endif
 };
 
-template <typename HashTableType>
+/** A hash table and its lock. Lookups take the lock shared, inserts exclusive.
+  * The returned iterators hold the lock until they are destroyed: IteratorWithLock an exclusive one, since the caller may
+  *  write the mapped value, ConstIteratorWithLock a shared one.
+  * The locks are std::unique_lock / std::shared_lock, so an operation doesn't allocate as with the former
+  *  std::unique_ptr<std::lock_guard<std::mutex>>, and with RWSpinLock probe threads don't serialize on each other.
+  * Pass ExclusiveMutex to get the former behaviour of one mutex for everything.
+  */
+template <typename HashTableType, typename Mutex = RWSpinLock>
 class HashTableWithLock
 {
 public:
     using HashTable = HashTableType;
-    using LockGuard = std::lock_guard<std::mutex>;
-    /// Maybe it's more reasonable to hold a write lock for IteratorWithLock and a read lock for ConstIteratorWithLock, however,
-    /// when I refine the code using shared_mutex to return read lock for ConstIterator and write lock for Iterator, the tests
-    /// in gtest_concurrent_hashmap(with test_loop = 1000) is about 5 times slower. Since the typical usage of concurrent hash map
-    /// in TiFlash is concurrent insert(when building join hash table), I think just keep using mutex is ok.
-    using IteratorWithLock = std::pair<typename HashTableType::LookupResult, std::unique_ptr<LockGuard>>;
-    using ConstIteratorWithLock = std::pair<typename HashTableType::ConstLookupResult, std::unique_ptr<LockGuard>>;
+    using WriteLock = std::unique_lock<Mutex>;
+    using ReadLock = std::shared_lock<Mutex>;
+    using IteratorWithLock = std::pair<typename HashTableType::LookupResult, WriteLock>;
+    using ConstIteratorWithLock = std::pair<typename HashTableType::ConstLookupResult, ReadLock>;
     HashTableWithLock() = default;
     explicit HashTableWithLock(size_t reserve_for_num_elements)
             : hash_table(reserve_for_num_elements)
     {}
-    std::mutex & getMutex() { return mutex; }
+    Mutex & getMutex() { return mutex; }
     HashTableType & getHashTable() { return hash_table; }
+    const HashTableType & getHashTable() const { return hash_table; }
     IteratorWithLock ALWAYS_INLINE find(const typename HashTableType::Key & x)
     {
-        auto lock_ptr = std::make_unique<LockGuard>(mutex);
-        return std::make_pair(hash_table.find(x), std::move(lock_ptr));
+        WriteLock lock(mutex);
+        return std::make_pair(hash_table.find(x), std::move(lock));
     }
     ConstIteratorWithLock ALWAYS_INLINE find(const typename HashTableType::Key & x) const
     {
-        auto lock_ptr = std::make_unique<LockGuard>(mutex);
-        return std::make_pair(hash_table.find(x), std::move(lock_ptr));
+        ReadLock lock(mutex);
+        return std::make_pair(hash_table.find(x), std::move(lock));
     }
     IteratorWithLock ALWAYS_INLINE find(const typename HashTableType::Key & x, size_t hash_value)
     {
-        auto lock_ptr = std::make_unique<LockGuard>(mutex);
-        return std::make_pair(hash_table.find(x, hash_value), std::move(lock_ptr));
+        WriteLock lock(mutex);
+        return std::make_pair(hash_table.find(x, hash_value), std::move(lock));
     }
     ConstIteratorWithLock ALWAYS_INLINE find(const typename HashTableType::Key & x, size_t hash_value) const
     {
-        auto lock_ptr = std::make_unique<LockGuard>(mutex);
-        return std::make_pair(hash_table.find(x, hash_value), std::move(lock_ptr));
+        ReadLock lock(mutex);
+        return std::make_pair(hash_table.find(x, hash_value), std::move(lock));
     }
     /// Insert a value. In the case of any more complex values, it is better to use the `emplace` function.
     std::pair<IteratorWithLock, bool> ALWAYS_INLINE insert(const typename HashTableType::value_type & x)
     {
-        auto lock_ptr = std::make_unique<LockGuard>(mutex);
+        WriteLock lock(mutex);
         auto res = hash_table.insert(x);
-        return std::make_pair(std::make_pair(res.first, std::move(lock_ptr)), res.second);
+        return std::make_pair(std::make_pair(res.first, std::move(lock)), res.second);
     }
+    /// `it` may still hold the lock of a previous emplace, it is released first, so reusing `it` in a loop doesn't self-deadlock.
     void ALWAYS_INLINE emplace(const typename HashTableType::Key & x, IteratorWithLock & it, bool & inserted)
     {
-        it.second = std::make_unique<LockGuard>(mutex);
+        relock(it.second);
         return hash_table.emplace(x, it.first, inserted);
     }
     void ALWAYS_INLINE emplace(const typename HashTableType::Key & x, IteratorWithLock & it, bool & inserted, size_t hash_value)
     {
-        it.second = std::make_unique<LockGuard>(mutex);
+        relock(it.second);
         return hash_table.emplace(x, it.first, inserted, hash_value);
     }
     bool ALWAYS_INLINE has(const typename HashTableType::Key & x) const
     {
-        LockGuard lk(mutex);
+        ReadLock lock(mutex);
         return hash_table.has(x);
     }
     bool ALWAYS_INLINE has(const typename HashTableType::Key & x, size_t hash_value) const
     {
-        LockGuard lk(mutex);
+        ReadLock lock(mutex);
         return hash_table.has(x, hash_value);
     }
+    /// Takes no lock, a prefetch into a buffer that a concurrent resize has just freed is harmless.
+    void ALWAYS_INLINE prefetch(size_t hash_value) const
+    {
+        hash_table.prefetch(hash_value);
+    }
     size_t getBufferSizeInBytes() const
     {
         return hash_table.getBufferSizeInBytes();
@@ -1385,36 +1415,50 @@ public:
     }
 
 private:
+    void ALWAYS_INLINE relock(WriteLock & lock)
+    {
+        if (lock.owns_lock())
+            lock.unlock();
+        lock = WriteLock(mutex);
+    }
+
     HashTableType hash_table;
-    mutable std::mutex mutex;
+    mutable Mutex mutex;
 };
 
-template <typename HashTableType>
+/** The table is split into a power of two of segments, each a HashTableWithLock.
+  * The segment is taken from the top bits of the hash, the segment table takes its buckets from the bottom bits,
+  *  so the two don't correlate while segments * buckets per segment fits into hashBits<Hash>().
+  * The number of segments is rounded up to a power of two.
+  */
+template <typename HashTableType, typename Mutex = RWSpinLock>
 class ConcurrentHashTable : protected HashTableType::Hash
         , protected HashTableType::Allocator
         , protected HashTableType::Cell::State
         , protected ZeroValueStorage<HashTableType::Cell::need_zero_value_storage, typename HashTableType::Cell>
 {
 public:
-    using SegmentType = HashTableWithLock<HashTableType>;
+    using SegmentType = HashTableWithLock<HashTableType, Mutex>;
     using Key = typename HashTableType::Key;
     using Cell = typename HashTableType::Cell;
     using Hash = typename HashTableType::Hash;
 
     explicit ConcurrentHashTable(size_t segment_size_)
-            : segment_size(segment_size_)
+            : segment_bits(segmentBits(segment_size_))
+            , segment_size(1ULL << segment_bits)
     {
         for (size_t i = 0; i < segment_size; i++)
         {
-            segments.emplace_back(std::move(std::make_unique<HashTableWithLock<HashTableType>>()));
+            segments.emplace_back(std::make_unique<SegmentType>());
         }
     }
     ConcurrentHashTable(size_t segment_size_, size_t reserve_for_num_elements)
-            : segment_size(segment_size_)
+            : segment_bits(segmentBits(segment_size_))
+            , segment_size(1ULL << segment_bits)
     {
         for (size_t i = 0; i < segment_size; i++)
         {
-            segments.emplace_back(std::make_unique<HashTableWithLock<HashTableType>>(reserve_for_num_elements));
+            segments.emplace_back(std::make_unique<SegmentType>(reserve_for_num_elements));
         }
     }
 
@@ -1428,7 +1472,7 @@ public:
         return segments[segment_index]->getHashTable();
     }
 
-    std::mutex & getSegmentMutex(size_t segment_index)
+    Mutex & getSegmentMutex(size_t segment_index)
     {
         return segments[segment_index]->getMutex();
     }
@@ -1444,6 +1488,14 @@ public:
         return Cell::isZero(x, *this);
     }
 
+    /// The zero key lives in segment 0, whatever its hash.
+    size_t ALWAYS_INLINE segmentIndex(size_t hash_value) const
+    {
+        if (segment_bits == 0)
+            return 0;
+        return (hash_value >> (hashBits<Hash>() - segment_bits)) & (segment_size - 1);
+    }
+
     typename SegmentType::IteratorWithLock ALWAYS_INLINE find(const Key & x)
     {
         size_t segment_index = 0;
@@ -1451,7 +1503,7 @@ public:
         if (!isZero(x))
         {
             hash_value = hash(x);
-            segment_index = hash_value % segment_size;
+            segment_index = segmentIndex(hash_value);
         }
 
         return segments[segment_index]->find(x, hash_value);
@@ -1464,17 +1516,17 @@ public:
         if (!isZero(x))
         {
             hash_value = hash(x);
-            segment_index = hash_value % segment_size;
+            segment_index = segmentIndex(hash_value);
         }
 
-        return segments[segment_index].find(x, hash_value);
+        return std::as_const(*segments[segment_index]).find(x, hash_value);
     }
 
     typename SegmentType::IteratorWithLock ALWAYS_INLINE find(const Key & x, size_t hash_value)
     {
         size_t segment_index = 0;
         if (!isZero(x))
-            segment_index = hash_value % segment_size;
+            segment_index = segmentIndex(hash_value);
 
         return segments[segment_index]->find(x, hash_value);
     }
@@ -1483,9 +1535,9 @@ public:
     {
         size_t segment_index = 0;
         if (!isZero(x))
-            segment_index = hash_value % segment_size;
+            segment_index = segmentIndex(hash_value);
 
-        return segments[segment_index]->find(x, hash_value);
+        return std::as_const(*segments[segment_index]).find(x, hash_value);
     }
 
     /// Insert a value. In the case of any more complex values, it is better to use the `emplace` function.
@@ -1495,7 +1547,7 @@ public:
         if (!isZero(Cell::getKey(x)))
         {
             size_t hash_value = hash(Cell::getKey(x));
-            segment_index = hash_value % segment_size;
+            segment_index = segmentIndex(hash_value);
         }
 
         return segments[segment_index]->insert(x);
@@ -1507,16 +1559,16 @@ public:
         if (!isZero(x))
         {
             size_t hash_value = hash(x);
-            segment_index = hash_value % segment_size;
+            segment_index = segmentIndex(hash_value);
         }
         return segments[segment_index]->emplace(x, it, inserted);
     }
 
-    void ALWAYS_INLINE emplace(const Key & x, typename SegmentType::ConstIteratorWithLock & it, bool & inserted, size_t hash_value)
+    void ALWAYS_INLINE emplace(const Key & x, typename SegmentType::IteratorWithLock & it, bool & inserted, size_t hash_value)
     {
         size_t segment_index = 0;
         if (!isZero(x))
-            segment_index = hash_value % segment_size;
+            segment_index = segmentIndex(hash_value);
         return segments[segment_index]->emplace(x, it, inserted, hash_value);
     }
 
@@ -1526,7 +1578,7 @@ public:
         if (!isZero(x))
         {
             size_t hash_value = hash(x);
-            segment_index = hash_value % segment_size;
+            segment_index = segmentIndex(hash_value);
         }
 
         return segments[segment_index]->has(x);
@@ -1535,12 +1587,38 @@ public:
     bool ALWAYS_INLINE has(const Key & x, size_t hash_value) const
     {
         size_t segment_index = 0;
-        if (isZero(x))
-            segment_index = hash_value % segment_index;
+        if (!isZero(x))
+            segment_index = segmentIndex(hash_value);
 
         return segments[segment_index]->has(x, hash_value);
     }
 
+    /// Prefetch the cell of a hash in its segment, without a lock. A zero key may be prefetched in the wrong segment.
+    void ALWAYS_INLINE prefetch(size_t hash_value) const
+    {
+        segments[segmentIndex(hash_value)]->prefetch(hash_value);
+    }
+
+    static constexpr size_t PREFETCH_DISTANCE = 16;
+
+    /** Find `size` keys `stride` bytes apart with their precomputed hashes, e.g. from hashBatch().
+      * The cell of the lookup PREFETCH_DISTANCE ahead is prefetched, so the cache misses of several lookups overlap.
+      * f(i, cell) is called for every key found, with the read lock of its segment held.
+      */
+    template <typename F>
+    void findBatch(const Key * keys, size_t stride, const size_t * hashes, size_t size, F && f) const
+    {
+        const char * base = reinterpret_cast<const char *>(keys);
+        for (size_t i = 0; i < size; ++i)
+        {
+            if (i + PREFETCH_DISTANCE < size)
+                prefetch(hashes[i + PREFETCH_DISTANCE]);
+            auto it = find(*reinterpret_cast<const Key *>(base + i * stride), hashes[i]);
+            if (it.first != nullptr)
+                f(i, it.first);
+        }
+    }
+
     size_t getBufferSizeInBytes() const
     {
         size_t ret = 0;
@@ -1560,6 +1638,15 @@ public:
     }
 
 private:
+    static size_t segmentBits(size_t segment_size_)
+    {
+        size_t bits = 0;
+        while ((1ULL << bits) < segment_size_)
+            ++bits;
+        return bits;
+    }
+
     std::vector<std::unique_ptr<SegmentType>> segments;
+    size_t segment_bits;
     size_t segment_size;
 };
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "Defines.h"
+#include "Types.h"
+
+/** Join kinds. The probe side is the left table and the build side the right table, as in a plan that builds on the right.
+  *
+  * inner - every matching (build, probe) pair;
+  * left  - inner, plus every probe row without a match, paired with a null build row;
+  * right - inner, plus every build row no probe row matched, paired with a null probe row;
+  * full  - left and right;
+  * semi  - every probe row that has a match, once, the chain walk stops at the first match;
+  * anti  - every probe row without a match.
+  */
+enum class JoinKind
+{
+    Inner,
+    Left,
+    Right,
+    Full,
+    Semi,
+    Anti,
+};
+
+inline const char * toString(JoinKind kind)
+{
+    switch (kind)
+    {
+        case JoinKind::Inner: return "inner";
+        case JoinKind::Left: return "left";
+        case JoinKind::Right: return "right";
+        case JoinKind::Full: return "full";
+        case JoinKind::Semi: return "semi";
+        case JoinKind::Anti: return "anti";
+    }
+    return "unknown";
+}
+
+inline bool parseJoinKind(const std::string & name, JoinKind & kind)
+{
+    for (auto k : {JoinKind::Inner, JoinKind::Left, JoinKind::Right, JoinKind::Full, JoinKind::Semi, JoinKind::Anti})
+    {
+        if (name == toString(k))
+        {
+            kind = k;
+            return true;
+        }
+    }
+    return false;
+}
+
+/// "" for inner joins, so that their log lines don't change, "(left)" etc. otherwise.
+inline std::string joinKindSuffix(JoinKind kind)
+{
+    return kind == JoinKind::Inner ? "" : std::string("(") + toString(kind) + ")";
+}
+
+constexpr bool emitsUnmatchedProbe(JoinKind kind)
+{
+    return kind == JoinKind::Left || kind == JoinKind::Full || kind == JoinKind::Anti;
+}
+
+constexpr bool emitsUnmatchedBuild(JoinKind kind)
+{
+    return kind == JoinKind::Right || kind == JoinKind::Full;
+}
+
+constexpr bool stopsAtFirstMatch(JoinKind kind)
+{
+    return kind == JoinKind::Semi || kind == JoinKind::Anti;
+}
+
+/// One bit per build row, set when a probe row matched it. Only RIGHT and FULL joins need it.
+class BuildMatchedMap
+{
+public:
+    explicit BuildMatchedMap(size_t rows = 0)
+        : bits((rows + 63) / 64)
+        , size(rows)
+    {}
+
+    void ALWAYS_INLINE setMatched(size_t row) { bits[row / 64] |= 1ULL << (row % 64); }
+    bool isMatched(size_t row) const { return bits[row / 64] >> (row % 64) & 1; }
+
+    /// Call f(row) for every row that is not matched, in increasing order.
+    template <typename F>
+    void forEachUnmatched(F && f) const
+    {
+        for (size_t word = 0; word < bits.size(); ++word)
+        {
+            UInt64 unmatched = ~bits[word];
+            if (word == bits.size() - 1 && size % 64)
+                unmatched &= (1ULL << (size % 64)) - 1;
+            while (unmatched)
+            {
+                f(word * 64 + __builtin_ctzll(unmatched));
+                unmatched &= unmatched - 1;
+            }
+        }
+    }
+
+private:
+    std::vector<UInt64> bits;
+    size_t size;
+};
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+
+#include "Column.h"
+#include "Defines.h"
+
+using Columns = std::vector<std::unique_ptr<IColumn>>;
+
+/// An empty column of the same type for every column of `columns`.
+inline Columns cloneEmpty(const Columns & columns)
+{
+    Columns res;
+    for (const auto & column : columns)
+    {
+        bool found = dispatchColumn(*column, [&](auto & typed) { res.emplace_back(std::make_unique<std::decay_t<decltype(typed)>>()); });
+        if (!found)
+            exit(-1);
+    }
+    return res;
+}
+
+inline size_t byteSize(const Columns & columns)
+{
+    size_t size = 0;
+    for (const auto & column : columns)
+    {
+        dispatchColumn(*column, [&](auto & typed)
+        {
+            using Column = std::decay_t<decltype(typed)>;
+            if constexpr (std::is_same_v<Column, ColumnString>)
+                size += typed.getChars().size() + typed.getOffsets().size() * sizeof(UInt64);
+            else
+                size += typed.getData().size() * sizeof(typed.getData()[0]);
+        });
+    }
+    return size;
+}
+
+/** Materializes the result of a join into columns.
+  * The probe loop only records the (build row, probe row) pair of a match, every BATCH_SIZE pairs
+  *  all build and probe columns are gathered with one insertIndicesFrom call per column.
+  * The source columns must outlive the sink.
+  */
+class JoinOutputSink
+{
+public:
+    static constexpr size_t BATCH_SIZE = 4096;
+
+    JoinOutputSink(const Columns & build_columns_, const Columns & probe_columns_)
+        : build_columns(build_columns_)
+        , probe_columns(probe_columns_)
+        , build_output(cloneEmpty(build_columns_))
+        , probe_output(cloneEmpty(probe_columns_))
+    {}
+
+    void reserve(size_t rows)
+    {
+        for (auto & column : build_output)
+            column->reserve(rows);
+        for (auto & column : probe_output)
+            column->reserve(rows);
+    }
+
+    void ALWAYS_INLINE add(UInt32 build_row, UInt32 probe_row)
+    {
+        build_rows[pos] = build_row;
+        probe_rows[pos] = probe_row;
+        if (unlikely(++pos == BATCH_SIZE))
+            flush();
+    }
+
+    /// Must be called after the last add().
+    void NO_INLINE flush()
+    {
+        for (size_t i = 0; i < build_columns.size(); ++i)
+            build_output[i]->insertIndicesFrom(*build_columns[i], build_rows, pos);
+        for (size_t i = 0; i < probe_columns.size(); ++i)
+            probe_output[i]->insertIndicesFrom(*probe_columns[i], probe_rows, pos);
+        rows += pos;
+        pos = 0;
+    }
+
+    size_t size() const { return rows + pos; }
+    const Columns & getBuildOutput() const { return build_output; }
+    const Columns & getProbeOutput() const { return probe_output; }
+
+private:
+    const Columns & build_columns;
+    const Columns & probe_columns;
+    Columns build_output;
+    Columns probe_output;
+
+    size_t rows = 0;
+    size_t pos = 0;
+    UInt32 build_rows[BATCH_SIZE];
+    UInt32 probe_rows[BATCH_SIZE];
+};
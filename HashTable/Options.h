@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+/** Optional `--name=value` flags that may follow the positional arguments.
+  * The positional arguments keep their meaning, flags are looked up by name and can appear in any order.
+  */
+inline const char * findOption(int argc, char ** argv, const char * name)
+{
+    size_t name_len = strlen(name);
+    for (int i = 1; i < argc; ++i)
+    {
+        const char * arg = argv[i];
+        if (strncmp(arg, "--", 2) != 0)
+            continue;
+        arg += 2;
+        if (strncmp(arg, name, name_len) == 0 && arg[name_len] == '=')
+            return arg + name_len + 1;
+    }
+    return nullptr;
+}
+
+inline bool hasOption(int argc, char ** argv, const char * name)
+{
+    return findOption(argc, argv, name) != nullptr;
+}
+
+inline size_t getOption(int argc, char ** argv, const char * name, size_t default_value)
+{
+    const char * value = findOption(argc, argv, name);
+    size_t res = default_value;
+    if (value)
+        sscanf(value, "%zu", &res);
+    return res;
+}
+
+inline std::string getOption(int argc, char ** argv, const char * name, const std::string & default_value)
+{
+    const char * value = findOption(argc, argv, name);
+    return value ? std::string(value) : default_value;
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <atomic>
+#include <mutex>
+
+#if defined(__x86_64__)
+#include <emmintrin.h>
+#endif
+
+#include "Defines.h"
+#include "Types.h"
+
+inline void cpuRelax()
+{
+#if defined(__x86_64__)
+    _mm_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield" ::: "memory");
+#endif
+}
+
+/** A reader-writer spin lock in one word, for critical sections of a few dozen nanoseconds like a hash table lookup.
+  * Readers only do one atomic add on the way in and out, so many probe threads don't serialize as on a mutex.
+  * A writer first sets the WRITER bit, which stops new readers, and then waits for the readers inside to leave,
+  *  so a stream of readers can't starve the build.
+  * Satisfies Lockable and SharedLockable, use it with std::unique_lock and std::shared_lock.
+  */
+class RWSpinLock
+{
+public:
+    void lock()
+    {
+        UInt32 state = value.load(std::memory_order_relaxed);
+        while (true)
+        {
+            if (!(state & WRITER) && value.compare_exchange_weak(state, state | WRITER, std::memory_order_acquire, std::memory_order_relaxed))
+                break;
+            cpuRelax();
+            state = value.load(std::memory_order_relaxed);
+        }
+        while (value.load(std::memory_order_acquire) != WRITER)
+            cpuRelax();
+    }
+
+    bool try_lock() /// NOLINT
+    {
+        UInt32 expected = 0;
+        return value.compare_exchange_strong(expected, WRITER, std::memory_order_acquire, std::memory_order_relaxed);
+    }
+
+    void unlock() { value.fetch_sub(WRITER, std::memory_order_release); }
+
+    void lock_shared() /// NOLINT
+    {
+        while (!try_lock_shared())
+        {
+            while (value.load(std::memory_order_relaxed) & WRITER)
+                cpuRelax();
+        }
+    }
+
+    bool try_lock_shared() /// NOLINT
+    {
+        if (likely(!(value.fetch_add(READER, std::memory_order_acquire) & WRITER)))
+            return true;
+        value.fetch_sub(READER, std::memory_order_relaxed);
+        return false;
+    }
+
+    void unlock_shared() { value.fetch_sub(READER, std::memory_order_release); } /// NOLINT
+
+private:
+    static constexpr UInt32 WRITER = 1;
+    static constexpr UInt32 READER = 2;
+
+    std::atomic<UInt32> value{0};
+};
+
+/** std::mutex with the SharedLockable interface, shared locks are exclusive.
+  * The locking of HashTableWithLock before the segments got a read lock, kept to compare with.
+  */
+class ExclusiveMutex
+{
+public:
+    void lock() { mutex.lock(); }
+    bool try_lock() { return mutex.try_lock(); } /// NOLINT
+    void unlock() { mutex.unlock(); }
+    void lock_shared() { mutex.lock(); } /// NOLINT
+    bool try_lock_shared() { return mutex.try_lock(); } /// NOLINT
+    void unlock_shared() { mutex.unlock(); } /// NOLINT
+
+private:
+    std::mutex mutex;
+};
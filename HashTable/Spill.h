@@ -0,0 +1,210 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "Defines.h"
+#include "Stopwatch.h"
+#include "Types.h"
+
+/** Where and under which budget the out-of-core joins spill.
+  * The budget covers what a join keeps in memory at a time: the build rows of the partitions it holds and their hash tables.
+  */
+struct SpillOptions
+{
+    /// Empty means $TMPDIR, or /tmp without it.
+    std::string dir;
+    size_t memory_budget = 256ULL << 20;
+};
+
+inline SpillOptions spill_options;
+
+inline std::string spillDir()
+{
+    if (!spill_options.dir.empty())
+        return spill_options.dir;
+    const char * tmp = getenv("TMPDIR");
+    return tmp && *tmp ? tmp : "/tmp";
+}
+
+/// The I/O of one join, summed over all its spill files.
+struct SpillStats
+{
+    UInt64 bytes_written = 0;
+    UInt64 bytes_read = 0;
+    UInt64 write_ns = 0;
+    UInt64 read_ns = 0;
+    size_t files = 0;
+    /// Levels of repartitioning below the first one.
+    size_t max_depth = 0;
+    /// Partitions joined over the budget, because more hash bits don't split them, e.g. a key with too many duplicates.
+    size_t oversized = 0;
+
+    void print(const std::string & log_head) const
+    {
+        printf("%s spill write %lu bytes in %lu ns, read %lu bytes in %lu ns, %zu files, depth %zu, oversized %zu\n",
+               log_head.c_str(), bytes_written, write_ns, bytes_read, read_ns, files, max_depth, oversized);
+    }
+};
+
+/** A temporary file of rows. It is created by mkstemp in spillDir() and unlinked at once, so nothing is left behind
+  *  when the process dies. Rows are appended through a buffer of BUFFER_BYTES that exists only while the file is written,
+  *  and read back sequentially in chunks of the same size, or all at once.
+  * Rows are written as they are in memory, pointers in them are garbage after reading.
+  */
+template <typename Row>
+class SpillFile
+{
+    static_assert(std::is_trivially_copyable_v<Row>);
+
+public:
+    static constexpr size_t BUFFER_BYTES = 1 << 15;
+    static constexpr size_t BUFFER_ROWS = std::max<size_t>(BUFFER_BYTES / sizeof(Row), 1);
+
+    explicit SpillFile(SpillStats & stats_)
+        : stats(&stats_)
+    {
+        std::string path = spillDir() + "/bench_hash_join_spill_XXXXXX";
+        fd = mkstemp(path.data());
+        if (fd < 0)
+        {
+            printf("can't create a spill file in %s: %s\n", spillDir().c_str(), strerror(errno));
+            abort();
+        }
+        unlink(path.c_str());
+        ++stats->files;
+    }
+
+    SpillFile(SpillFile && rhs) noexcept
+        : stats(rhs.stats), fd(rhs.fd), rows(rhs.rows), buffer(std::move(rhs.buffer)), buffered(rhs.buffered)
+    {
+        rhs.fd = -1;
+    }
+
+    SpillFile(const SpillFile &) = delete;
+    SpillFile & operator=(const SpillFile &) = delete;
+    SpillFile & operator=(SpillFile &&) = delete;
+
+    ~SpillFile()
+    {
+        if (fd >= 0)
+            close(fd);
+    }
+
+    void ALWAYS_INLINE append(const Row & row)
+    {
+        if (unlikely(!buffer))
+            buffer = std::make_unique<char[]>(BUFFER_ROWS * sizeof(Row));
+        memcpy(buffer.get() + buffered * sizeof(Row), &row, sizeof(Row));
+        ++buffered;
+        ++rows;
+        if (unlikely(buffered == BUFFER_ROWS))
+            flush();
+    }
+
+    /// Write out the buffer and release it, call it before reading.
+    void finishWrite()
+    {
+        flush();
+        buffer.reset();
+    }
+
+    /// Close the file early, its disk space is freed.
+    void release()
+    {
+        if (fd >= 0)
+            close(fd);
+        fd = -1;
+        rows = 0;
+        buffer.reset();
+        buffered = 0;
+    }
+
+    size_t size() const { return rows; }
+    size_t bytes() const { return rows * sizeof(Row); }
+
+    /// Call f(const Row * rows, size_t count) for every chunk of at most BUFFER_ROWS rows, in the order they were appended.
+    template <typename F>
+    void forEachChunk(F && f) const
+    {
+        auto chunk = std::make_unique<char[]>(BUFFER_ROWS * sizeof(Row));
+        for (size_t begin = 0; begin < rows; begin += BUFFER_ROWS)
+        {
+            size_t count = std::min(BUFFER_ROWS, rows - begin);
+            read(chunk.get(), begin, count);
+            f(reinterpret_cast<const Row *>(chunk.get()), count);
+        }
+    }
+
+    void readAll(std::vector<Row> & res) const
+    {
+        res.clear();
+        res.reserve(rows);
+        forEachChunk([&](const Row * chunk, size_t count) { res.insert(res.end(), chunk, chunk + count); });
+    }
+
+private:
+    void flush()
+    {
+        if (buffered == 0)
+            return;
+        Stopwatch watch;
+        const char * data = buffer.get();
+        size_t len = buffered * sizeof(Row);
+        while (len)
+        {
+            ssize_t res = ::write(fd, data, len);
+            if (res < 0 && errno == EINTR)
+                continue;
+            if (res <= 0)
+            {
+                printf("can't write a spill file: %s\n", strerror(errno));
+                abort();
+            }
+            data += res;
+            len -= res;
+        }
+        stats->bytes_written += buffered * sizeof(Row);
+        stats->write_ns += watch.elapsed();
+        buffered = 0;
+    }
+
+    void read(char * data, size_t begin, size_t count) const
+    {
+        Stopwatch watch;
+        size_t len = count * sizeof(Row);
+        off_t offset = begin * sizeof(Row);
+        while (len)
+        {
+            ssize_t res = pread(fd, data, len, offset);
+            if (res < 0 && errno == EINTR)
+                continue;
+            if (res <= 0)
+            {
+                printf("can't read a spill file: %s\n", res < 0 ? strerror(errno) : "unexpected end of file");
+                abort();
+            }
+            data += res;
+            len -= res;
+            offset += res;
+        }
+        stats->bytes_read += count * sizeof(Row);
+        stats->read_ns += watch.elapsed();
+    }
+
+    SpillStats * stats;
+    int fd = -1;
+    size_t rows = 0;
+    std::unique_ptr<char[]> buffer;
+    size_t buffered = 0;
+};
@@ -16,9 +16,16 @@
 
 #include "Types.h"
 #include "Defines.h"
+#include <cassert>
 #include <ctime>
 
 #include <atomic>
+#include <cstdio>
+
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
 
 inline UInt64 clock_gettime_ns(clockid_t clock_type = CLOCK_MONOTONIC)
 {
@@ -110,3 +117,140 @@ private:
 
     UInt64 nanoseconds() const { return clock_gettime_ns_adjusted(start_ns, clock_type); }
 };
+
+/// Read the time stamp counter. On x86_64 it is the TSC, on AArch64 the generic timer, both tick at a constant rate.
+inline UInt64 rdtsc()
+{
+#if defined(__x86_64__)
+    return __rdtsc();
+#elif defined(__aarch64__)
+    UInt64 val;
+    asm volatile("mrs %0, cntvct_el0" : "=r"(val));
+    return val;
+#else
+    return clock_gettime_ns();
+#endif
+}
+
+/// Whether the TSC rate is independent of frequency scaling and C-states, so cycles are comparable across runs.
+inline bool hasInvariantTSC()
+{
+#if defined(__x86_64__)
+    unsigned eax, ebx, ecx, edx;
+    if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx))
+        return false;
+    return edx & (1U << 8);
+#else
+    return true;
+#endif
+}
+
+/// TSC ticks per nanosecond, calibrated once against CLOCK_MONOTONIC.
+inline double tscTicksPerNanosecond()
+{
+    static const double ticks_per_ns = []
+    {
+        UInt64 start_ns = clock_gettime_ns();
+        UInt64 start_tsc = rdtsc();
+        while (clock_gettime_ns() - start_ns < 20000000)
+            ;
+        UInt64 end_tsc = rdtsc();
+        UInt64 end_ns = clock_gettime_ns();
+        return static_cast<double>(end_tsc - start_tsc) / (end_ns - start_ns);
+    }();
+    return ticks_per_ns;
+}
+
+/** Same interface as Stopwatch, but counts TSC cycles instead of nanoseconds.
+  * Reading the TSC is much cheaper than clock_gettime, so it can also be used inside loops.
+  * NOTE The TSC counts at the nominal frequency, that is not the core clock if turbo or frequency scaling is active.
+  */
+class TscStopwatch
+{
+public:
+    TscStopwatch() { start(); }
+
+    void start()
+    {
+        start_cycles = rdtsc();
+        last_cycles = start_cycles;
+    }
+
+    void restart() { start(); }
+    UInt64 elapsed() const { return rdtsc() - start_cycles; }
+
+    UInt64 elapsedFromLastTime()
+    {
+        const auto now = rdtsc();
+        auto rc = now - last_cycles;
+        last_cycles = now;
+        return rc;
+    }
+
+    static double toNanoseconds(UInt64 cycles) { return cycles / tscTicksPerNanosecond(); }
+
+private:
+    UInt64 start_cycles = 0;
+    UInt64 last_cycles = 0;
+};
+
+/** Log2 histogram of the TSC cycles spent on each batch of BATCH_SIZE consecutive loop iterations.
+  * Call step(i) at the top of the loop body with the iteration number, and finish() right after the loop.
+  */
+class BatchLatencyHistogram
+{
+public:
+    static constexpr size_t BATCH_SIZE = 1024;
+    static constexpr size_t BUCKETS = 64;
+
+    void ALWAYS_INLINE step(size_t i)
+    {
+        if ((i & (BATCH_SIZE - 1)) == 0)
+            mark();
+    }
+
+    void finish() { mark(); }
+
+    size_t batches() const
+    {
+        size_t res = 0;
+        for (auto c : counts)
+            res += c;
+        return res;
+    }
+
+    /// Upper bound (2^(bucket+1)) of the bucket that contains the given quantile.
+    UInt64 quantile(double level) const
+    {
+        size_t total = batches();
+        size_t seen = 0;
+        for (size_t i = 0; i < BUCKETS; ++i)
+        {
+            seen += counts[i];
+            if (total && seen >= level * total)
+                return 1ULL << (i + 1);
+        }
+        return 0;
+    }
+
+    void print(const char * log_head) const
+    {
+        printf("%s batch latency (cycles per %zu tuples), p50 < %lu, p99 < %lu:", log_head, BATCH_SIZE, quantile(0.5), quantile(0.99));
+        for (size_t i = 0; i < BUCKETS; ++i)
+            if (counts[i])
+                printf(" 2^%zu:%zu", i, counts[i]);
+        printf("\n");
+    }
+
+private:
+    UInt64 last = 0;
+    size_t counts[BUCKETS]{};
+
+    void NO_INLINE mark()
+    {
+        UInt64 now = rdtsc();
+        if (last != 0 && now > last)
+            ++counts[63 - __builtin_clzll(now - last)];
+        last = now;
+    }
+};
@@ -0,0 +1,153 @@
+#pragma once
+
+#include <cstring>
+#include <string>
+
+#include "Arena.h"
+#include "Hash.h"
+#include "HashTable.h"
+
+/// A reference to a piece of memory that is owned by someone else: a column, an Arena or a literal.
+struct StringRef
+{
+    const char * data = nullptr;
+    size_t size = 0;
+
+    StringRef() = default;
+    StringRef(const char * data_, size_t size_)
+        : data(data_)
+        , size(size_)
+    {}
+    StringRef(const std::string & s) /// NOLINT
+        : data(s.data())
+        , size(s.size())
+    {}
+
+    std::string toString() const { return std::string(data, size); }
+};
+
+template <typename T>
+inline T unalignedLoad(const void * address)
+{
+    T res;
+    memcpy(&res, address, sizeof(res));
+    return res;
+}
+
+/** Keys up to 16 bytes are compared with at most two pairs of overlapping loads instead of a call to memcmp,
+  *  most varchar join keys are that short.
+  */
+inline bool operator==(StringRef lhs, StringRef rhs)
+{
+    if (lhs.size != rhs.size)
+        return false;
+
+    size_t size = lhs.size;
+    const char * a = lhs.data;
+    const char * b = rhs.data;
+    if (size <= 16)
+    {
+        if (size >= 8)
+            return unalignedLoad<UInt64>(a) == unalignedLoad<UInt64>(b)
+                && unalignedLoad<UInt64>(a + size - 8) == unalignedLoad<UInt64>(b + size - 8);
+        if (size >= 4)
+            return unalignedLoad<UInt32>(a) == unalignedLoad<UInt32>(b)
+                && unalignedLoad<UInt32>(a + size - 4) == unalignedLoad<UInt32>(b + size - 4);
+        if (size > 0)
+            return a[0] == b[0] && a[size / 2] == b[size / 2] && a[size - 1] == b[size - 1];
+        return true;
+    }
+    return 0 == memcmp(a, b, size);
+}
+
+inline bool operator!=(StringRef lhs, StringRef rhs)
+{
+    return !(lhs == rhs);
+}
+
+/// The empty string is the zero key, the hash table keeps it out of the buffer.
+namespace ZeroTraits
+{
+template <>
+inline bool check<StringRef>(const StringRef & x)
+{
+    return 0 == x.size;
+}
+
+template <>
+inline void set<StringRef>(StringRef & x)
+{
+    x.size = 0;
+}
+} // namespace ZeroTraits
+
+/// CRC32C over 8-byte words, the last word overlaps the previous one. Shorter strings are read as one zero-padded word.
+inline size_t hashStringCRC32(const char * data, size_t size)
+{
+    UInt64 crc = -1ULL;
+    if (size >= 8)
+    {
+        const char * end = data + size;
+        for (; data + 8 < end; data += 8)
+            crc = updateCRC32(crc, unalignedLoad<UInt64>(data));
+        crc = updateCRC32(crc, unalignedLoad<UInt64>(end - 8));
+    }
+    else if (size > 0)
+    {
+        UInt64 word = 0;
+        if (size >= 4)
+            word = unalignedLoad<UInt32>(data) | (static_cast<UInt64>(unalignedLoad<UInt32>(data + size - 4)) << 32);
+        else
+            word = static_cast<UInt8>(data[0]) | (static_cast<UInt8>(data[size / 2]) << 8) | (static_cast<UInt8>(data[size - 1]) << 16);
+        crc = updateCRC32(crc, word);
+    }
+    return updateCRC32(crc, size);
+}
+
+struct StringRefHash
+{
+    size_t operator()(StringRef x) const { return hashStringCRC32(x.data, x.size); }
+};
+
+/** Key holders for HashTable::emplace, see keyHolderGetKey in HashTable.h.
+  * ArenaKeyHolder copies a key that lives elsewhere (e.g. in a column) into the Arena once it is inserted.
+  * SerializedKeyHolder holds a key that was just serialized into the Arena and gives the memory back if it is a duplicate.
+  */
+struct ArenaKeyHolder
+{
+    StringRef key;
+    Arena & pool;
+};
+
+inline StringRef & ALWAYS_INLINE keyHolderGetKey(ArenaKeyHolder & holder)
+{
+    return holder.key;
+}
+
+inline void ALWAYS_INLINE keyHolderPersistKey(ArenaKeyHolder & holder)
+{
+    if (holder.key.size)
+        holder.key.data = holder.pool.insert(holder.key.data, holder.key.size);
+}
+
+inline void ALWAYS_INLINE keyHolderDiscardKey(ArenaKeyHolder &)
+{}
+
+struct SerializedKeyHolder
+{
+    StringRef key;
+    Arena & pool;
+};
+
+inline StringRef & ALWAYS_INLINE keyHolderGetKey(SerializedKeyHolder & holder)
+{
+    return holder.key;
+}
+
+inline void ALWAYS_INLINE keyHolderPersistKey(SerializedKeyHolder &)
+{}
+
+inline void ALWAYS_INLINE keyHolderDiscardKey(SerializedKeyHolder & holder)
+{
+    holder.pool.rollback(holder.key.size);
+}
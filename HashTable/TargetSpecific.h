@@ -0,0 +1,138 @@
+#pragma once
+
+#include <string>
+
+#include "Defines.h"
+#include "Types.h"
+
+/** Runtime CPU dispatch.
+  *
+  * The build doesn't pass -march, so the code outside of the blocks below can only use the baseline instruction set.
+  * Kernels that profit from newer instructions are compiled once per target with TIFLASH_DECLARE_MULTITARGET_CODE,
+  *  each copy lands in its own namespace TargetSpecific::<Arch>, and the caller picks the copy for `target_arch`,
+  *  which is the best target the host supports unless overridden with --arch.
+  *
+  * Example:
+  *   TIFLASH_DECLARE_MULTITARGET_CODE(
+  *   inline void kernel(...) { ... }
+  *   )
+  *   if (target_arch == TargetArch::AVX2) TargetSpecific::AVX2::kernel(...); else ...
+  */
+enum class TargetArch : UInt8
+{
+    Default,
+    SSE42,
+    AVX2,
+    AVX512,
+};
+
+inline const char * toString(TargetArch arch)
+{
+    switch (arch)
+    {
+        case TargetArch::Default: return "default";
+        case TargetArch::SSE42: return "sse42";
+        case TargetArch::AVX2: return "avx2";
+        case TargetArch::AVX512: return "avx512";
+    }
+    return "unknown";
+}
+
+inline bool parseTargetArch(const std::string & name, TargetArch & arch)
+{
+    if (name == "default")
+        arch = TargetArch::Default;
+    else if (name == "sse42")
+        arch = TargetArch::SSE42;
+    else if (name == "avx2")
+        arch = TargetArch::AVX2;
+    else if (name == "avx512")
+        arch = TargetArch::AVX512;
+    else
+        return false;
+    return true;
+}
+
+/// Every target includes the previous ones, so a host that supports a target supports all smaller ones.
+inline bool isArchSupported(TargetArch arch)
+{
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    switch (arch)
+    {
+        case TargetArch::Default: return true;
+        case TargetArch::SSE42: return __builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("popcnt");
+        case TargetArch::AVX2: return isArchSupported(TargetArch::SSE42) && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("bmi2");
+        case TargetArch::AVX512:
+            return isArchSupported(TargetArch::AVX2) && __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")
+                && __builtin_cpu_supports("avx512vl") && __builtin_cpu_supports("avx512dq");
+    }
+    return false;
+#else
+    return arch == TargetArch::Default;
+#endif
+}
+
+inline TargetArch detectTargetArch()
+{
+    for (auto arch : {TargetArch::AVX512, TargetArch::AVX2, TargetArch::SSE42})
+    {
+        if (isArchSupported(arch))
+            return arch;
+    }
+    return TargetArch::Default;
+}
+
+/// The target the dispatched kernels use.
+inline TargetArch target_arch = detectTargetArch();
+
+// clang-format off
+#if defined(__x86_64__)
+
+#define TIFLASH_SSE42_TARGET_STRING "sse,sse2,sse3,ssse3,sse4,popcnt"
+#define TIFLASH_AVX2_TARGET_STRING "sse,sse2,sse3,ssse3,sse4,popcnt,avx,avx2,bmi,bmi2,lzcnt,fma"
+#define TIFLASH_AVX512_TARGET_STRING "sse,sse2,sse3,ssse3,sse4,popcnt,avx,avx2,bmi,bmi2,lzcnt,fma,avx512f,avx512bw,avx512vl,avx512dq"
+
+#if defined(__clang__)
+#define TIFLASH_BEGIN_TARGET_SPECIFIC_CODE(TARGET) _Pragma(TIFLASH_MACRO_STRINGIFY(clang attribute push(__attribute__((target(TARGET))), apply_to = function)))
+#define TIFLASH_END_TARGET_SPECIFIC_CODE _Pragma("clang attribute pop")
+#else
+#define TIFLASH_BEGIN_TARGET_SPECIFIC_CODE(TARGET) _Pragma("GCC push_options") _Pragma(TIFLASH_MACRO_STRINGIFY(GCC target(TARGET)))
+#define TIFLASH_END_TARGET_SPECIFIC_CODE _Pragma("GCC pop_options")
+#endif
+
+#define TIFLASH_MACRO_STRINGIFY(...) #__VA_ARGS__
+
+#define TIFLASH_DECLARE_TARGET_SPECIFIC_CODE(TARGET, NAME, ...) \
+    TIFLASH_BEGIN_TARGET_SPECIFIC_CODE(TARGET)                  \
+    namespace TargetSpecific::NAME                              \
+    {                                                           \
+    TIFLASH_DUMMY_FUNCTION_DEFINITION                           \
+    __VA_ARGS__                                                 \
+    }                                                           \
+    TIFLASH_END_TARGET_SPECIFIC_CODE
+
+#define TIFLASH_DECLARE_SSE42_SPECIFIC_CODE(...) TIFLASH_DECLARE_TARGET_SPECIFIC_CODE(TIFLASH_SSE42_TARGET_STRING, SSE42, __VA_ARGS__)
+#define TIFLASH_DECLARE_AVX2_SPECIFIC_CODE(...) TIFLASH_DECLARE_TARGET_SPECIFIC_CODE(TIFLASH_AVX2_TARGET_STRING, AVX2, __VA_ARGS__)
+#define TIFLASH_DECLARE_AVX512_SPECIFIC_CODE(...) TIFLASH_DECLARE_TARGET_SPECIFIC_CODE(TIFLASH_AVX512_TARGET_STRING, AVX512, __VA_ARGS__)
+
+#else
+
+#define TIFLASH_DECLARE_SSE42_SPECIFIC_CODE(...)
+#define TIFLASH_DECLARE_AVX2_SPECIFIC_CODE(...)
+#define TIFLASH_DECLARE_AVX512_SPECIFIC_CODE(...)
+
+#endif
+
+#define TIFLASH_DECLARE_DEFAULT_CODE(...) \
+    namespace TargetSpecific::Default     \
+    {                                     \
+    __VA_ARGS__                           \
+    }
+
+#define TIFLASH_DECLARE_MULTITARGET_CODE(...)        \
+    TIFLASH_DECLARE_DEFAULT_CODE(__VA_ARGS__)        \
+    TIFLASH_DECLARE_SSE42_SPECIFIC_CODE(__VA_ARGS__) \
+    TIFLASH_DECLARE_AVX2_SPECIFIC_CODE(__VA_ARGS__)  \
+    TIFLASH_DECLARE_AVX512_SPECIFIC_CODE(__VA_ARGS__)
+// clang-format on
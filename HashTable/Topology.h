@@ -0,0 +1,302 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include <pthread.h>
+#include <sched.h>
+
+#include "CacheControl.h"
+#include "Types.h"
+
+/// A cpu list of sysfs, e.g. "0-3,8,10-11".
+inline std::vector<size_t> parseCpuList(const std::string & str)
+{
+    std::vector<size_t> res;
+    const char * p = str.c_str();
+    while (*p)
+    {
+        size_t first = 0;
+        size_t last = 0;
+        int consumed = 0;
+        if (sscanf(p, "%zu-%zu%n", &first, &last, &consumed) == 2)
+            ;
+        else if (sscanf(p, "%zu%n", &first, &consumed) == 1)
+            last = first;
+        else
+            break;
+        for (size_t cpu = first; cpu <= last; ++cpu)
+            res.push_back(cpu);
+        p += consumed;
+        if (*p == ',')
+            ++p;
+    }
+    return res;
+}
+
+/// Where to pin the join workers, --pin.
+enum class PinPolicy
+{
+    /// Leave the placement to the OS.
+    None,
+    /// One hardware thread of every physical core first, the SMT siblings only when the cores run out.
+    Cores,
+    /// Fill both hardware threads of a core before the next core, so pairs of workers share an L1 and L2.
+    Smt,
+};
+
+inline const char * toString(PinPolicy policy)
+{
+    switch (policy)
+    {
+        case PinPolicy::None: return "none";
+        case PinPolicy::Cores: return "cores";
+        case PinPolicy::Smt: return "smt";
+    }
+    return "unknown";
+}
+
+inline bool parsePinPolicy(const std::string & name, PinPolicy & policy)
+{
+    for (auto p : {PinPolicy::None, PinPolicy::Cores, PinPolicy::Smt})
+    {
+        if (name == toString(p))
+        {
+            policy = p;
+            return true;
+        }
+    }
+    return false;
+}
+
+struct LogicalCpu
+{
+    size_t cpu = 0;
+    size_t package = 0;
+    /// core_id of sysfs, only unique within the package.
+    size_t core = 0;
+    /// Index of the cpu among the hardware threads of its core.
+    size_t smt = 0;
+    /// Index into CpuTopology::llcGroups().
+    size_t llc_group = 0;
+    size_t node = 0;
+};
+
+/// The cpus that share one last level cache.
+struct LLCGroup
+{
+    size_t size = 0;
+    std::vector<size_t> cpus;
+};
+
+/** The cpus this process may run on, read from /sys/devices/system/cpu, with their cores, SMT siblings,
+  *  LLC sharing groups and NUMA nodes. Without sysfs every cpu is its own core and all share one LLC of detectLLCSize().
+  */
+class CpuTopology
+{
+public:
+    /// Detected once, before any worker is pinned, so the affinity mask is the one the process started with.
+    static const CpuTopology & get()
+    {
+        static const CpuTopology topology = detect();
+        return topology;
+    }
+
+    const std::vector<LogicalCpu> & cpus() const { return logical_cpus; }
+    const std::vector<LLCGroup> & llcGroups() const { return llc_groups; }
+
+    size_t physicalCores() const
+    {
+        size_t res = 0;
+        for (const auto & cpu : logical_cpus)
+            res += cpu.smt == 0;
+        return res;
+    }
+
+    /** The cpu of every one of `threads` workers, empty for PinPolicy::None.
+      * Workers with close numbers share an LLC group, the policy decides between spreading over cores and filling SMT siblings.
+      * With more workers than cpus the cpus are reused round robin.
+      */
+    std::vector<size_t> selectCpus(size_t threads, PinPolicy policy) const
+    {
+        if (policy == PinPolicy::None || logical_cpus.empty())
+            return {};
+
+        std::vector<LogicalCpu> order = logical_cpus;
+        std::sort(order.begin(), order.end(), [policy](const LogicalCpu & lhs, const LogicalCpu & rhs)
+        {
+            if (policy == PinPolicy::Cores)
+                return std::tie(lhs.smt, lhs.llc_group, lhs.package, lhs.core, lhs.cpu) < std::tie(rhs.smt, rhs.llc_group, rhs.package, rhs.core, rhs.cpu);
+            return std::tie(lhs.llc_group, lhs.package, lhs.core, lhs.smt, lhs.cpu) < std::tie(rhs.llc_group, rhs.package, rhs.core, rhs.smt, rhs.cpu);
+        });
+
+        std::vector<size_t> res(threads);
+        for (size_t worker = 0; worker < threads; ++worker)
+            res[worker] = order[worker % order.size()].cpu;
+        return res;
+    }
+
+    /// The LLC bytes a worker has to itself when one worker runs on each of `worker_cpus`, the smallest share of all groups.
+    size_t llcBytesPerWorker(const std::vector<size_t> & worker_cpus) const
+    {
+        if (worker_cpus.empty() || llc_groups.empty())
+            return detectLLCSize() / std::max<size_t>(worker_cpus.size(), 1);
+
+        std::vector<size_t> workers(llc_groups.size());
+        for (size_t cpu : worker_cpus)
+            ++workers[groupOf(cpu)];
+        size_t res = 0;
+        for (size_t group = 0; group < llc_groups.size(); ++group)
+        {
+            if (workers[group] == 0)
+                continue;
+            size_t share = llc_groups[group].size / workers[group];
+            res = res ? std::min(res, share) : share;
+        }
+        return res;
+    }
+
+    void print() const
+    {
+        printf("topology %zu cpus, %zu cores, %zu llc groups\n", logical_cpus.size(), physicalCores(), llc_groups.size());
+        for (size_t group = 0; group < llc_groups.size(); ++group)
+        {
+            printf("topology llc %zu size %zu cpus", group, llc_groups[group].size);
+            for (size_t cpu : llc_groups[group].cpus)
+                printf(" %zu", cpu);
+            printf("\n");
+        }
+    }
+
+private:
+    static std::string readLine(const std::string & path)
+    {
+        std::ifstream file(path);
+        std::string line;
+        std::getline(file, line);
+        return line;
+    }
+
+    static size_t readNumber(const std::string & path, size_t default_value)
+    {
+        std::string line = readLine(path);
+        size_t res = default_value;
+        sscanf(line.c_str(), "%zu", &res);
+        return res;
+    }
+
+    static std::vector<size_t> allowedCpus()
+    {
+        std::vector<size_t> res;
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if (sched_getaffinity(0, sizeof(set), &set) == 0)
+        {
+            for (size_t cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+                if (CPU_ISSET(cpu, &set))
+                    res.push_back(cpu);
+        }
+        if (res.empty())
+            res = parseCpuList(readLine("/sys/devices/system/cpu/online"));
+        return res;
+    }
+
+    /// The highest data or unified cache level of a cpu: its size and the cpus that share it.
+    static std::pair<size_t, std::string> lastLevelCache(size_t cpu)
+    {
+        size_t best_level = 0;
+        std::pair<size_t, std::string> res{detectLLCSize(), ""};
+        for (size_t index = 0;; ++index)
+        {
+            std::string dir = "/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/cache/index" + std::to_string(index);
+            std::string level = readLine(dir + "/level");
+            if (level.empty())
+                break;
+            if (readLine(dir + "/type") == "Instruction")
+                continue;
+            size_t level_value = std::stoul(level);
+            if (level_value > best_level)
+            {
+                best_level = level_value;
+                res = {parseCacheSize(readLine(dir + "/size")), readLine(dir + "/shared_cpu_list")};
+            }
+        }
+        return res;
+    }
+
+    static CpuTopology detect()
+    {
+        CpuTopology res;
+        std::map<size_t, size_t> node_of_cpu;
+        for (size_t node = 0;; ++node)
+        {
+            std::string list = readLine("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+            if (list.empty())
+                break;
+            for (size_t cpu : parseCpuList(list))
+                node_of_cpu[cpu] = node;
+        }
+
+        std::map<std::string, size_t> group_of_list;
+        for (size_t cpu : allowedCpus())
+        {
+            std::string dir = "/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/topology";
+            LogicalCpu info;
+            info.cpu = cpu;
+            info.package = readNumber(dir + "/physical_package_id", 0);
+            info.core = readNumber(dir + "/core_id", cpu);
+            auto siblings = parseCpuList(readLine(dir + "/thread_siblings_list"));
+            info.smt = std::find(siblings.begin(), siblings.end(), cpu) - siblings.begin();
+            if (info.smt == siblings.size())
+                info.smt = 0;
+            info.node = node_of_cpu.count(cpu) ? node_of_cpu[cpu] : 0;
+
+            auto [llc_size, shared_list] = lastLevelCache(cpu);
+            auto [it, inserted] = group_of_list.try_emplace(shared_list, res.llc_groups.size());
+            if (inserted)
+                res.llc_groups.push_back({llc_size, {}});
+            info.llc_group = it->second;
+            res.llc_groups[info.llc_group].cpus.push_back(cpu);
+
+            res.logical_cpus.push_back(info);
+        }
+        return res;
+    }
+
+    size_t groupOf(size_t cpu) const
+    {
+        for (const auto & info : logical_cpus)
+            if (info.cpu == cpu)
+                return info.llc_group;
+        return 0;
+    }
+
+    std::vector<LogicalCpu> logical_cpus;
+    std::vector<LLCGroup> llc_groups;
+};
+
+/// Placement of the join workers, --pin.
+inline PinPolicy pin_policy = PinPolicy::None;
+
+inline bool pinCurrentThread(size_t cpu)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+/// Pin the calling thread as worker `worker` of `threads` by `pin_policy`. Nothing happens with PinPolicy::None.
+inline void pinWorker(size_t worker, size_t threads)
+{
+    if (pin_policy == PinPolicy::None)
+        return;
+    auto cpus = CpuTopology::get().selectCpus(threads, pin_policy);
+    if (!cpus.empty())
+        pinCurrentThread(cpus[worker]);
+}
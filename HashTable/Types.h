@@ -1,5 +1,7 @@
 #pragma once
 
+#include <cstdint>
+
 using Int8 = int8_t;
 using Int16 = int16_t;
 using Int32 = int32_t;
@@ -0,0 +1,220 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Defines.h"
+#include "Stopwatch.h"
+#include "Topology.h"
+#include "Types.h"
+
+/// How the rows of a parallel loop are given to the threads.
+enum class Schedule
+{
+    /// One contiguous range per thread, as parallelFor.
+    Static,
+    /// Morsels from per-worker deques, idle workers steal.
+    Stealing,
+};
+
+inline const char * toString(Schedule schedule)
+{
+    return schedule == Schedule::Static ? "static" : "steal";
+}
+
+inline bool parseSchedule(const std::string & name, Schedule & schedule)
+{
+    if (name == "static")
+        schedule = Schedule::Static;
+    else if (name == "steal")
+        schedule = Schedule::Stealing;
+    else
+        return false;
+    return true;
+}
+
+/// What one worker of a parallel loop did. Idle is the wall time of the loop minus busy: stealing, and waiting for the others.
+struct WorkerStats
+{
+    UInt64 busy_ns = 0;
+    UInt64 idle_ns = 0;
+    size_t morsels = 0;
+    size_t steals = 0;
+};
+
+/** Runs f(worker, begin, end) over [0, size) on `threads` workers.
+  *
+  * Every worker starts with its contiguous share of the rows in its own deque, as a static split would give it.
+  * A worker takes the newest morsel from the back of its deque. While the morsel is bigger than `grain` rows,
+  *  it pushes the upper half back and keeps the lower half, so the deque holds halves of decreasing size
+  *  and the worker itself goes through its rows in order.
+  * A worker with an empty deque steals the oldest, i.e. the biggest, morsel from the front of another worker's deque.
+  * So with skewed rows, e.g. probe rows that walk long chains, the workers that are done early take over the rest
+  *  of the slow ones in big pieces, instead of waiting at the end of the loop.
+  *
+  * The deques are guarded by a mutex each: the owner and a thief only meet on the same deque when it runs low.
+  * The calling thread is the last worker. Workers are pinned by `pin_policy`.
+  */
+class WorkStealingScheduler
+{
+public:
+    static constexpr size_t DEFAULT_GRAIN = 1024;
+
+    explicit WorkStealingScheduler(size_t threads_, size_t grain_ = DEFAULT_GRAIN)
+        : threads(std::max<size_t>(threads_, 1))
+        , grain(std::max<size_t>(grain_, 1))
+        , workers(threads)
+    {}
+
+    template <typename F>
+    const std::vector<WorkerStats> & run(Schedule schedule, size_t size, F && f)
+    {
+        for (size_t worker = 0; worker < threads; ++worker)
+        {
+            workers[worker].stats = {};
+            workers[worker].deque.clear();
+            size_t begin = size * worker / threads;
+            size_t end = size * (worker + 1) / threads;
+            if (begin < end)
+                workers[worker].deque.push_back({begin, end});
+        }
+        remaining.store(size, std::memory_order_relaxed);
+
+        Stopwatch watch;
+        auto work = [&](size_t worker) {
+            pinWorker(worker, threads);
+            if (schedule == Schedule::Static)
+                runStatic(worker, f);
+            else
+                runStealing(worker, f);
+        };
+        std::vector<std::thread> pool;
+        pool.reserve(threads - 1);
+        for (size_t worker = 0; worker + 1 < threads; ++worker)
+            pool.emplace_back(work, worker);
+        work(threads - 1);
+        for (auto & t : pool)
+            t.join();
+        UInt64 total_ns = watch.elapsed();
+
+        stats.resize(threads);
+        for (size_t worker = 0; worker < threads; ++worker)
+        {
+            stats[worker] = workers[worker].stats;
+            stats[worker].idle_ns = total_ns > stats[worker].busy_ns ? total_ns - stats[worker].busy_ns : 0;
+        }
+        return stats;
+    }
+
+private:
+    struct Morsel
+    {
+        size_t begin;
+        size_t end;
+    };
+
+    struct alignas(64) Worker
+    {
+        std::mutex mutex;
+        std::deque<Morsel> deque;
+        WorkerStats stats;
+    };
+
+    template <typename F>
+    void runMorsel(size_t worker, Morsel morsel, F & f)
+    {
+        Stopwatch watch;
+        f(worker, morsel.begin, morsel.end);
+        workers[worker].stats.busy_ns += watch.elapsed();
+        ++workers[worker].stats.morsels;
+    }
+
+    template <typename F>
+    void runStatic(size_t worker, F & f)
+    {
+        for (const auto & morsel : workers[worker].deque)
+            runMorsel(worker, morsel, f);
+    }
+
+    template <typename F>
+    void runStealing(size_t worker, F & f)
+    {
+        Morsel morsel;
+        while (remaining.load(std::memory_order_acquire) > 0)
+        {
+            if (!pop(worker, morsel) && !steal(worker, morsel))
+            {
+                std::this_thread::yield();
+                continue;
+            }
+            while (morsel.end - morsel.begin > grain)
+            {
+                size_t middle = morsel.begin + (morsel.end - morsel.begin) / 2;
+                push(worker, {middle, morsel.end});
+                morsel.end = middle;
+            }
+            runMorsel(worker, morsel, f);
+            remaining.fetch_sub(morsel.end - morsel.begin, std::memory_order_release);
+        }
+    }
+
+    void push(size_t worker, Morsel morsel)
+    {
+        std::lock_guard lock(workers[worker].mutex);
+        workers[worker].deque.push_back(morsel);
+    }
+
+    bool pop(size_t worker, Morsel & morsel)
+    {
+        std::lock_guard lock(workers[worker].mutex);
+        auto & deque = workers[worker].deque;
+        if (deque.empty())
+            return false;
+        morsel = deque.back();
+        deque.pop_back();
+        return true;
+    }
+
+    bool steal(size_t thief, Morsel & morsel)
+    {
+        for (size_t i = 1; i < threads; ++i)
+        {
+            auto & victim = workers[(thief + i) % threads];
+            std::lock_guard lock(victim.mutex);
+            if (victim.deque.empty())
+                continue;
+            morsel = victim.deque.front();
+            victim.deque.pop_front();
+            ++workers[thief].stats.steals;
+            return true;
+        }
+        return false;
+    }
+
+    const size_t threads;
+    const size_t grain;
+    std::vector<Worker> workers;
+    std::vector<WorkerStats> stats;
+    std::atomic<size_t> remaining{0};
+};
+
+/// One line per worker and the spread of the busy times, the imbalance a static split would leave is max / avg.
+inline void printWorkerStats(const std::string & log_head, const std::vector<WorkerStats> & stats)
+{
+    UInt64 max_busy = 0;
+    UInt64 total_busy = 0;
+    for (size_t worker = 0; worker < stats.size(); ++worker)
+    {
+        const auto & s = stats[worker];
+        printf("%s worker %zu busy %lu idle %lu morsels %zu steals %zu\n", log_head.c_str(), worker, s.busy_ns, s.idle_ns, s.morsels, s.steals);
+        max_busy = std::max(max_busy, s.busy_ns);
+        total_busy += s.busy_ns;
+    }
+    if (!stats.empty() && total_busy)
+        printf("%s busy max/avg %.2f\n", log_head.c_str(), static_cast<double>(max_busy) * stats.size() / total_busy);
+}
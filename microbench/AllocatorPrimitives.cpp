@@ -0,0 +1,77 @@
+#include <memory>
+
+#include "HashTable/Arena.h"
+#include "microbench/MicroBench.h"
+
+void benchArenaAlloc(size_t ops, size_t bytes)
+{
+    std::unique_ptr<Arena> arena;
+    UInt64 time = measure(
+        [&] { arena = std::make_unique<Arena>(); },
+        [&]
+        {
+            for (size_t i = 0; i < ops; ++i)
+                doNotOptimize(arena->alloc(bytes));
+        });
+
+    char name[64];
+    snprintf(name, sizeof(name), "Arena::alloc(%zu)", bytes);
+    report(name, ops, ops, time);
+}
+
+/// Grow buffers of `bytes` to twice their size. The buffers are touched before, so realloc has to keep real pages.
+template <bool clear_memory>
+void benchAllocatorRealloc(size_t bytes)
+{
+    Allocator<clear_memory> allocator;
+    size_t count = std::clamp<size_t>((64 << 20) / bytes, 1, 1024);
+    std::vector<void *> bufs;
+    size_t buf_size = bytes;
+
+    auto free_bufs = [&]
+    {
+        for (void * buf : bufs)
+            allocator.free(buf, buf_size);
+        bufs.clear();
+    };
+
+    UInt64 time = measure(
+        [&]
+        {
+            free_bufs();
+            buf_size = bytes;
+            for (size_t i = 0; i < count; ++i)
+            {
+                void * buf = allocator.alloc(bytes);
+                memset(buf, 1, bytes);
+                bufs.push_back(buf);
+            }
+        },
+        [&]
+        {
+            for (auto & buf : bufs)
+                buf = allocator.realloc(buf, bytes, bytes * 2);
+            buf_size = bytes * 2;
+        });
+    free_bufs();
+
+    char name[64];
+    snprintf(name, sizeof(name), "Allocator<%s>::realloc(%zu->%zu)", clear_memory ? "true" : "false", bytes, bytes * 2);
+    report(name, count, count, time);
+}
+
+int main(int argc, char ** argv)
+{
+    for (size_t size : benchSizes(argc, argv))
+    {
+        for (size_t bytes : {8, 16, 64, 256})
+            benchArenaAlloc(size, bytes);
+    }
+
+    for (size_t bytes : {4UL << 10, 64UL << 10, 1UL << 20, 16UL << 20, 64UL << 20})
+    {
+        benchAllocatorRealloc<false>(bytes);
+        benchAllocatorRealloc<true>(bytes);
+    }
+    return 0;
+}
@@ -0,0 +1,142 @@
+#include <memory>
+#include <string>
+
+#include "HashTable/Column.h"
+#include "microbench/MicroBench.h"
+
+/** Appending the rows of one column to another, per row through the virtual insertData and batched.
+  * The indices are random like the matched build rows of a join, the range is what a probe side copy does.
+  */
+template <typename Column>
+std::unique_ptr<Column> makeSource(size_t size, UInt64 seed)
+{
+    auto column = std::make_unique<Column>();
+    std::mt19937_64 mt(seed);
+    std::string str;
+    for (size_t i = 0; i < size; ++i)
+    {
+        UInt64 value = mt();
+        if constexpr (std::is_same_v<Column, ColumnString>)
+        {
+            str.assign(1 + value % 24, 'a' + value % 26);
+            column->insertData(str.data(), str.size());
+        }
+        else
+            column->insertData(reinterpret_cast<const char *>(&value), sizeof(value));
+    }
+    return column;
+}
+
+template <typename Column>
+void benchColumnAppend(const char * type_name, size_t size)
+{
+    auto src = makeSource<Column>(size, size);
+    std::vector<UInt32> indices(size);
+    std::mt19937_64 mt(size + 1);
+    for (auto & index : indices)
+        index = mt() % size;
+
+    std::unique_ptr<IColumn> dst;
+    auto setup = [&] { dst = std::make_unique<Column>(); };
+    char name[64];
+
+    UInt64 time = measure(setup, [&]
+    {
+        for (UInt32 index : indices)
+        {
+            auto value = src->getDataAt(index);
+            dst->insertData(value.data, value.size);
+        }
+    });
+    snprintf(name, sizeof(name), "%s insertData(indices)", type_name);
+    report(name, size, size, time);
+
+    time = measure(setup, [&] { dst->insertIndicesFrom(*src, indices.data(), indices.size()); });
+    snprintf(name, sizeof(name), "%s insertIndicesFrom", type_name);
+    report(name, size, size, time);
+
+    time = measure(setup, [&]
+    {
+        for (size_t i = 0; i < size; ++i)
+        {
+            auto value = src->getDataAt(i);
+            dst->insertData(value.data, value.size);
+        }
+    });
+    snprintf(name, sizeof(name), "%s insertData(range)", type_name);
+    report(name, size, size, time);
+
+    time = measure(setup, [&] { dst->insertRangeFrom(*src, 0, size); });
+    snprintf(name, sizeof(name), "%s insertRangeFrom", type_name);
+    report(name, size, size, time);
+
+    doNotOptimize(dst->size());
+}
+
+template <typename... Columns>
+std::vector<std::unique_ptr<IColumn>> makeColumns(TypeList<Columns...>)
+{
+    std::vector<std::unique_ptr<IColumn>> columns;
+    (columns.emplace_back(std::make_unique<Columns>()), ...);
+    return columns;
+}
+
+/** One column of every type filled from the same values, row by row through the virtual insertData
+  *  like insertRandom, and column by column with the type resolved once by dispatchColumn.
+  */
+void benchColumnDispatch(size_t size)
+{
+    auto values = randomKeys(size, size);
+    std::vector<std::unique_ptr<IColumn>> columns;
+    auto setup = [&] { columns = makeColumns(ColumnTypes{}); };
+    size_t ops = values.size() * ColumnTypes::size;
+
+    UInt64 time = measure(setup, [&]
+    {
+        for (auto & value : values)
+        {
+            for (auto & column : columns)
+                column->insertData(reinterpret_cast<const char *>(&value), sizeof(value));
+        }
+    });
+    report("insertData per row", values.size(), ops, time);
+
+    time = measure(setup, [&]
+    {
+        for (auto & column : columns)
+        {
+            dispatchColumn(*column, [&](auto & typed)
+            {
+                typed.reserve(values.size());
+                for (auto & value : values)
+                    typed.insertData(reinterpret_cast<const char *>(&value), sizeof(value));
+            });
+        }
+    });
+    report("dispatchColumn per column", values.size(), ops, time);
+
+    std::vector<UInt32> indices(values.size());
+    for (size_t i = 0; i < indices.size(); ++i)
+        indices[i] = (i * 7919) % indices.size();
+    ColumnVector<UInt32> src;
+    src.insertRangeFrom(*columns[2], 0, columns[2]->size());
+    std::unique_ptr<IColumn> dst;
+
+    time = measure([&] { dst = std::make_unique<ColumnVector<Int64>>(); }, [&]
+    {
+        insertIndicesConvert(src, *dst, indices.data(), indices.size());
+    });
+    report("insertIndicesConvert UInt32->Int64", values.size(), values.size(), time);
+}
+
+int main(int argc, char ** argv)
+{
+    for (size_t size : benchSizes(argc, argv))
+    {
+        benchColumnAppend<ColumnVector<UInt32>>("UInt32", size);
+        benchColumnAppend<ColumnVector<UInt64>>("UInt64", size);
+        benchColumnAppend<ColumnString>("String", size);
+        benchColumnDispatch(size);
+    }
+    return 0;
+}
@@ -0,0 +1,83 @@
+#include <thread>
+#include <utility>
+
+#include "HashTable/HashMap.h"
+#include "microbench/MicroBench.h"
+
+/** Many probe threads against one ConcurrentHashMap, the probe phase of a join on a shared table.
+  * The same lookups run with every segment lock: ExclusiveMutex (one mutex for reads and writes, the former locking),
+  *  std::shared_mutex and RWSpinLock, and with one or many segments.
+  */
+static constexpr size_t PROBES_PER_RUN = 1 << 22;
+
+inline std::vector<size_t> threadCounts()
+{
+    size_t max_threads = std::max(1U, std::thread::hardware_concurrency());
+    std::vector<size_t> res;
+    for (size_t threads = 1; threads <= std::max<size_t>(max_threads, 8); threads *= 2)
+        res.push_back(threads);
+    if (res.back() != max_threads && max_threads > 8)
+        res.push_back(max_threads);
+    return res;
+}
+
+template <typename Mutex>
+void benchConcurrentProbe(const char * mutex_name, size_t size, size_t segments, size_t threads)
+{
+    using Map = ConcurrentHashMap<UInt64, UInt64, HashCRC32<UInt64>, HashTableGrower<>, HashTableAllocator, Mutex>;
+    Map map(segments);
+    auto keys = randomKeys(size, size);
+    for (size_t i = 0; i < keys.size(); ++i)
+        map[keys[i]] = i;
+
+    /// Half of the probes hit.
+    std::vector<UInt64> probes(PROBES_PER_RUN);
+    std::mt19937_64 mt(size + 1);
+    for (auto & probe : probes)
+        probe = mt() % 2 ? keys[mt() % keys.size()] : mt() | 1;
+
+    const Map & table = map;
+    std::vector<size_t> found(threads);
+    UInt64 time = measure([] {}, [&]
+    {
+        std::vector<std::thread> pool;
+        for (size_t thread = 0; thread < threads; ++thread)
+        {
+            pool.emplace_back([&, thread]
+            {
+                size_t hits = 0;
+                for (size_t i = thread; i < probes.size(); i += threads)
+                    hits += table.find(probes[i]).first != nullptr;
+                found[thread] = hits;
+            });
+        }
+        for (auto & t : pool)
+            t.join();
+    });
+
+    size_t hits = 0;
+    for (size_t h : found)
+        hits += h;
+    doNotOptimize(hits);
+
+    char name[128];
+    snprintf(name, sizeof(name), "ConcurrentHashMap<%s> find, %zu segments, %zu threads", mutex_name, map.getSegmentSize(), threads);
+    report(name, size, probes.size(), time);
+}
+
+int main(int argc, char ** argv)
+{
+    for (size_t size : benchSizes(argc, argv))
+    {
+        for (size_t segments : {1, 16})
+        {
+            for (size_t threads : threadCounts())
+            {
+                benchConcurrentProbe<ExclusiveMutex>("mutex", size, segments, threads);
+                benchConcurrentProbe<std::shared_mutex>("shared_mutex", size, segments, threads);
+                benchConcurrentProbe<RWSpinLock>("RWSpinLock", size, segments, threads);
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,104 @@
+#include <cmath>
+#include <string>
+
+#include "HashTable/BenchHashJoin.h"
+#include "microbench/MicroBench.h"
+
+static constexpr size_t PARTITION_NUM = 256;
+
+/// Pearson's chi-square of the bucket counts divided by its degrees of freedom, about 1 for a uniform distribution.
+double chiSquare(const std::vector<size_t> & counts, size_t total)
+{
+    double expected = static_cast<double>(total) / counts.size();
+    double sum = 0;
+    for (size_t count : counts)
+        sum += (count - expected) * (count - expected) / expected;
+    return sum / (counts.size() - 1);
+}
+
+/** Speed and quality of one hash policy on one key distribution.
+  * Buckets are selected by the low bits, as in TestChained, and partitions by the upper half of the low 32 bits, as in partition().
+  */
+template <typename HashMethod>
+void benchHash(const char * hash_name, const char * dist_name, const std::vector<UInt64> & keys)
+{
+    auto hash_method = HashMethod();
+
+    size_t sum = 0;
+    UInt64 time = measure(
+        [&] { sum = 0; },
+        [&]
+        {
+            for (auto key : keys)
+                sum += hash_method(key);
+        });
+    doNotOptimize(sum);
+
+    size_t head_size = 1 << (static_cast<size_t>(log2(keys.size() - 1)) + 2);
+    std::vector<size_t> buckets(head_size);
+    std::vector<size_t> partitions(PARTITION_NUM);
+    for (auto key : keys)
+    {
+        size_t hash = hash_method(key);
+        ++buckets[hash & (head_size - 1)];
+        ++partitions[(static_cast<uint32_t>(hash) * PARTITION_NUM) >> 32];
+    }
+
+    printf("%s %s size %zu time %lu Mhashes/s %.1f bucket_chi2 %.3f partition_chi2 %.3f\n",
+           hash_name, dist_name, keys.size(), time, time ? keys.size() * 1000.0 / time : 0.0,
+           chiSquare(buckets, keys.size()), chiSquare(partitions, keys.size()));
+}
+
+/// Throughput of the batch kernel of HashMethod compiled for one target, checked against the scalar policy.
+template <typename HashMethod>
+void benchHashBatch(const char * hash_name, HashBatchFunction hash_batch, TargetArch arch, const std::vector<UInt64> & keys)
+{
+    std::vector<size_t> hashes(keys.size());
+    UInt64 time = measure([] {}, [&] { hash_batch(keys.data(), sizeof(UInt64), keys.size(), hashes.data()); });
+
+    auto hash_method = HashMethod();
+    size_t mismatch = 0;
+    for (size_t i = 0; i < keys.size(); ++i)
+        mismatch += hashes[i] != hash_method(keys[i]);
+
+    printf("%s_batch_%s build size %zu time %lu Mhashes/s %.1f%s\n",
+           hash_name, toString(arch), keys.size(), time, time ? keys.size() * 1000.0 / time : 0.0, mismatch ? " MISMATCH" : "");
+}
+
+template <typename HashMethod>
+void benchHashOnAll(const char * hash_name, const std::vector<UInt64> & build, const std::vector<UInt64> & probe, const std::vector<UInt64> & sequential)
+{
+    benchHash<HashMethod>(hash_name, "build", build);
+    benchHash<HashMethod>(hash_name, "probe", probe);
+    benchHash<HashMethod>(hash_name, "sequential", sequential);
+}
+
+int main(int argc, char ** argv)
+{
+    for (size_t size : benchSizes(argc, argv))
+    {
+        /// The same generator init() feeds to the joins, half of the probe keys match.
+        auto [build_kv, probe_kv] = generate<0, 0>(size, size, 50, 1);
+        std::vector<UInt64> build, probe, sequential;
+        for (const auto & kv : build_kv)
+            build.push_back(kv.key);
+        for (const auto & kv : probe_kv)
+            probe.push_back(kv.key);
+        for (size_t i = 1; i <= size; ++i)
+            sequential.push_back(i);
+
+        benchHashOnAll<HashCRC32<uint64_t>>("crc32", build, probe, sequential);
+        benchHashOnAll<HashIntHash64>("murmur", build, probe, sequential);
+        benchHashOnAll<HashMultiplyShift>("mulshift", build, probe, sequential);
+        benchHashOnAll<HashMul128Fold>("mul128", build, probe, sequential);
+
+        for (auto arch : {TargetArch::Default, TargetArch::SSE42, TargetArch::AVX2, TargetArch::AVX512})
+        {
+            if (!isArchSupported(arch))
+                continue;
+            benchHashBatch<HashCRC32<uint64_t>>("crc32", hashCRC32BatchFunction(arch), arch, build);
+            benchHashBatch<HashMultiplyShift>("mulshift", hashMultiplyShiftBatchFunction(arch), arch, build);
+        }
+    }
+    return 0;
+}
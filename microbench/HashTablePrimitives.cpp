@@ -0,0 +1,109 @@
+#include <memory>
+
+#include "HashTable/Hash.h"
+#include "HashTable/HashMap.h"
+#include "microbench/MicroBench.h"
+
+using Map = HashMap<UInt64, UInt64, HashCRC32<UInt64>>;
+
+/// Insert into a table that is already large enough, so no resize happens while timing.
+void benchEmplace(const std::vector<UInt64> & keys)
+{
+    std::unique_ptr<Map> map;
+    UInt64 time = measure(
+        [&] { map = std::make_unique<Map>(keys.size()); },
+        [&]
+        {
+            for (auto key : keys)
+            {
+                Map::LookupResult it;
+                bool inserted;
+                map->emplace(key, it, inserted);
+                if (inserted)
+                    new (&it->getMapped()) UInt64(key);
+            }
+        });
+    report("emplace", keys.size(), keys.size(), time);
+}
+
+void benchFind(const Map & map, const std::vector<UInt64> & probe, const char * name)
+{
+    size_t found = 0;
+    UInt64 time = measure(
+        [&] { found = 0; },
+        [&]
+        {
+            for (auto key : probe)
+                found += map.find(key) != nullptr;
+        });
+    doNotOptimize(found);
+    report(name, map.size(), probe.size(), time);
+}
+
+/// The same access pattern as the probe loop of TestLinearPrefetch.
+void benchPrefetchFind(Map & map, const std::vector<UInt64> & probe)
+{
+    const size_t PREFETCH = 16;
+    size_t found = 0;
+    UInt64 time = measure(
+        [&] { found = 0; },
+        [&]
+        {
+            size_t size = probe.size();
+            size_t hashes[PREFETCH];
+            for (size_t i = 0; i < PREFETCH && i < size; ++i)
+                hashes[i] = map.hash(probe[i]);
+            for (size_t i = 0; i < size; ++i)
+            {
+                size_t pos = i % PREFETCH;
+                size_t hash_value = hashes[pos];
+                if (i + PREFETCH < size)
+                {
+                    hashes[pos] = map.hash(probe[i + PREFETCH]);
+                    map.prefetch(hashes[pos]);
+                }
+                found += map.find(probe[i], hash_value) != nullptr;
+            }
+        });
+    doNotOptimize(found);
+    report("prefetch+find(hit)", map.size(), probe.size(), time);
+}
+
+/// Double the buffer of a filled table, ns/op is per element moved.
+void benchResize(const std::vector<UInt64> & keys)
+{
+    std::unique_ptr<Map> map;
+    UInt64 time = measure(
+        [&]
+        {
+            map = std::make_unique<Map>();
+            for (auto key : keys)
+                (*map)[key] = key;
+        },
+        [&] { map->reserve(map->bufSize()); });
+    report("resize", keys.size(), keys.size(), time);
+}
+
+int main(int argc, char ** argv)
+{
+    for (size_t size : benchSizes(argc, argv))
+    {
+        auto keys = randomKeys(size, 1);
+        auto miss_keys = randomKeys(size, 2);
+
+        benchEmplace(keys);
+
+        Map map(keys.size());
+        for (auto key : keys)
+            map[key] = key;
+
+        auto hit_keys = keys;
+        std::shuffle(hit_keys.begin(), hit_keys.end(), std::mt19937_64(3));
+
+        benchFind(map, hit_keys, "find(hit)");
+        benchFind(map, miss_keys, "find(miss)");
+        benchPrefetchFind(map, hit_keys);
+        benchResize(keys);
+    }
+    return 0;
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+#include "HashTable/Stopwatch.h"
+
+/** Helpers shared by the microbenchmarks of the hash table primitives.
+  * Every measurement is repeated RUNS times on fresh state and the fastest run is reported,
+  *  so a regression in a primitive shows up as ns/op instead of getting lost in the noise of a whole join.
+  */
+static constexpr size_t RUNS = 3;
+
+/// Table sizes in elements, can be overridden by the positional arguments of the benchmark.
+inline std::vector<size_t> benchSizes(int argc, char ** argv)
+{
+    std::vector<size_t> sizes;
+    for (int i = 1; i < argc; ++i)
+    {
+        size_t size;
+        if (sscanf(argv[i], "%zu", &size) == 1)
+            sizes.push_back(size);
+    }
+    if (sizes.empty())
+        sizes = {1 << 10, 1 << 16, 1 << 20, 1 << 22};
+    return sizes;
+}
+
+inline void report(const char * name, size_t size, size_t ops, UInt64 time)
+{
+    printf("%s size %zu ops %zu time %lu ns/op %.2f\n", name, size, ops, time, ops ? static_cast<double>(time) / ops : 0.0);
+}
+
+/// Run setup() and then body() RUNS times, only body() is timed. Returns the fastest run in nanoseconds.
+template <typename Setup, typename Body>
+UInt64 measure(Setup && setup, Body && body)
+{
+    UInt64 best = UINT64_MAX;
+    for (size_t run = 0; run < RUNS; ++run)
+    {
+        setup();
+        Stopwatch watch;
+        body();
+        best = std::min(best, watch.elapsed());
+    }
+    return best;
+}
+
+/// Distinct non-zero keys in random order.
+inline std::vector<UInt64> randomKeys(size_t size, UInt64 seed)
+{
+    std::mt19937_64 mt(seed);
+    std::vector<UInt64> keys(size);
+    for (auto & key : keys)
+    {
+        do
+        {
+            key = mt();
+        } while (key == 0);
+    }
+    std::sort(keys.begin(), keys.end());
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+    std::shuffle(keys.begin(), keys.end(), mt);
+    return keys;
+}
+
+/// Keep the compiler from discarding a computed value.
+template <typename T>
+inline void doNotOptimize(const T & value)
+{
+    asm volatile("" : : "r,m"(value) : "memory");
+}
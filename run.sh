@@ -2,12 +2,12 @@
 
 oneRun()
 {
-    numactl --cpubind=0 --membind=0 ./build/bench-hash-join $1 $2 100000000 $3 0
+    numactl --cpubind=0 --membind=0 ./build/bench-hash-join $1 $2 100000000 $3 0 --dataset=dataset --seed=1
 }
 
 onePerfRun()
 {
-    perf stat -e L1-dcache-load-misses,L1-dcache-loads,L1-dcache-stores,L1-icache-load-misses,LLC-load-misses,LLC-loads,LLC-store-misses,LLC-stores,branch-load-misses,branch-loads,dTLB-load-misses,dTLB-loads,dTLB-store-misses,dTLB-stores numactl --cpubind=0 --membind=0 ./build/bench-hash-join $1 $2 100000000 $3 0
+    perf stat -e L1-dcache-load-misses,L1-dcache-loads,L1-dcache-stores,L1-icache-load-misses,LLC-load-misses,LLC-loads,LLC-store-misses,LLC-stores,branch-load-misses,branch-loads,dTLB-load-misses,dTLB-loads,dTLB-store-misses,dTLB-stores numactl --cpubind=0 --membind=0 ./build/bench-hash-join $1 $2 100000000 $3 0 --dataset=dataset --seed=1
 }
 
 multipleRun()